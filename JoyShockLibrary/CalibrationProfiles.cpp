@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+// What continuous or automatic calibration had worked out for a controller, so it can pick up where it left off next time it connects
+struct CALIBRATION_PROFILE {
+	float offsetX;
+	float offsetY;
+	float offsetZ;
+	float accelMagnitude;
+	// how many samples the offset is the average of
+	int numSamples;
+	// automatic calibration's confidence in it, 0 to 1
+	float confidence;
+};
+
+// Calibration profiles by controller serial number, kept in a small text file. One line per controller:
+// serial offsetX offsetY offsetZ accelMagnitude numSamples confidence
+// Controllers that aren't connected keep their line, so a file can be shared between sessions with different controllers.
+class CalibrationProfiles {
+public:
+	// replaces whatever's loaded with what's in the file. a missing file is just no profiles yet
+	bool load(const std::string& path) {
+		_profiles.clear();
+		FILE* file = fopen(path.c_str(), "r");
+		if (file == nullptr) {
+			return false;
+		}
+		char line[256];
+		while (fgets(line, sizeof(line), file) != nullptr) {
+			if (line[0] == '#') {
+				continue;
+			}
+			char serial[128];
+			CALIBRATION_PROFILE profile;
+			if (sscanf(line, "%127s %f %f %f %f %d %f", serial, &profile.offsetX, &profile.offsetY, &profile.offsetZ,
+				&profile.accelMagnitude, &profile.numSamples, &profile.confidence) == 7 && profile.numSamples >= 0) {
+				_profiles[serial] = profile;
+			}
+		}
+		fclose(file);
+		return true;
+	}
+
+	bool save(const std::string& path) const {
+		FILE* file = fopen(path.c_str(), "w");
+		if (file == nullptr) {
+			return false;
+		}
+		fprintf(file, "# JoyShockLibrary calibration profiles\n");
+		fprintf(file, "# serial offsetX offsetY offsetZ accelMagnitude numSamples confidence\n");
+		for (const auto& entry : _profiles) {
+			const CALIBRATION_PROFILE& profile = entry.second;
+			fprintf(file, "%s %.9g %.9g %.9g %.9g %d %.9g\n", entry.first.c_str(), profile.offsetX, profile.offsetY, profile.offsetZ,
+				profile.accelMagnitude, profile.numSamples, profile.confidence);
+		}
+		return fclose(file) == 0;
+	}
+
+	bool find(const std::string& serial, CALIBRATION_PROFILE& profile) const {
+		auto found = _profiles.find(serial);
+		if (found == _profiles.end()) {
+			return false;
+		}
+		profile = found->second;
+		return true;
+	}
+
+	void set(const std::string& serial, const CALIBRATION_PROFILE& profile) {
+		_profiles[serial] = profile;
+	}
+
+private:
+	std::map<std::string, CALIBRATION_PROFILE> _profiles;
+};
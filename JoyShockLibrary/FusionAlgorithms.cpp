@@ -0,0 +1,404 @@
+#pragma once
+
+#include "JoyShockLibrary.h"
+#include <cmath>
+
+// Sensor fusion algorithms a device can choose between (JS_FUSION_*).
+// Each one's a policy with the same members as Motion (SensorFusion.cpp, included first), which is the complementary filter:
+// Reset(), Update() with Motion::Update's arguments, GetMotionState(), and Quaternion, Accel and Grav.
+// FusionAlgorithm<Policy> wraps one for a device. The device makes one virtual call per report, for all of its samples and the motion state after them
+// (or, when fusion's lazy, one for everything that's been waiting), and the loop over the samples calls the policy directly, so it's inlined. Code that knows which algorithm it wants can use a policy (or FusionAlgorithm<Policy>) itself and skip even that.
+// All of them keep orientation the way Motion does: local rotations from the gyro, with world up being +y.
+
+// internal. One IMU sample, ready to fuse (or waiting to be, when fusion's lazy)
+typedef struct MOTION_SAMPLE {
+	float gyroX;
+	float gyroY;
+	float gyroZ;
+	float accelX;
+	float accelY;
+	float accelZ;
+	float gravityLength;
+	float deltaTime;
+} MOTION_SAMPLE;
+
+// what the quaternion filters below have in common
+struct QuaternionFusion {
+	Quat Quaternion;
+	Vec Accel;
+	Vec Grav;
+
+	MOTION_STATE GetMotionState() const {
+		MOTION_STATE result = MOTION_STATE();
+		result.quatW = Quaternion.w;
+		result.quatX = Quaternion.x;
+		result.quatY = Quaternion.y;
+		result.quatZ = Quaternion.z;
+		result.accelX = Accel.x;
+		result.accelY = Accel.y;
+		result.accelZ = Accel.z;
+		result.gravX = Grav.x;
+		result.gravY = Grav.y;
+		result.gravZ = Grav.z;
+		return result;
+	}
+
+protected:
+	void ResetOrientation() {
+		Quaternion.Set(1.0f, 0.0f, 0.0f, 0.0f);
+		Accel.Set(0.0f, 0.0f, 0.0f);
+		Grav.Set(0.0f, 0.0f, 0.0f);
+	}
+
+	// world up, in the controller's frame. which way the accelerometer points when it's still
+	Vec LocalUp() const {
+		return Vec(0.0f, 1.0f, 0.0f) * Quaternion.Inverse();
+	}
+
+	// turn at this rate (radians per second, in the controller's frame) for deltaTime. a local rotation, same as Motion::Update.
+	// not with Quat::AngleAxis and Quat::Normalize, though: they get w from cosf and keep it, and cosf of anything under about 0.0007 radians
+	// rounds to 1 in a float. these filters make lots of corrections that small, so they'd all be lost
+	void Turn(const Vec& rate, float deltaTime) {
+		const float rateLength = rate.Length();
+		const float halfAngle = rateLength * deltaTime * 0.5f;
+		if (halfAngle > 0.0f) {
+			const float scale = sinf(halfAngle) / rateLength;
+			Quaternion *= Quat(cosf(halfAngle), rate.x * scale, rate.y * scale, rate.z * scale);
+		}
+		const float length = sqrtf(Quaternion.w * Quaternion.w + Quaternion.x * Quaternion.x + Quaternion.y * Quaternion.y + Quaternion.z * Quaternion.z);
+		if (length > 0.0f) {
+			Quaternion.Set(Quaternion.w / length, Quaternion.x / length, Quaternion.y / length, Quaternion.z / length);
+		}
+	}
+
+	// gravity from the orientation, and acceleration without it, same as Motion::Update
+	void Finish(const Vec& accel, float gravityLength) {
+		Grav = Vec(0.0f, -gravityLength, 0.0f) * Quaternion.Inverse();
+		if (accel.x != 0.0f || accel.y != 0.0f || accel.z != 0.0f) {
+			Accel = accel + Grav;
+		}
+		else {
+			Accel.Set(0.0f, 0.0f, 0.0f);
+		}
+	}
+
+	static Vec GyroRadians(float gyroX, float gyroY, float gyroZ) {
+		return Vec(gyroX, gyroY, gyroZ) * ((float)M_PI / 180.0f);
+	}
+};
+
+// Madgwick's gradient descent filter (IMU only). Every sample steps the orientation down the gradient of the difference between where
+// it thinks up is and where the accelerometer says it is, at a fixed rate beta on top of the gyro's.
+// The gradient's taken with respect to turning the controller, so it's the usual one less the part along the quaternion itself, which normalising throws away anyway.
+// Cheap, and doesn't wait for the controller to be still, so it's pulled about a little by acceleration
+struct MadgwickFusion : QuaternionFusion {
+	// radians per second. Madgwick suggests the gyro's mean error; bigger corrects faster, smaller is steadier
+	float Beta = 0.05f;
+
+	MadgwickFusion() {
+		Reset();
+	}
+
+	void Reset() {
+		ResetOrientation();
+	}
+
+	void Update(float inGyroX, float inGyroY, float inGyroZ, float inAccelX, float inAccelY, float inAccelZ, float gravityLength, float deltaTime) {
+		Vec rate = GyroRadians(inGyroX, inGyroY, inGyroZ);
+		const Vec accel = Vec(inAccelX, inAccelY, inAccelZ);
+		const float accelMagnitude = accel.Length();
+		if (accelMagnitude > 0.0f) {
+			// turning about accel x up takes up towards accel. the gradient's the other way, and it's always a step of 2 beta
+			const Vec error = (accel / accelMagnitude).Cross(LocalUp());
+			const float errorLength = error.Length();
+			if (errorLength > 0.0f) {
+				rate = rate + error * (2.0f * Beta / errorLength);
+			}
+		}
+		Turn(rate, deltaTime);
+		Finish(accel, gravityLength);
+	}
+};
+
+// Mahony's complementary filter (IMU only). The cross product of where it thinks up is and where the accelerometer says it is goes back into the gyro,
+// proportionally and integrated. The integral ends up being the gyro's bias, so it keeps correcting whatever calibration missed
+struct MahonyFusion : QuaternionFusion {
+	// per second
+	float ProportionalGain = 1.0f;
+	float IntegralGain = 0.02f;
+	// in radians per second. it can't run away when it's being shaken about
+	float MaxIntegral = 0.1f;
+	Vec Integral;
+
+	MahonyFusion() {
+		Reset();
+	}
+
+	void Reset() {
+		ResetOrientation();
+		Integral.Set(0.0f, 0.0f, 0.0f);
+	}
+
+	void Update(float inGyroX, float inGyroY, float inGyroZ, float inAccelX, float inAccelY, float inAccelZ, float gravityLength, float deltaTime) {
+		Vec rate = GyroRadians(inGyroX, inGyroY, inGyroZ);
+		const Vec accel = Vec(inAccelX, inAccelY, inAccelZ);
+		const float accelMagnitude = accel.Length();
+		if (accelMagnitude > 0.0f) {
+			const Vec error = (accel / accelMagnitude).Cross(LocalUp());
+			if (deltaTime > 0.0f) {
+				Integral = Integral + error * (IntegralGain * deltaTime);
+				const float integralLength = Integral.Length();
+				if (integralLength > MaxIntegral) {
+					Integral = Integral * (MaxIntegral / integralLength);
+				}
+			}
+			rate = rate + error * ProportionalGain + Integral;
+		}
+		Turn(rate, deltaTime);
+		Finish(accel, gravityLength);
+	}
+};
+
+// just enough 3x3 matrix for the Kalman filter below
+struct Matrix3 {
+	float m[3][3];
+
+	static Matrix3 Diagonal(float value) {
+		Matrix3 result = {};
+		result.m[0][0] = result.m[1][1] = result.m[2][2] = value;
+		return result;
+	}
+
+	// multiplying by this is the cross product with vec
+	static Matrix3 Cross(const Vec& vec) {
+		Matrix3 result = {};
+		result.m[0][1] = -vec.z;
+		result.m[0][2] = vec.y;
+		result.m[1][0] = vec.z;
+		result.m[1][2] = -vec.x;
+		result.m[2][0] = -vec.y;
+		result.m[2][1] = vec.x;
+		return result;
+	}
+
+	Matrix3 Transposed() const {
+		Matrix3 result;
+		for (int row = 0; row < 3; row++) {
+			for (int column = 0; column < 3; column++) {
+				result.m[row][column] = m[column][row];
+			}
+		}
+		return result;
+	}
+
+	// for a symmetric matrix that's positive definite, which is what the Kalman filter's innovation covariance always is
+	Matrix3 Inverse() const {
+		Matrix3 result;
+		result.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+		result.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+		result.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+		result.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+		result.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+		result.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+		result.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+		result.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+		result.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+		const float determinant = m[0][0] * result.m[0][0] + m[0][1] * result.m[1][0] + m[0][2] * result.m[2][0];
+		return result * (1.0f / determinant);
+	}
+
+	Vec operator*(const Vec& vec) const {
+		return Vec(m[0][0] * vec.x + m[0][1] * vec.y + m[0][2] * vec.z,
+			m[1][0] * vec.x + m[1][1] * vec.y + m[1][2] * vec.z,
+			m[2][0] * vec.x + m[2][1] * vec.y + m[2][2] * vec.z);
+	}
+
+	Matrix3 operator*(const Matrix3& other) const {
+		Matrix3 result;
+		for (int row = 0; row < 3; row++) {
+			for (int column = 0; column < 3; column++) {
+				result.m[row][column] = m[row][0] * other.m[0][column] + m[row][1] * other.m[1][column] + m[row][2] * other.m[2][column];
+			}
+		}
+		return result;
+	}
+
+	Matrix3 operator*(float scale) const {
+		Matrix3 result;
+		for (int i = 0; i < 9; i++) {
+			result.m[i / 3][i % 3] = m[i / 3][i % 3] * scale;
+		}
+		return result;
+	}
+
+	Matrix3 operator+(const Matrix3& other) const {
+		Matrix3 result;
+		for (int i = 0; i < 9; i++) {
+			result.m[i / 3][i % 3] = m[i / 3][i % 3] + other.m[i / 3][i % 3];
+		}
+		return result;
+	}
+
+	Matrix3 operator-(const Matrix3& other) const {
+		return *this + other * -1.0f;
+	}
+};
+
+// A small error-state extended Kalman filter. Its state is the orientation and the gyro's bias; the covariance is kept as 3x3 blocks
+// (orientation, orientation-bias, bias), and the accelerometer's direction is the measurement. Acceleration makes the accelerometer less trustworthy,
+// so its noise goes up the further its magnitude is from gravity's. Costs the most, but it's the one to use when calibration can't be trusted,
+// since it learns the bias that's left (all but about the vertical axis, which gravity can't tell it anything about)
+struct BiasKalmanFusion : QuaternionFusion {
+	// radians per second of gyro noise, and how quickly (per root second) its bias can wander
+	float GyroNoise = 0.01f;
+	float BiasDrift = 0.0005f;
+	// accelerometer direction noise, and how much to add for acceleration on top of gravity (per g) and for turning (per radian per second),
+	// since the accelerometer's only worth trusting while the controller's more or less still
+	float AccelNoise = 0.05f;
+	float AccelerationNoise = 2.0f;
+	float TurningNoise = 1.0f;
+	// how unsure it starts: radians of orientation, and radians per second of bias
+	float InitialOrientationError = 0.5f;
+	float InitialBiasError = 0.05f;
+	// radians per second, estimated
+	Vec Bias;
+	Matrix3 OrientationCovariance;
+	Matrix3 CrossCovariance;
+	Matrix3 BiasCovariance;
+
+	BiasKalmanFusion() {
+		Reset();
+	}
+
+	void Reset() {
+		ResetOrientation();
+		Bias.Set(0.0f, 0.0f, 0.0f);
+		OrientationCovariance = Matrix3::Diagonal(InitialOrientationError * InitialOrientationError);
+		CrossCovariance = Matrix3::Diagonal(0.0f);
+		BiasCovariance = Matrix3::Diagonal(InitialBiasError * InitialBiasError);
+	}
+
+	void Update(float inGyroX, float inGyroY, float inGyroZ, float inAccelX, float inAccelY, float inAccelZ, float gravityLength, float deltaTime) {
+		const Vec rate = GyroRadians(inGyroX, inGyroY, inGyroZ) - Bias;
+		const Vec accel = Vec(inAccelX, inAccelY, inAccelZ);
+		if (deltaTime > 0.0f) {
+			Turn(rate, deltaTime);
+			// the orientation error turns with the controller, and bias error adds to it
+			const Matrix3 transition = Matrix3::Diagonal(1.0f) - Matrix3::Cross(rate * deltaTime);
+			const Matrix3 transitionTransposed = transition.Transposed();
+			OrientationCovariance = transition * OrientationCovariance * transitionTransposed
+				- (transition * CrossCovariance + CrossCovariance.Transposed() * transitionTransposed) * deltaTime
+				+ BiasCovariance * (deltaTime * deltaTime)
+				+ Matrix3::Diagonal(GyroNoise * GyroNoise * deltaTime);
+			CrossCovariance = transition * CrossCovariance - BiasCovariance * deltaTime;
+			BiasCovariance = BiasCovariance + Matrix3::Diagonal(BiasDrift * BiasDrift * deltaTime);
+		}
+
+		const float accelMagnitude = accel.Length();
+		if (accelMagnitude > 0.0f) {
+			// the measurement's which way up is. turning by a small error e moves where it thinks up is by up x e
+			const Vec up = LocalUp();
+			const Matrix3 measurement = Matrix3::Cross(up);
+			const Matrix3 measurementTransposed = measurement.Transposed();
+			const float acceleration = accelMagnitude - gravityLength;
+			const float turning = rate.Length();
+			const float noise = AccelNoise * AccelNoise + AccelerationNoise * acceleration * acceleration + TurningNoise * turning * turning;
+			const Matrix3 innovation = measurement * OrientationCovariance * measurementTransposed + Matrix3::Diagonal(noise);
+			const Matrix3 innovationInverse = innovation.Inverse();
+			const Matrix3 orientationGain = OrientationCovariance * measurementTransposed * innovationInverse;
+			const Matrix3 biasGain = CrossCovariance.Transposed() * measurementTransposed * innovationInverse;
+			const Vec residual = accel / accelMagnitude - up;
+			const Vec orientationCorrection = orientationGain * residual;
+			Bias = Bias + biasGain * residual;
+			Turn(orientationCorrection, 1.0f);
+
+			const Matrix3 orientationGainTransposed = orientationGain.Transposed();
+			const Matrix3 biasGainTransposed = biasGain.Transposed();
+			OrientationCovariance = Symmetric(OrientationCovariance - orientationGain * innovation * orientationGainTransposed);
+			CrossCovariance = CrossCovariance - orientationGain * innovation * biasGainTransposed;
+			BiasCovariance = Symmetric(BiasCovariance - biasGain * innovation * biasGainTransposed);
+		}
+		Finish(accel, gravityLength);
+	}
+
+private:
+	// float rounding shouldn't make a covariance lopsided
+	static Matrix3 Symmetric(const Matrix3& matrix) {
+		return (matrix + matrix.Transposed()) * 0.5f;
+	}
+};
+
+// only the complementary filter waits for gravity to hold steady
+template <typename Fusion>
+static inline void set_fusion_gravity_window(Fusion&, float) {}
+
+static inline void set_fusion_gravity_window(Motion& fusion, float seconds) {
+	fusion.Gravity.SetWindowSeconds(seconds);
+}
+
+// a device's sensor fusion, whichever algorithm it is. only ever touched by whoever's fusing (see JoyShock::motion_lock)
+class MotionFusion {
+public:
+	virtual ~MotionFusion() {}
+	virtual void reset() = 0;
+	// samples in order. sampleStates, if it isn't null, gets the motion state right after each one, and finalState, if it isn't null,
+	// the motion state after them all (which is just the current one if there aren't any)
+	virtual void fuse(const MOTION_SAMPLE* samples, int numSamples, MOTION_STATE* sampleStates, MOTION_STATE* finalState) = 0;
+	virtual MOTION_STATE get_motion_state() = 0;
+	// carry on from where another algorithm got to. only the orientation, gravity and acceleration: nothing else means the same thing to all of them
+	virtual void set_motion_state(const MOTION_STATE& state) = 0;
+	virtual void set_gravity_window(float seconds) = 0;
+};
+
+template <typename Fusion>
+class FusionAlgorithm : public MotionFusion {
+public:
+	Fusion fusion;
+
+	void reset() override {
+		fusion.Reset();
+	}
+
+	void fuse(const MOTION_SAMPLE* samples, int numSamples, MOTION_STATE* sampleStates, MOTION_STATE* finalState) override {
+		for (int i = 0; i < numSamples; i++) {
+			const MOTION_SAMPLE& sample = samples[i];
+			fusion.Update(sample.gyroX, sample.gyroY, sample.gyroZ, sample.accelX, sample.accelY, sample.accelZ, sample.gravityLength, sample.deltaTime);
+			if (sampleStates != nullptr) {
+				sampleStates[i] = fusion.GetMotionState();
+			}
+		}
+		if (finalState != nullptr) {
+			*finalState = fusion.GetMotionState();
+		}
+	}
+
+	MOTION_STATE get_motion_state() override {
+		return fusion.GetMotionState();
+	}
+
+	void set_motion_state(const MOTION_STATE& state) override {
+		fusion.Quaternion.Set(state.quatW, state.quatX, state.quatY, state.quatZ);
+		fusion.Accel.Set(state.accelX, state.accelY, state.accelZ);
+		fusion.Grav.Set(state.gravX, state.gravY, state.gravZ);
+	}
+
+	void set_gravity_window(float seconds) override {
+		set_fusion_gravity_window(fusion, seconds);
+	}
+};
+
+// a new instance of the given algorithm (JS_FUSION_*), or nullptr if there's no such algorithm
+static MotionFusion* make_motion_fusion(int algorithm) {
+	switch (algorithm) {
+	case JS_FUSION_COMPLEMENTARY:
+		return new FusionAlgorithm<Motion>();
+	case JS_FUSION_MADGWICK:
+		return new FusionAlgorithm<MadgwickFusion>();
+	case JS_FUSION_MAHONY:
+		return new FusionAlgorithm<MahonyFusion>();
+	case JS_FUSION_KALMAN:
+		return new FusionAlgorithm<BiasKalmanFusion>();
+	default:
+		return nullptr;
+	}
+}
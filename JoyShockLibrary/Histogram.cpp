@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define JSL_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define JSL_HAS_TSC 1
+#else
+#define JSL_HAS_TSC 0
+#endif
+
+// Cheap timing for instrumenting the polling threads.
+// Where there's a time stamp counter we read that directly, which is a handful of cycles rather than a trip through the OS clock.
+// Ticks only get turned into real time when someone asks for results, by comparing the counter against steady_clock.
+class TickClock {
+public:
+	static uint64_t now() {
+#if JSL_HAS_TSC
+		return __rdtsc();
+#else
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	static double microseconds_per_tick() {
+#if JSL_HAS_TSC
+		const Reference& start = reference();
+		// the first time anyone asks, make sure we've been counting for long enough to be accurate
+		for (;;) {
+			const uint64_t ticks = now();
+			const auto time = std::chrono::steady_clock::now();
+			const double elapsed = std::chrono::duration<double, std::micro>(time - start.time).count();
+			if (elapsed >= 10000.0 && ticks > start.ticks) {
+				return elapsed / (double)(ticks - start.ticks);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+#else
+		return 0.001;
+#endif
+	}
+
+private:
+	struct Reference {
+		uint64_t ticks;
+		std::chrono::steady_clock::time_point time;
+		Reference() : ticks(TickClock::now()), time(std::chrono::steady_clock::now()) {}
+	};
+
+	static const Reference& reference() {
+		static const Reference start;
+		return start;
+	}
+
+	// take the reference when the library loads, so it's long past by the time results are wanted
+	static const bool _referenced;
+};
+
+const bool TickClock::_referenced = (TickClock::reference(), true);
+
+inline int jsl_highest_bit(uint64_t value) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanReverse(&index, (unsigned long)(value >> 32))) {
+		return (int)index + 32;
+	}
+	_BitScanReverse(&index, (unsigned long)value);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+// Log-linear histogram of tick counts, in the style of HdrHistogram: every power of two is split into 16 equal buckets, so any value is
+// recorded to within about 6%. It's a fixed array, so recording is a couple of instructions and never allocates.
+// One thread records. Any thread can read or reset. Resetting doesn't touch the counts (that would race with the recorder) --
+// it remembers where they were, and results are worked out relative to that.
+class LatencyHistogram {
+public:
+	static const int sub_bucket_bits = 4;
+	static const int sub_buckets = 1 << sub_bucket_bits;
+	// anything longer than 2^44 ticks (a couple of hours) is counted as 2^44 ticks
+	static const int max_bits = 44;
+	static const int num_buckets = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+	LatencyHistogram() : _sum(0), _baselineSum(0) {
+		for (int i = 0; i < num_buckets; i++) {
+			_counts[i].store(0, std::memory_order_relaxed);
+			_baseline[i] = 0;
+		}
+	}
+
+	// only ever call this from one thread at a time
+	void record(uint64_t ticks) {
+		const uint64_t max_ticks = ((uint64_t)1 << max_bits) - 1;
+		if (ticks > max_ticks) {
+			ticks = max_ticks;
+		}
+		std::atomic<uint64_t>& count = _counts[bucket_of(ticks)];
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		_sum.store(_sum.load(std::memory_order_relaxed) + ticks, std::memory_order_relaxed);
+	}
+
+	void reset() {
+		std::lock_guard<std::mutex> guard(_readLock);
+		for (int i = 0; i < num_buckets; i++) {
+			_baseline[i] = _counts[i].load(std::memory_order_relaxed);
+		}
+		_baselineSum = _sum.load(std::memory_order_relaxed);
+	}
+
+	// counts since the last reset. returns the sum of everything recorded since then, in ticks
+	uint64_t read(uint64_t* counts) {
+		std::lock_guard<std::mutex> guard(_readLock);
+		for (int i = 0; i < num_buckets; i++) {
+			counts[i] = _counts[i].load(std::memory_order_relaxed) - _baseline[i];
+		}
+		return _sum.load(std::memory_order_relaxed) - _baselineSum;
+	}
+
+	static int bucket_of(uint64_t ticks) {
+		if (ticks < (uint64_t)sub_buckets) {
+			return (int)ticks;
+		}
+		const int shift = jsl_highest_bit(ticks) - sub_bucket_bits;
+		return (shift + 1) * sub_buckets + (int)((ticks >> shift) & (sub_buckets - 1));
+	}
+
+	// the smallest value that lands in the given bucket
+	static uint64_t bucket_lower_bound(int bucket) {
+		if (bucket < sub_buckets) {
+			return (uint64_t)bucket;
+		}
+		const int shift = bucket / sub_buckets - 1;
+		return (uint64_t)(sub_buckets + bucket % sub_buckets) << shift;
+	}
+
+	// one past the largest value that lands in the given bucket
+	static uint64_t bucket_upper_bound(int bucket) {
+		if (bucket < sub_buckets) {
+			return (uint64_t)bucket + 1;
+		}
+		return bucket_lower_bound(bucket) + ((uint64_t)1 << (bucket / sub_buckets - 1));
+	}
+
+private:
+	std::atomic<uint64_t> _counts[num_buckets];
+	std::atomic<uint64_t> _sum;
+	uint64_t _baseline[num_buckets];
+	uint64_t _baselineSum;
+	std::mutex _readLock;
+};
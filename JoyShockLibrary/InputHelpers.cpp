@@ -1,8 +1,36 @@
+#pragma once
+
 #include "JoyShockLibrary.h"
 #include "JoyShock.cpp"
+#include "SwitchImu.cpp"
 
 #include <cmath>
 
+// with use_imu_samples: give continuous calibration each of a Switch report's 3 samples instead of their average,
+// and keep them, calibrated and flipped the same as imu_state will be, for sensor fusion and the IMU sample callback
+static void push_switch_imu_samples(JoyShock* jc, const uint8_t* packet) {
+	for (int i = 0; i < 3; i++) {
+		float imu[6];
+		decode_switch_imu_sample(packet + 13 + i * 12, jc->sensor_cal[1], imu);
+		jc->imu_samples[i] = { imu[0], imu[1], imu[2], imu[3], imu[4], imu[5] };
+		jc->calibrate(imu[3], imu[4], imu[5], sqrtf(imu[0] * imu[0] + imu[1] * imu[1] + imu[2] * imu[2]), jc->delta_time / 3);
+	}
+	for (int i = 0; i < 3; i++) {
+		IMU_STATE& sample = jc->imu_samples[i];
+		sample.gyroX -= jc->offset_x;
+		sample.gyroY -= jc->offset_y;
+		sample.gyroZ -= jc->offset_z;
+		if (jc->left_right == 2) {
+			sample.gyroX = -sample.gyroX;
+			sample.gyroY = -sample.gyroY;
+			sample.accelX = -sample.accelX;
+			sample.accelY = -sample.accelY;
+		}
+		sample.gyroZ = -sample.gyroZ;
+	}
+	jc->num_imu_samples = 3;
+}
+
 bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 	hasIMU = true;
 	if (packet[0] == 0) return false; // ignore non-responses
@@ -16,9 +44,10 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 	jc->last_simple_state = jc->simple_state;
 	jc->simple_state.buttons = 0;
 	jc->last_imu_state = jc->imu_state;
-	// delta time
+	// delta time. this is when the report arrived, which Bluetooth can bunch up, so it's replaced below by the controller's own timer where there is one
 	auto time_now = std::chrono::steady_clock::now();
-	jc->delta_time = (float)(std::chrono::duration_cast<std::chrono::microseconds>(time_now - jc->last_polled).count() / 1000000.0);
+	const float host_delta_time = (float)(std::chrono::duration_cast<std::chrono::microseconds>(time_now - jc->last_polled).count() / 1000000.0);
+	jc->delta_time = host_delta_time;
 	jc->last_polled = time_now;
 	// ds4
 	if (jc->controller_type == ControllerType::s_ds4) {
@@ -34,6 +63,11 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 				return false; // ignore packets from Dongle with no connected controller
 		}
 		if (isValid) {
+			// sensor timestamp, in units of 16/3 microseconds
+			jc->delta_time = jc->update_device_timer(packet[indexOffset+10] | (packet[indexOffset+11] << 8), 16, 16.0 / 3.0, host_delta_time);
+			// 6 bit report counter, above the PS and touchpad click buttons
+			jc->track_report_counter(packet[indexOffset+7] >> 2, 6, 1, host_delta_time, 0.004f);
+
 			// Gyroscope:
 			// Gyroscope data is relative (degrees/s)
 			int16_t gyroSampleX = uint16_to_int16(packet[indexOffset+13] | (packet[indexOffset+14] << 8) & 0xFF00);
@@ -122,11 +156,8 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 			jc->simple_state.stickRX = (std::fmin)(1.0, (stick2_x - 127.0) / 127.0);
 			jc->simple_state.stickRY = (std::fmin)(1.0, (stick2_y - 127.0) / 127.0);
 
-			if (jc->use_continuous_calibration) {
-				jc->push_sensor_samples(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
-					sqrtf(jc->imu_state.accelX * jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ));
-				jc->get_average_gyro(jc->offset_x, jc->offset_y, jc->offset_z, jc->accel_magnitude);
-			}
+			jc->calibrate(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
+				sqrtf(jc->imu_state.accelX * jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ), jc->delta_time);
 
 			jc->imu_state.gyroX -= jc->offset_x;
 			jc->imu_state.gyroY -= jc->offset_y;
@@ -149,6 +180,12 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 		//	packet[41], packet[42], packet[43], packet[44], packet[45], packet[46], packet[47], packet[48], packet[49], packet[50]);
 		int indexOffset = 1;
 
+		// sensor timestamp, in units of 1/3 microseconds
+		jc->delta_time = jc->update_device_timer(packet[indexOffset + 27] | (packet[indexOffset + 28] << 8) | (packet[indexOffset + 29] << 16) | ((uint32_t)packet[indexOffset + 30] << 24),
+			32, 1.0 / 3.0, host_delta_time);
+		// report counter
+		jc->track_report_counter(packet[indexOffset + 6], 8, 1, host_delta_time, 0.004f);
+
 		// Gyroscope:
 			// Gyroscope data is relative (degrees/s)
 		int16_t gyroSampleX = uint16_to_int16(packet[indexOffset + 15] | (packet[indexOffset + 16] << 8) & 0xFF00);
@@ -237,11 +274,8 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 		jc->simple_state.stickRX = (std::fmin)(1.0, (stick2_x - 127.0) / 127.0);
 		jc->simple_state.stickRY = (std::fmin)(1.0, (stick2_y - 127.0) / 127.0);
 
-		if (jc->use_continuous_calibration) {
-			jc->push_sensor_samples(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
-				sqrtf(jc->imu_state.accelX * jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ));
-			jc->get_average_gyro(jc->offset_x, jc->offset_y, jc->offset_z, jc->accel_magnitude);
-		}
+		jc->calibrate(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
+			sqrtf(jc->imu_state.accelX * jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ), jc->delta_time);
 
 		jc->imu_state.gyroX -= jc->offset_x;
 		jc->imu_state.gyroY -= jc->offset_y;
@@ -266,7 +300,17 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 
 	// input update packet:
 	// 0x21 is just buttons, 0x30 includes gyro, 0x31 includes NFC (large packet size)
-	if (packet[0] == 0x21 || packet[0] == 0x30 || packet[0] == 0x31) {
+	const bool isInput = packet[0] == 0x21 || packet[0] == 0x30 || packet[0] == 0x31;
+	if (!isInput) {
+		// no new IMU data, so leave the last lot alone
+		hasIMU = false;
+	}
+	if (isInput) {
+
+		// timer byte, ticks about every 5ms
+		jc->delta_time = jc->update_device_timer(packet[1], 8, 5000.0, host_delta_time);
+		// there's no report counter, but reports come every 15ms, so the timer should go up by 3 each time
+		jc->track_switch_timer(packet[1], host_delta_time);
 
 		// offset for usb or bluetooth data:
 		/*int offset = settings.usingBluetooth ? 0 : 10;*/
@@ -436,10 +480,13 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 
 			//printf("Switch accel: %.4f, %.4f, %.4f\n", jc->imu_state.accelX, jc->imu_state.accelY, jc->imu_state.accelZ);
 
-			if (jc->use_continuous_calibration) {
-				jc->push_sensor_samples(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
-					sqrtf(jc->imu_state.accelX* jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ));
-				jc->get_average_gyro(jc->offset_x, jc->offset_y, jc->offset_z, jc->accel_magnitude);
+			const bool useImuSamples = jc->use_imu_samples.load(std::memory_order_relaxed);
+			if (useImuSamples) {
+				push_switch_imu_samples(jc, packet);
+			}
+			else {
+				jc->calibrate(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
+					sqrtf(jc->imu_state.accelX * jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ), jc->delta_time);
 			}
 
 			jc->imu_state.gyroX -= jc->offset_x;
@@ -467,7 +514,9 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 			jc->simple_state.buttons |= ((buttons_pressed >> 4) << JSOFFSET_SR) & JSMASK_SR;
 
 			// just need to negate gyroZ
-			jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+			if (isInput) {
+				jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+			}
 		}
 
 		// right:
@@ -486,12 +535,14 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 			jc->simple_state.buttons |= ((buttons_pressed >> 20) << JSOFFSET_SR) & JSMASK_SR;
 
 			// for some reason we need to negate x and y, and z on the right joycon
-			jc->imu_state.gyroX = -jc->imu_state.gyroX;
-			jc->imu_state.gyroY = -jc->imu_state.gyroY;
-			jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+			if (isInput) {
+				jc->imu_state.gyroX = -jc->imu_state.gyroX;
+				jc->imu_state.gyroY = -jc->imu_state.gyroY;
+				jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
 
-			jc->imu_state.accelX = -jc->imu_state.accelX;
-			jc->imu_state.accelY = -jc->imu_state.accelY;
+				jc->imu_state.accelX = -jc->imu_state.accelX;
+				jc->imu_state.accelY = -jc->imu_state.accelY;
+			}
 
 		}
 
@@ -519,7 +570,9 @@ bool handle_input(JoyShock *jc, uint8_t *packet, int len, bool &hasIMU) {
 			jc->simple_state.buttons |= ((int)(jc->simple_state.rTrigger) << JSOFFSET_ZR) & JSMASK_ZR;
 
 			// just need to negate gyroZ
-			jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+			if (isInput) {
+				jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+			}
 		}
 
 	}
@@ -7,7 +7,16 @@
 #include <thread>
 #include <unordered_map>
 #include <atomic>
+#include <mutex>
 #include "tools.cpp"
+#include "LockFree.cpp"
+#include "Histogram.cpp"
+#include "Stillness.cpp"
+#include "CalibrationProfiles.cpp"
+#include "PollRate.cpp"
+#include "Prediction.cpp"
+#include "FusionAlgorithms.cpp"
+#include "Transport.cpp"
 #include <cstring>
 
 #ifdef __GNUC__
@@ -50,15 +59,45 @@ typedef struct GYRO_AVERAGE_WINDOW {
 	int numSamples;
 } GYRO_AVERAGE_WINDOW;
 
+// internal. Sums over several GYRO_AVERAGE_WINDOWs
+typedef struct GYRO_AVERAGE_TOTAL {
+	double x;
+	double y;
+	double z;
+	double accelMagnitude;
+	int numSamples;
+} GYRO_AVERAGE_TOTAL;
+
+// internal. Everything from one report, published together so readers never mix up reports:
+typedef struct JOY_SHOCK_SNAPSHOT {
+	unsigned long long sequence;
+	long long timestamp;
+	long long device_timestamp;
+	JOY_SHOCK_STATE simple_state;
+	IMU_STATE imu_state;
+	TOUCH_STATE touch_state;
+	MOTION_STATE motion_state;
+	POLL_RATE_STATS poll_rate;
+	// what calibration's worked out so far, so it can be saved without stopping the polling thread. its confidence is automatic calibration's
+	CALIBRATION_PROFILE calibration;
+	// whether automatic calibration thinks the controller's still
+	bool is_still;
+	// for turning motion_state forward to a later time
+	float angular_velocity[3];
+	float angular_acceleration[3];
+} JOY_SHOCK_SNAPSHOT;
+
 class JoyShock {
 
 public:
 
-	hid_device * handle;
+	// how we talk to the controller. usually hidapi
+	Transport* transport = nullptr;
 	int intHandle = 0;
 	wchar_t *serial;
 
 	std::string name;
+	std::string path;
 
 	int deviceNumber = 0;// left(0) or right(1) vjoy
 
@@ -67,6 +106,27 @@ public:
 	std::chrono::steady_clock::time_point last_polled;
 	float delta_time = 1.0;
 
+	// the controller's own sensor clock, unwrapped and in microseconds. it's immune to Bluetooth batching, so it's what delta_time comes from when it's available
+	long long device_timestamp = 0;
+	double device_time = 0.0;
+	uint32_t last_device_timer = 0;
+	bool has_device_timer = false;
+
+	// report counters. only the polling thread writes them, but anyone can read them
+	std::atomic<unsigned long long> reports_received{ 0 };
+	std::atomic<unsigned long long> reports_dropped{ 0 };
+	std::atomic<unsigned long long> reports_duplicated{ 0 };
+	std::atomic<unsigned long long> reports_out_of_order{ 0 };
+	uint32_t last_report_counter = 0;
+	bool has_report_counter = false;
+
+	// how long each stage of handling a report takes, indexed by JS_LATENCY_*. recorded by the polling thread
+	static const int num_latency_metrics = JS_LATENCY_READ_TO_PUBLISH + 1;
+	LatencyHistogram latency[num_latency_metrics];
+	uint64_t last_arrival_ticks = 0;
+	// how often reports really come, from delta_time. updated by the polling thread and published with each report
+	PollRateEstimator poll_rate;
+
 	JOY_SHOCK_STATE simple_state = {};
 	JOY_SHOCK_STATE last_simple_state = {};
 
@@ -76,7 +136,37 @@ public:
 	TOUCH_STATE touch_state = {};
 	TOUCH_STATE last_touch_state = {};
 
-	Motion motion;
+	// sensor fusion, with whichever algorithm (JS_FUSION_*) fusion_algorithm says. anyone can ask for a different one, and the polling thread
+	// makes the change the same way it changes motion mode
+	MotionFusion* fusion = make_motion_fusion(JS_FUSION_COMPLEMENTARY);
+	int fusion_algorithm = JS_FUSION_COMPLEMENTARY;
+	std::atomic<int> requested_fusion_algorithm{ JS_FUSION_COMPLEMENTARY };
+	MotionPredictor predictor;
+	// whether predictor estimates angular acceleration. anyone can ask, and the polling thread takes it up the same way it does motion mode
+	std::atomic<bool> requested_prediction_acceleration{ false };
+	// motion as of the last time the polling thread fused (which is every sample unless fusion's lazy)
+	MOTION_STATE fused_motion_state = {};
+	// how sensor fusion's done (JS_MOTION_*). anyone can ask for a change, but the polling thread makes it, between samples, with motion_lock held
+	std::atomic<int> requested_motion_mode{ JS_MOTION_EAGER };
+	std::atomic<int> motion_mode{ JS_MOTION_EAGER };
+	// how long gravity has to hold steady before fusion trusts it, in seconds. anyone can ask, and the polling thread takes it up the same way it does motion mode
+	std::atomic<float> gravity_window_seconds{ GravityWindow().WindowSeconds };
+	float applied_gravity_window_seconds = GravityWindow().WindowSeconds;
+	// when fusion's lazy, fusion and motion_samples are only touched with this held -- by the polling thread, or by a reader catching motion up
+	std::mutex motion_lock;
+	static const int max_motion_samples = 64;
+	MOTION_SAMPLE motion_samples[max_motion_samples];
+	int num_motion_samples = 0;
+
+	// the above are only touched by whichever thread polls this device. everyone else reads this copy, which sits on its own cache lines
+	SeqLock<JOY_SHOCK_SNAPSHOT> published;
+
+	// every processed report, for readers who poll less often than the device reports. about a second's worth at 250Hz
+	static const int state_history_size = 256;
+	HistoryRing<STATE_SAMPLE, state_history_size> state_history;
+
+	// no controller we support reports less often than this, so a longer gap between timer readings means the timer's gone wrong
+	static constexpr float max_device_delta_time = 0.25f;
 
 	int8_t dstick;
 	uint8_t battery;
@@ -108,6 +198,8 @@ public:
 
 	ControllerType controller_type = ControllerType::n_switch;
 	bool is_usb = false;
+	// decodes this device's reports. chosen once we know exactly what the device is (see choose_report_parser). null means handle_input
+	bool (*parse_report)(JoyShock* jc, uint8_t* packet, int len, bool& hasIMU) = nullptr;
 
 	unsigned char small_rumble = 0;
 	unsigned char big_rumble = 0;
@@ -123,21 +215,49 @@ public:
 	int player_number = 0;
 
 	bool cancel_thread = false;
-	std::thread* thread;
+	std::thread* thread = nullptr;
+
+	// polling state, whether we're polled by our own thread or by the reactor
+	int num_timeouts = 0;
+	int num_no_imu = 0;
+	float ds4_wakeup_timer = 0.0f;
+	// our own non-blocking handle on the hidraw node, only opened for reactor polling
+	int reactor_fd = -1;
 
 	// for calibration:
 	bool use_continuous_calibration = false;
+	// only calibrate while the controller's still. continuous calibration takes everything instead, if it's on. anyone can change it
+	std::atomic<bool> use_automatic_calibration{ false };
+	StillnessDetector stillness;
 	bool cue_motion_reset = false;
 	float offset_x = 0.0f;
 	float offset_y = 0.0f;
 	float offset_z = 0.0f;
 	float accel_magnitude = 1.0f;
+	// Switch reports have 3 IMU samples, 5ms apart. imu_state is their average, but with use_imu_samples each one also goes to continuous calibration
+	// and sensor fusion on its own. imu_samples are those samples from the last report, calibrated and flipped just like imu_state.
+	// anyone can change use_imu_samples, so the report parsers read it just once per report
+	std::atomic<bool> use_imu_samples{ false };
+	int num_imu_samples = 0;
+	IMU_STATE imu_samples[3];
 
 	// for continuous calibration
 	static const int num_gyro_average_windows = 16;
 	int gyro_average_window_front_index = 0;
-	int gyro_average_window_seconds = 600; // TODO: Function to set this for this device and for all devices. Different players might have different settings
+	// how many seconds of samples to average over. anyone can ask for a change, and the polling thread takes it up before its next sample
+	std::atomic<float> requested_calibration_window_seconds{ 600.0f };
+	// anyone can ask for everything collected to be forgotten, and the polling thread does it before its next sample
+	std::atomic<bool> requested_calibration_reset{ false };
+	float gyro_average_window_seconds = 600.0f;
 	GYRO_AVERAGE_WINDOW gyro_average_window[num_gyro_average_windows];
+	// gyro_average_totals[i] is the sum of the i windows behind the front one, newest first. Only the front window changes from one sample to the next,
+	// so these only need working out again when it fills up and a new one's started -- not for every sample
+	GYRO_AVERAGE_TOTAL gyro_average_totals[num_gyro_average_windows];
+	bool gyro_average_totals_valid = false;
+	// the last average worked out, so it's only worked out again if there've been samples since
+	bool gyro_average_dirty = true;
+	bool has_gyro_average = false;
+	float gyro_average[4];
 
 	unsigned char factory_stick_cal[0x12];
 	unsigned char device_colours[0xC];
@@ -276,12 +396,13 @@ public:
 		//buf[36] = 0x08;
 		//buf[37] = 0x00;
 
-		hid_write(handle, buf, 38);
-		//hid_read_timeout(handle, buf, bufLength, 100);
+		transport->write(buf, 38);
+		//transport->read_timeout(buf, bufLength, 100);
 	}
 
 public:
-	JoyShock(struct hid_device_info *dev, int uniqueHandle) {
+	// if transport is null, the device is opened through hidapi. otherwise the JoyShock takes ownership of it
+	JoyShock(struct hid_device_info *dev, int uniqueHandle, Transport* transport = nullptr) {
 
 		if (dev->product_id == JOYCON_CHARGING_GRIP) {
 
@@ -328,10 +449,11 @@ public:
 		}
 
 		this->serial = _wcsdup(dev->serial_number);
+		this->path = dev->path;
 		this->intHandle = uniqueHandle;
 
 		//printf("Found device %c: %ls %s\n", L_OR_R(this->left_right), this->serial, dev->path);
-		this->handle = hid_open_path(dev->path);
+		this->transport = transport != nullptr ? transport : new HidTransport(dev->path);
 
 		if (this->controller_type == ControllerType::s_ds4) {
 			unsigned char buf[64];
@@ -339,7 +461,7 @@ public:
 
 			enable_gyro_ds4_bt(buf, 64);
 
-			hid_read_timeout(handle, buf, 64, 100);
+			this->transport->read_timeout(buf, 64, 100);
 			// choose between BT and USB
 			if (buf[0] == 0x11) {
 				this->is_usb = false;
@@ -349,25 +471,129 @@ public:
 		// initialise continuous calibration windows
 		reset_continuous_calibration();
 
-		if (this->handle == nullptr) {
+		// nothing's been reported yet, but motion starts out as the identity rather than all zeroes
+		JOY_SHOCK_SNAPSHOT snapshot = {};
+		fused_motion_state = fusion->get_motion_state();
+		snapshot.motion_state = fused_motion_state;
+		snapshot.poll_rate = poll_rate.stats();
+		snapshot.calibration = get_calibration_profile();
+		published.store(snapshot);
+
+		if (!this->transport->is_open()) {
 			//printf("Could not open serial %ls: %s\n", this->serial, strerror(errno));
 			throw;
 		}
 	}
 
+	~JoyShock() {
+		delete transport;
+		delete fusion;
+	}
+
+	// only for the polling thread, or before polling's started. anyone else calls request_calibration_reset
 	void reset_continuous_calibration() {
 		for (int i = 0; i < num_gyro_average_windows; i++) {
 			this->gyro_average_window[i] = {};
 		}
+		this->gyro_average_totals_valid = false;
+		this->gyro_average_dirty = true;
+		this->has_gyro_average = false;
+		this->stillness.reset();
 	}
 
-	int get_gyro_average_window_total_samples_for_device() {
-		if (this->controller_type == ControllerType::s_ds4) {
-			// 250 samples per second
-			return 250 * this->gyro_average_window_seconds;
+	// what calibration's worked out so far, to be saved for next time
+	CALIBRATION_PROFILE get_calibration_profile() const {
+		CALIBRATION_PROFILE profile;
+		profile.offsetX = this->offset_x;
+		profile.offsetY = this->offset_y;
+		profile.offsetZ = this->offset_z;
+		profile.accelMagnitude = this->accel_magnitude;
+		profile.numSamples = 0;
+		for (int i = 0; i < num_gyro_average_windows; i++) {
+			profile.numSamples += this->gyro_average_window[i].numSamples;
+		}
+		profile.confidence = this->stillness.confidence();
+		return profile;
+	}
+
+	// carry on from a saved profile. its average goes in as up to one window's worth of samples, so new samples are averaged in with it
+	// rather than starting from nothing -- and it'll age out like any other window
+	void apply_calibration_profile(const CALIBRATION_PROFILE& profile) {
+		reset_continuous_calibration();
+		apply_calibration_window();
+		this->offset_x = profile.offsetX;
+		this->offset_y = profile.offsetY;
+		this->offset_z = profile.offsetZ;
+		this->accel_magnitude = profile.accelMagnitude;
+		const int numSamples = profile.numSamples < get_gyro_average_window_single_samples_for_device() ? profile.numSamples : get_gyro_average_window_single_samples_for_device();
+		if (numSamples > 0) {
+			GYRO_AVERAGE_WINDOW& window = this->gyro_average_window[this->gyro_average_window_front_index];
+			window.x = profile.offsetX * numSamples;
+			window.y = profile.offsetY * numSamples;
+			window.z = profile.offsetZ * numSamples;
+			window.accelMagnitude = profile.accelMagnitude * numSamples;
+			window.numSamples = numSamples;
 		}
-		// 67 samples per second
-		return 67 * this->gyro_average_window_seconds;
+		this->stillness.restore(profile.confidence);
+		// nothing's polling this device yet, so nothing else is publishing
+		JOY_SHOCK_SNAPSHOT snapshot = published.load();
+		snapshot.calibration = get_calibration_profile();
+		published.store(snapshot);
+	}
+
+	// safe to call from any thread
+	void set_calibration_window(float seconds) {
+		this->requested_calibration_window_seconds.store(seconds, std::memory_order_relaxed);
+	}
+
+	// called by the polling thread before it collects a sample
+	void apply_calibration_window() {
+		const float seconds = this->requested_calibration_window_seconds.load(std::memory_order_relaxed);
+		if (seconds != this->gyro_average_window_seconds) {
+			this->gyro_average_window_seconds = seconds;
+			// same samples, different weights
+			this->gyro_average_dirty = true;
+		}
+	}
+
+	// safe to call from any thread
+	void request_calibration_reset() {
+		this->requested_calibration_reset.store(true, std::memory_order_relaxed);
+	}
+
+	// every gyro sample goes through here, before the offset's taken off. with continuous calibration it's collected,
+	// and with automatic calibration it's collected if the controller's still. then the offset is updated to the average of what's been collected
+	void calibrate(float x, float y, float z, float accelMagnitude, float deltaTime) {
+		if (this->requested_calibration_reset.load(std::memory_order_relaxed) && this->requested_calibration_reset.exchange(false)) {
+			reset_continuous_calibration();
+		}
+		const bool collect = this->use_continuous_calibration ||
+			(this->use_automatic_calibration.load(std::memory_order_relaxed) && this->stillness.update(x, y, z, accelMagnitude, deltaTime));
+		if (!collect) {
+			return;
+		}
+		apply_calibration_window();
+		push_sensor_samples(x, y, z, accelMagnitude);
+		get_average_gyro(this->offset_x, this->offset_y, this->offset_z, this->accel_magnitude);
+	}
+
+	// how often a controller like this is supposed to report, for until we've measured it
+	float get_nominal_poll_rate() const {
+		if (this->controller_type != ControllerType::n_switch) {
+			return 250.0f;
+		}
+		// about every 8ms over USB, and every 15ms over Bluetooth
+		return this->is_usb ? 125.0f : 66.6667f;
+	}
+
+	float get_poll_rate() const {
+		return this->poll_rate.has_rate() ? this->poll_rate.rate() : get_nominal_poll_rate();
+	}
+
+	int get_gyro_average_window_total_samples_for_device() {
+		// Switch controllers can give us 3 samples per report
+		const float samplesPerSecond = get_poll_rate() * (this->use_imu_samples.load(std::memory_order_relaxed) ? 3 : 1);
+		return (int)(samplesPerSecond * this->gyro_average_window_seconds);
 	}
 
 	int get_gyro_average_window_single_samples_for_device() {
@@ -382,6 +608,8 @@ public:
 			this->gyro_average_window_front_index = (this->gyro_average_window_front_index + num_gyro_average_windows - 1) % num_gyro_average_windows;
 			this->gyro_average_window[this->gyro_average_window_front_index] = {};
 			windowPointer = this->gyro_average_window + this->gyro_average_window_front_index;
+			// every window has moved back one
+			this->gyro_average_totals_valid = false;
 		}
 		// accumulate
 		windowPointer->numSamples++;
@@ -389,79 +617,362 @@ public:
 		windowPointer->y += y;
 		windowPointer->z += z;
 		windowPointer->accelMagnitude += accelMagnitude;
+		this->gyro_average_dirty = true;
+	}
+
+	void update_gyro_average_totals() {
+		this->gyro_average_totals[0] = {};
+		for (int i = 1; i < num_gyro_average_windows; i++) {
+			const GYRO_AVERAGE_WINDOW& window = this->gyro_average_window[(i + this->gyro_average_window_front_index) % num_gyro_average_windows];
+			const GYRO_AVERAGE_TOTAL& previous = this->gyro_average_totals[i - 1];
+			this->gyro_average_totals[i] = { previous.x + window.x, previous.y + window.y, previous.z + window.z,
+				previous.accelMagnitude + window.accelMagnitude, previous.numSamples + window.numSamples };
+		}
+		this->gyro_average_totals_valid = true;
 	}
 
 	void get_average_gyro(float& x, float& y, float& z, float& accelMagnitude) {
-		float weight = 0.0f;
-		float totalX = 0.0f;
-		float totalY = 0.0f;
-		float totalZ = 0.0f;
-		float totalAccelMagnitude = 0.0f;
-		int samplesAccumulated = 0;
+		if (this->gyro_average_dirty) {
+			this->gyro_average_dirty = false;
+			this->has_gyro_average = calculate_average_gyro(this->gyro_average);
+		}
+		if (this->has_gyro_average) {
+			x = this->gyro_average[0];
+			y = this->gyro_average[1];
+			z = this->gyro_average[2];
+			accelMagnitude = this->gyro_average[3];
+		}
+	}
+
+	// get the average of each window
+	// and a weighted average of all those averages, weighted by the number of samples it has compared to how many samples a full window will have.
+	// this isn't a perfect rolling average. the last window, which has more samples than we need, will have its contribution weighted according to how many samples it would ideally have for the current span of time.
+	// A full window's average times its weight is just its sum over samplesPerWindow, so all the windows that count in full come straight out of gyro_average_totals.
+	// returns false if there are no samples at all
+	bool calculate_average_gyro(float average[4]) {
+		if (!this->gyro_average_totals_valid) {
+			update_gyro_average_totals();
+		}
 		int samplesWanted = this->get_gyro_average_window_total_samples_for_device();
-		float samplesPerWindow = (float)(this->get_gyro_average_window_single_samples_for_device());
-		//int numSamplesAvailable = 0;
-		//for (int i = 0; i < num_gyro_average_windows && samplesWanted > 0; i++) {
-		//	numSamplesAvailable += this->gyro_average_window[i].numSamples;
-		//}
+		if (samplesWanted <= 0) {
+			return false;
+		}
+		const double samplesPerWindow = (double)(this->get_gyro_average_window_single_samples_for_device());
+		double weight = 0.0;
+		double totalX = 0.0;
+		double totalY = 0.0;
+		double totalZ = 0.0;
+		double totalAccelMagnitude = 0.0;
+
+		// the window still filling up, then however many of the windows behind it fit in what's left, then part of the one after that
+		const GYRO_AVERAGE_WINDOW& front = this->gyro_average_window[this->gyro_average_window_front_index];
+		int partialIndex = -1;
+		if (front.numSamples > 0 && samplesWanted < front.numSamples) {
+			partialIndex = this->gyro_average_window_front_index;
+		}
+		else {
+			totalX = front.x;
+			totalY = front.y;
+			totalZ = front.z;
+			totalAccelMagnitude = front.accelMagnitude;
+			int fullSamples = front.numSamples;
+			samplesWanted -= front.numSamples;
+			if (samplesWanted > 0) {
+				// the most windows whose samples all fit
+				int full = 0;
+				int low = 1;
+				int high = num_gyro_average_windows - 1;
+				while (low <= high) {
+					const int middle = (low + high) / 2;
+					if (this->gyro_average_totals[middle].numSamples <= samplesWanted) {
+						full = middle;
+						low = middle + 1;
+					}
+					else {
+						high = middle - 1;
+					}
+				}
+				const GYRO_AVERAGE_TOTAL& fullWindows = this->gyro_average_totals[full];
+				totalX += fullWindows.x;
+				totalY += fullWindows.y;
+				totalZ += fullWindows.z;
+				totalAccelMagnitude += fullWindows.accelMagnitude;
+				fullSamples += fullWindows.numSamples;
+				samplesWanted -= fullWindows.numSamples;
+				// the next window has samples, or it would have fit
+				if (samplesWanted > 0 && full < num_gyro_average_windows - 1) {
+					partialIndex = (full + 1 + this->gyro_average_window_front_index) % num_gyro_average_windows;
+				}
+			}
+			weight = fullSamples / samplesPerWindow;
+			totalX /= samplesPerWindow;
+			totalY /= samplesPerWindow;
+			totalZ /= samplesPerWindow;
+			totalAccelMagnitude /= samplesPerWindow;
+		}
+		if (partialIndex >= 0) {
+			const GYRO_AVERAGE_WINDOW& window = this->gyro_average_window[partialIndex];
+			const double numSamples = (double)(window.numSamples);
+			const double thisWeight = samplesWanted / numSamples;
+			totalX += (window.x / numSamples) * thisWeight;
+			totalY += (window.y / numSamples) * thisWeight;
+			totalZ += (window.z / numSamples) * thisWeight;
+			totalAccelMagnitude += (window.accelMagnitude / numSamples) * thisWeight;
+			weight += thisWeight;
+		}
+		if (weight <= 0.0) {
+			return false;
+		}
+		average[0] = (float)(totalX / weight);
+		average[1] = (float)(totalY / weight);
+		average[2] = (float)(totalZ / weight);
+		average[3] = (float)(totalAccelMagnitude / weight);
+		return true;
+	}
 
-		// get the average of each window
-		// and a weighted average of all those averages, weighted by the number of samples it has compared to how many samples a full window will have.
-		// this isn't a perfect rolling average. the last window, which has more samples than we need, will have its contribution weighted according to how many samples it would ideally have for the current span of time.
-		for (int i = 0; i < num_gyro_average_windows && samplesWanted > 0; i++) {
-			int cycledIndex = (i + this->gyro_average_window_front_index) % num_gyro_average_windows;
-			GYRO_AVERAGE_WINDOW* windowPointer = this->gyro_average_window + cycledIndex;
-			if (windowPointer->numSamples == 0)
-			{
-				continue;
+	// the reactor needs a file descriptor it can wait on. not every transport has one
+	bool open_reactor_fd() {
+		if (reactor_fd < 0) {
+			reactor_fd = transport->open_poll_fd();
+		}
+		return reactor_fd >= 0;
+	}
+
+	void close_reactor_fd() {
+		if (reactor_fd >= 0) {
+			transport->close_poll_fd();
+			reactor_fd = -1;
+		}
+	}
+
+	// returns the report length, 0 if there's nothing waiting, or -1 if the device is gone
+	int read_reactor_report(unsigned char* buf, int len) {
+		return transport->read_ready(buf, len);
+	}
+
+	// throw away any reports waiting to be read the usual way
+	void drain_reports() {
+		transport->drain();
+	}
+
+	// SeqLock is cache-line aligned, and plain new doesn't respect that before C++17
+	static void* operator new(size_t size) {
+		return jsl_aligned_alloc(size);
+	}
+
+	static void operator delete(void* p) {
+		jsl_aligned_free(p);
+	}
+
+	// Work out delta_time from the controller's own timer, which counts in units of tickMicroseconds and wraps after timerBits bits.
+	// hostDeltaTime is the time between the reports arriving. We fall back to it when the timer can't be trusted: the first report,
+	// a gap long enough that the timer might have wrapped more than once, or a jump that makes no sense (the controller was reset, say).
+	// Either way, device_timestamp keeps counting up.
+	float update_device_timer(uint32_t timer, int timerBits, double tickMicroseconds, float hostDeltaTime) {
+		const uint32_t timerMask = timerBits >= 32 ? 0xFFFFFFFF : (1u << timerBits) - 1;
+		const double wrapSeconds = (double)timerMask * tickMicroseconds / 1000000.0;
+		double deltaMicroseconds = hostDeltaTime * 1000000.0;
+		if (has_device_timer && hostDeltaTime < wrapSeconds * 0.5) {
+			const uint32_t ticks = (timer - last_device_timer) & timerMask;
+			const double deviceDeltaMicroseconds = ticks * tickMicroseconds;
+			if (deviceDeltaMicroseconds > 0.0 && deviceDeltaMicroseconds <= max_device_delta_time * 1000000.0) {
+				deltaMicroseconds = deviceDeltaMicroseconds;
 			}
-			float thisWeight = 1.0f;
-			float fNumSamples = (float)(windowPointer->numSamples);
-			if (samplesWanted < windowPointer->numSamples)
-			{
-				thisWeight = ((float)(samplesWanted)) / windowPointer->numSamples;
-				samplesWanted = 0;
+		}
+		has_device_timer = true;
+		last_device_timer = timer & timerMask;
+		// kept as a double so that fractional ticks don't get rounded away one report at a time
+		device_time += deltaMicroseconds;
+		device_timestamp = (long long)device_time;
+		return (float)(deltaMicroseconds / 1000000.0);
+	}
+
+	// Check the controller's report counter for gaps. The counter is timerBits wide and goes up by about 'step' with each report, which needn't be a whole number.
+	// A counter that doesn't move is a duplicate, and one that goes backwards is out of order. Neither moves our idea of where the counter's up to.
+	// If there's been too long a gap to tell how many times the counter wrapped (a timeout, say), we just start again from this report rather than guess.
+	void track_report_counter(uint32_t counter, int counterBits, float step, float hostDeltaTime, float reportInterval) {
+		const uint32_t counterMask = (1u << counterBits) - 1;
+		counter &= counterMask;
+		bump(reports_received);
+		const float wrapSeconds = (float)(counterMask + 1) / step * reportInterval;
+		if (!has_report_counter || hostDeltaTime >= wrapSeconds * 0.5f) {
+			has_report_counter = true;
+			last_report_counter = counter;
+			return;
+		}
+		const uint32_t difference = (counter - last_report_counter) & counterMask;
+		if (difference == 0) {
+			bump(reports_duplicated);
+			return;
+		}
+		if (difference > counterMask / 2) {
+			bump(reports_out_of_order);
+			return;
+		}
+		const uint32_t reports = (uint32_t)(difference / step + 0.5f);
+		if (reports > 1) {
+			reports_dropped.store(reports_dropped.load(std::memory_order_relaxed) + reports - 1, std::memory_order_relaxed);
+		}
+		last_report_counter = counter;
+	}
+
+	// Switch controllers don't number their reports, so it's their timer that's checked. It counts 5ms ticks: about 3 a report over Bluetooth,
+	// but under 2 over USB. How far it should move comes from the nominal rate, not the measured one -- lost reports bring the measured rate down,
+	// which would make the step bigger and hide the very reports we're counting
+	void track_switch_timer(uint8_t timer, float hostDeltaTime) {
+		const float reportInterval = 1.0f / get_nominal_poll_rate();
+		track_report_counter(timer, 8, reportInterval / 0.005f, hostDeltaTime, reportInterval);
+	}
+
+	// there's only one writer, so this doesn't need to be a (slower) atomic increment
+	static void bump(std::atomic<unsigned long long>& counter) {
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	// safe to call from any thread
+	JOY_SHOCK_SNAPSHOT get_published_state() const {
+		return published.load();
+	}
+
+	// the latest motion, from the snapshot unless fusion's lazy. then the samples waiting are fused first. for readers
+	MOTION_STATE get_motion_state(const JOY_SHOCK_SNAPSHOT& snapshot) {
+		if (motion_mode.load(std::memory_order_acquire) == JS_MOTION_LAZY) {
+			std::lock_guard<std::mutex> guard(motion_lock);
+			// the polling thread might have changed mode since we looked
+			if (motion_mode.load(std::memory_order_relaxed) == JS_MOTION_LAZY) {
+				MOTION_STATE state;
+				fuse_motion_samples(&state);
+				return state;
 			}
-			else
-			{
-				thisWeight = fNumSamples / samplesPerWindow;
-				samplesWanted -= windowPointer->numSamples;
+		}
+		return snapshot.motion_state;
+	}
+
+	// every sample waiting, in one go, and the motion state after them if finalState isn't null. motion_lock has to be held
+	void fuse_motion_samples(MOTION_STATE* finalState) {
+		fusion->fuse(motion_samples, num_motion_samples, nullptr, finalState);
+		num_motion_samples = 0;
+	}
+
+	// called by the polling thread before each report's IMU samples
+	void apply_motion_mode() {
+		predictor.use_acceleration = requested_prediction_acceleration.load(std::memory_order_relaxed);
+		const float windowSeconds = gravity_window_seconds.load(std::memory_order_relaxed);
+		if (windowSeconds != applied_gravity_window_seconds) {
+			std::lock_guard<std::mutex> guard(motion_lock);
+			fusion->set_gravity_window(windowSeconds);
+			applied_gravity_window_seconds = windowSeconds;
+		}
+		const int algorithm = requested_fusion_algorithm.load(std::memory_order_relaxed);
+		if (algorithm != fusion_algorithm) {
+			MotionFusion* replacement = make_motion_fusion(algorithm);
+			if (replacement != nullptr) {
+				std::lock_guard<std::mutex> guard(motion_lock);
+				// the old one catches up first, and the new one carries on from there
+				MOTION_STATE state;
+				fuse_motion_samples(&state);
+				replacement->set_motion_state(state);
+				replacement->set_gravity_window(applied_gravity_window_seconds);
+				delete fusion;
+				fusion = replacement;
+				fusion_algorithm = algorithm;
+				fused_motion_state = fusion->get_motion_state();
 			}
+		}
+		const int requested = requested_motion_mode.load(std::memory_order_relaxed);
+		if (requested != motion_mode.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> guard(motion_lock);
+			// catch up on anything lazy fusion had waiting, so it isn't lost
+			fuse_motion_samples(&fused_motion_state);
+			motion_mode.store(requested, std::memory_order_release);
+		}
+	}
 
-			//printf("[%.1f] [%d] [%.1f]; ", \
-						//	windowPointer->y,
-//	(int)fNumSamples,
-//	thisWeight);
+	void reset_motion() {
+		std::lock_guard<std::mutex> guard(motion_lock);
+		num_motion_samples = 0;
+		fusion->reset();
+		fused_motion_state = fusion->get_motion_state();
+	}
 
-			totalX += (windowPointer->x / fNumSamples) * thisWeight;
-			totalY += (windowPointer->y / fNumSamples) * thisWeight;
-			totalZ += (windowPointer->z / fNumSamples) * thisWeight;
-			totalAccelMagnitude += (windowPointer->accelMagnitude / fNumSamples) * thisWeight;
-			weight += thisWeight;
+	// most IMU samples a report has (a Switch report's 3)
+	static const int max_report_samples = 3;
+
+	// called by the polling thread with a report's IMU samples, deltaTime apart. whatever the algorithm, that's one virtual call for the lot.
+	// sampleStates, if it isn't null, gets the motion state right after each sample, and then fused_motion_state has to include them all, even if fusion's lazy
+	void fuse_motion(const IMU_STATE* samples, int numSamples, float deltaTime, MOTION_STATE* sampleStates) {
+		MOTION_SAMPLE motionSamples[max_report_samples];
+		numSamples = numSamples < max_report_samples ? numSamples : max_report_samples;
+		for (int i = 0; i < numSamples; i++) {
+			const IMU_STATE& sample = samples[i];
+			predictor.update(sample.gyroX, sample.gyroY, sample.gyroZ, deltaTime);
+			motionSamples[i] = { sample.gyroX, sample.gyroY, sample.gyroZ, sample.accelX, sample.accelY, sample.accelZ, accel_magnitude, deltaTime };
 		}
-		if (weight > 0.0) {
-			x = totalX / weight;
-			y = totalY / weight;
-			z = totalZ / weight;
-			accelMagnitude = totalAccelMagnitude / weight;
+		switch (motion_mode.load(std::memory_order_relaxed)) {
+		case JS_MOTION_EAGER:
+			fusion->fuse(motionSamples, numSamples, sampleStates, &fused_motion_state);
+			break;
+		case JS_MOTION_LAZY: {
+			std::lock_guard<std::mutex> guard(motion_lock);
+			if (sampleStates != nullptr) {
+				// anything still waiting goes first. it's only ever left over from switching mode, since samples wanted this way don't wait
+				if (num_motion_samples > 0) {
+					fuse_motion_samples(nullptr);
+				}
+				fusion->fuse(motionSamples, numSamples, sampleStates, &fused_motion_state);
+				break;
+			}
+			if (num_motion_samples + numSamples > max_motion_samples) {
+				fuse_motion_samples(&fused_motion_state);
+			}
+			for (int i = 0; i < numSamples; i++) {
+				motion_samples[num_motion_samples++] = motionSamples[i];
+			}
+			break;
+		}
+		default:
+			// disabled. motion stays where it was
+			for (int i = 0; i < numSamples && sampleStates != nullptr; i++) {
+				sampleStates[i] = fused_motion_state;
+			}
+			break;
 		}
-		//printf("{%.1f, %.1f, %.1f} {%d}\n", x, y, z, numSamplesAvailable);
-		//printf("{%.1f} {%d}\n", y, numSamplesAvailable);
 	}
 
-	MOTION_STATE get_motion_state()
-	{
-		return motion.GetMotionState();
+	// called by the polling thread once a report has been fully processed. adds it to the history and makes it the latest state
+	void publish_state() {
+		STATE_SAMPLE sample;
+		sample.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(last_polled.time_since_epoch()).count();
+		sample.deviceTimestamp = device_timestamp;
+		sample.deltaTime = delta_time;
+		sample.simpleState = simple_state;
+		sample.imuState = imu_state;
+		sample.touchState = touch_state;
+		state_history.push(sample);
+
+		JOY_SHOCK_SNAPSHOT snapshot;
+		snapshot.sequence = sample.sequence;
+		snapshot.timestamp = sample.timestamp;
+		snapshot.device_timestamp = sample.deviceTimestamp;
+		snapshot.simple_state = simple_state;
+		snapshot.imu_state = imu_state;
+		snapshot.touch_state = touch_state;
+		snapshot.motion_state = fused_motion_state;
+		snapshot.poll_rate = poll_rate.stats();
+		snapshot.calibration = get_calibration_profile();
+		snapshot.is_still = stillness.is_still();
+		predictor.get(snapshot.angular_velocity, snapshot.angular_acceleration);
+		published.store(snapshot);
 	}
 
-	bool hid_exchange(hid_device *handle, unsigned char *buf, int len) {
-		if (!handle) return false;
+	bool hid_exchange(unsigned char *buf, int len) {
+		if (!transport->is_open()) return false;
 
 		int res;
 
-		res = hid_write(handle, buf, len);
+		res = transport->write(buf, len);
 
-		res = hid_read_timeout(handle, buf, 0x40, 1000);
+		res = transport->read_timeout(buf, 0x40, 1000);
 		if (res == 0)
 		{
 			return false;
@@ -485,7 +996,7 @@ public:
 			memcpy(buf + (is_usb ? 0x9 : 0x1), data, len);
 		}
 
-		if (!hid_exchange(this->handle, buf, len + (is_usb ? 0x9 : 0x1)))
+		if (!hid_exchange(buf, len + (is_usb ? 0x9 : 0x1)))
 		{
 			return false;
 		}
@@ -558,7 +1069,7 @@ public:
 		}
 
 		// set non-blocking:
-		hid_set_nonblocking(this->handle, 1);
+		transport->set_nonblocking(1);
 
 		send_command(0x10, (uint8_t*)buf, 0x9);
 	}
@@ -766,14 +1277,14 @@ public:
 
 		// set blocking:
 		// this insures we get the MAC Address
-		hid_set_nonblocking(this->handle, 0);
+		transport->set_nonblocking(0);
 
 		//Get MAC Left
 		printf("Getting MAC...\n");
 		memset(buf, 0x00, 0x40);
 		buf[0] = 0x80;
 		buf[1] = 0x01;
-		hid_exchange(this->handle, buf, 0x2);
+		hid_exchange(buf, 0x2);
 
 		//if (buf[2] == 0x3) {
 		//	printf("%s disconnected!\n", this->name.c_str());
@@ -790,28 +1301,28 @@ public:
 		memset(buf, 0x00, 0x40);
 		buf[0] = 0x80;
 		buf[1] = 0x02;
-		hid_exchange(this->handle, buf, 0x2);
+		hid_exchange(buf, 0x2);
 
 		// Switch baudrate to 3Mbit
 		printf("Switching baudrate...\n");
 		memset(buf, 0x00, 0x40);
 		buf[0] = 0x80;
 		buf[1] = 0x03;
-		hid_exchange(this->handle, buf, 0x2);
+		hid_exchange(buf, 0x2);
 
 		//Do handshaking again at new baudrate so the firmware pulls pin 3 low?
 		printf("Doing handshake...\n");
 		memset(buf, 0x00, 0x40);
 		buf[0] = 0x80;
 		buf[1] = 0x02;
-		hid_exchange(this->handle, buf, 0x2);
+		hid_exchange(buf, 0x2);
 
 		//Only talk HID from now on
 		printf("Only talk HID...\n");
 		memset(buf, 0x00, 0x40);
 		buf[0] = 0x80;
 		buf[1] = 0x04;
-		hid_exchange(this->handle, buf, 0x2);
+		hid_exchange(buf, 0x2);
 
 		// Enable vibration
 		printf("Enabling vibration...\n");
@@ -842,16 +1353,16 @@ public:
 		printf("Initialising Bluetooth connection...\n");
 
 		// set blocking to ensure command is recieved:
-		hid_set_nonblocking(this->handle, 0);
+		transport->set_nonblocking(0);
 
 		// first, check if this is a USB connection
 		buf[0] = 0x80;
 		buf[1] = 0x01;
-		hid_write(this->handle, buf, 2);
+		transport->write(buf, 2);
 		// wait for up to 5 messages for a USB acknowledgement
 		for (int idx = 0; idx < 5; idx++)
 		{
-			if (hid_read_timeout(this->handle, buf, 0x40, 200) && buf[0] == 0x81)
+			if (transport->read_timeout(buf, 0x40, 200) && buf[0] == 0x81)
 			{
 				//printf("%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
 				//	buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10]);
@@ -870,7 +1381,7 @@ public:
 			printf("Not a USB response...\n");
 		}
 		memset(buf, 0, 0x40);
-		//if (hid_exchange(this->handle, buf, 2))
+		//if (hid_exchange(buf, 2))
 		//{
 		//	printf("%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
 		//		buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10]);
@@ -984,9 +1495,9 @@ public:
 
 		// set blocking:
 		// this insures we get the MAC Address
-		hid_set_nonblocking(this->handle, 0);
+		transport->set_nonblocking(0);
 
-		hid_write(handle, buf, 78);
+		transport->write(buf, 78);
 
 		// initialise stuff
 		memset(factory_stick_cal, 0, 0x12);
@@ -1088,9 +1599,9 @@ public:
 
 		// set blocking:
 		// this insures we get the MAC Address
-		hid_set_nonblocking(this->handle, 0);
+		transport->set_nonblocking(0);
 
-		hid_write(handle, buf, 31);
+		transport->write(buf, 31);
 
 		// initialise stuff
 		memset(factory_stick_cal, 0, 0x12);
@@ -1159,9 +1670,9 @@ public:
 		//buf[75] = 
 
 		// set non-blocking
-		hid_set_nonblocking(this->handle, 1);
+		transport->set_nonblocking(1);
 
-		hid_write(handle, buf, 31);
+		transport->write(buf, 31);
 	}
 
 	void deinit_usb() {
@@ -1171,7 +1682,7 @@ public:
 		//Let the Joy-Con talk BT again    
 		buf[0] = 0x80;
 		buf[1] = 0x05;
-		hid_exchange(this->handle, buf, 0x2);
+		hid_exchange(buf, 0x2);
 		//printf("Deinitialized %s\n", this->name.c_str());
 	}
 
@@ -1213,7 +1724,7 @@ public:
 		//uint32_t = crc_32(buf, 75);
 		//buf[75] = 
 
-		hid_write(handle, buf, 31);
+		transport->write(buf, 31);
 	}
 
 	void set_ds4_rumble_light_bt(unsigned char smallRumble, unsigned char bigRumble,
@@ -1251,7 +1762,7 @@ public:
 		//buf[77] = (crc >> 8) & 0xFF;
 		//buf[78] = crc & 0xFF;
 
-		hid_write(handle, buf, 79);
+		transport->write(buf, 79);
 	}
 
 	//// mfosse credits Hypersect (Ryan Juckett), but I've removed deadzones so the consuming application can deal with them
@@ -1314,9 +1825,9 @@ public:
 				buf[i] = buf[i + 3];
 			}
 
-			res = hid_write(handle, buf, sizeof(*hdr) + sizeof(*pkt));
+			res = transport->write(buf, sizeof(*hdr) + sizeof(*pkt));
 
-			res = hid_read_timeout(handle, buf, sizeof(buf), 1000);
+			res = transport->read_timeout(buf, sizeof(buf), 1000);
 			if (res == 0)
 			{
 				return false;
@@ -1355,9 +1866,9 @@ public:
 			for (int i = 0; i < write_len; i++) {
 				buf[0x10 + i] = test_buf[i];
 			}
-			res = hid_write(handle, buf, sizeof(*hdr) + sizeof(*pkt) + write_len);
+			res = transport->write(buf, sizeof(*hdr) + sizeof(*pkt) + write_len);
 
-			res = hid_read(handle, buf, sizeof(buf));
+			res = transport->read(buf, sizeof(buf));
 
 			if (*(uint16_t*)&buf[0xD] == 0x1180)
 				break;
@@ -7,181 +7,770 @@
 #include <chrono>
 #include <thread>
 #include <shared_mutex>
-#include <unordered_map>
+#include <mutex>
+#include <vector>
 #include <atomic>
+#include <condition_variable>
 #include "SensorFusion.cpp"
 #include "JoyShock.cpp"
+#include "Trace.cpp"
+#include "Simulator.cpp"
 #include "InputHelpers.cpp"
+#include "ReportParsers.cpp"
+#include "Reactor.cpp"
 
 std::shared_timed_mutex _callbackLock;
 void(*_pollCallback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float) = nullptr;
 void(*_pollTouchCallback)(int, TOUCH_STATE, TOUCH_STATE, float) = nullptr;
-std::unordered_map<int, JoyShock*> _joyshocks;
-// https://stackoverflow.com/questions/41206861/atomic-increment-and-return-counter
-static std::atomic<int> _joyshockHandleCounter;
-static int GetUniqueHandle()
-{
-	return _joyshockHandleCounter++;
+void(*_imuSampleCallback)(int, IMU_STATE, MOTION_STATE, float) = nullptr;
+
+// one IMU sample as it went into sensor fusion, for the IMU sample callback. Switch reports can have 3 of these (JslSetIMUSamples)
+struct IMU_SAMPLE_EVENT {
+	IMU_STATE imuState;
+	MOTION_STATE motionState;
+	float deltaTime;
+};
+
+// everything a callback needs about one report, so it can be called later on the dispatcher thread
+struct CALLBACK_EVENT {
+	int deviceId;
+	bool hasTouch;
+	float deltaTime;
+	JOY_SHOCK_STATE simpleState;
+	JOY_SHOCK_STATE lastSimpleState;
+	IMU_STATE imuState;
+	IMU_STATE lastImuState;
+	TOUCH_STATE touchState;
+	TOUCH_STATE lastTouchState;
+	int numImuSamples;
+	IMU_SAMPLE_EVENT imuSamples[3];
+};
+// in JS_CALLBACK_DISPATCH_ASYNC, polling threads queue reports here and one dispatcher thread calls the callbacks
+static const int callback_queue_size = 1024;
+BoundedQueue<CALLBACK_EVENT, callback_queue_size> _callbackQueue;
+std::atomic<int> _callbackDispatchMode(JS_CALLBACK_DISPATCH_INLINE);
+std::atomic<unsigned long long> _callbacksQueued(0);
+std::atomic<unsigned long long> _callbacksDispatched(0);
+std::atomic<unsigned long long> _callbacksDropped(0);
+std::atomic<int> _callbackQueueMaxDepth(0);
+// started and stopped with _joyshocksWriteLock held
+std::thread* _dispatcherThread = nullptr;
+std::atomic<bool> _cancelDispatcher(false);
+// the dispatcher sleeps when there's nothing to do. pollers only touch the mutex if it's actually asleep
+std::atomic<bool> _dispatcherSleeping(false);
+std::mutex _dispatcherWakeLock;
+std::condition_variable _dispatcherWake;
+// fixed-size table of devices. looking a device up by handle is just an index, and never takes a lock
+static const int max_devices = 256;
+HandleTable<JoyShock, max_devices> _joyshocks;
+// getters don't lock, so devices are only deleted once no getter can still be using them
+ReadEpochs _joyshockReaders;
+// connecting and disconnecting are serialised with each other, but never with getters
+std::mutex _joyshocksWriteLock;
+
+// keeps the device it refers to from being deleted until it goes out of scope. use it like a JoyShock*
+class JoyShockRef {
+public:
+	explicit JoyShockRef(int handle) : _scope(_joyshockReaders) {
+		_jc = _joyshocks.get(handle);
+	}
+
+	JoyShock* operator->() const {
+		return _jc;
+	}
+
+	operator JoyShock*() const {
+		return _jc;
+	}
+
+private:
+	ReadScope _scope;
+	JoyShock* _jc;
+};
+
+// recordings and replays. only touched with _joyshocksWriteLock held
+// if this isn't empty, every device connected through hidapi has everything it sends recorded into a file in this directory
+std::string _recordingDirectory;
+int _numRecordings = 0;
+// recordings to play back as if they were devices, each time we connect
+struct REPLAY_DEVICE {
+	std::string path;
+	bool realTime;
+};
+std::vector<REPLAY_DEVICE> _replayDevices;
+// simulated controllers to add each time we connect, one entry per device
+std::vector<SIMULATED_DEVICE_SETTINGS> _simulatedDevices;
+// calibration settings for every device. also only touched with _joyshocksWriteLock held
+float _calibrationWindowSeconds = 600.0f;
+// JS_MOTION_* for devices when they connect
+int _defaultMotionMode = JS_MOTION_EAGER;
+int _defaultFusionAlgorithm = JS_FUSION_COMPLEMENTARY;
+// if this isn't empty, calibration is loaded from this file for each device when we connect, and saved back to it when we disconnect
+std::string _calibrationProfilePath;
+CalibrationProfiles _calibrationProfiles;
+
+static Transport* OpenTransport(struct hid_device_info* dev) {
+	HidTransport* hid = new HidTransport(dev->path);
+	if (_recordingDirectory.empty() || !hid->is_open()) {
+		return hid;
+	}
+	RECORDING_HEADER header;
+	header.vendorId = dev->vendor_id;
+	header.productId = dev->product_id;
+	header.interfaceNumber = dev->interface_number;
+	// serial numbers are just hex digits and colons
+	for (const wchar_t* c = dev->serial_number; c != nullptr && *c != 0; c++) {
+		header.serial.push_back((char)*c);
+	}
+	char fileName[64];
+	snprintf(fileName, sizeof(fileName), "/%04x-%04x-%d.jslrec", dev->vendor_id, dev->product_id, _numRecordings++);
+	const std::string path = _recordingDirectory + fileName;
+	RecordingTransport* recorder = new RecordingTransport(hid, path.c_str(), header);
+	if (!recorder->is_recording()) {
+		printf("Couldn't record to %s\n", path.c_str());
+	}
+	return recorder;
+}
+
+// give the device a handle and make it visible to getters. returns nullptr if we're out of room.
+// if transport is null, the device is opened through hidapi (and recorded, if we're recording). otherwise the device takes ownership of it
+static JoyShock* AddJoyShock(struct hid_device_info* dev, Transport* transport = nullptr) {
+	int handle = _joyshocks.reserve();
+	if (handle < 0) {
+		printf("Too many devices connected. Ignoring %ls\n", dev->serial_number);
+		delete transport;
+		return nullptr;
+	}
+	JoyShock* jc = new JoyShock(dev, handle, transport != nullptr ? transport : OpenTransport(dev));
+	_joyshocks.publish(handle, jc);
+	return jc;
 }
 
-// https://stackoverflow.com/questions/25144887/map-unordered-map-prefer-find-and-then-at-or-try-at-catch-out-of-range
-static JoyShock* GetJoyShockFromHandle(int handle) {
-	auto iter = _joyshocks.find(handle);
+static void AddReplayDevices() {
+	for (const REPLAY_DEVICE& replay : _replayDevices) {
+		ReplayTransport* transport = new ReplayTransport(replay.path.c_str(), replay.realTime);
+		if (!transport->is_valid()) {
+			printf("Couldn't replay %s\n", replay.path.c_str());
+			delete transport;
+			continue;
+		}
+		const RECORDING_HEADER& header = transport->header();
+		std::wstring serial(header.serial.begin(), header.serial.end());
+		struct hid_device_info dev = {};
+		dev.path = (char*)replay.path.c_str();
+		dev.vendor_id = header.vendorId;
+		dev.product_id = header.productId;
+		dev.interface_number = header.interfaceNumber;
+		dev.serial_number = (wchar_t*)serial.c_str();
+		AddJoyShock(&dev, transport);
+	}
+}
 
-	if (iter != _joyshocks.end())
+static void AddSimulatedDevices() {
+	for (int i = 0; i < (int)_simulatedDevices.size(); i++) {
+		char path[32];
+		wchar_t serial[32];
+		snprintf(path, sizeof(path), "simulated:%d", i);
+		swprintf(serial, sizeof(serial) / sizeof(serial[0]), L"sim-%d", i);
+		struct hid_device_info dev = {};
+		SimulatedTransport::describe(_simulatedDevices[i].type, dev);
+		dev.path = path;
+		dev.serial_number = serial;
+		// same seed each time, so a run can be repeated
+		AddJoyShock(&dev, new SimulatedTransport(_simulatedDevices[i], (unsigned int)i + 1));
+	}
+}
+
+// serial numbers are just hex digits and colons. empty if there's nothing to go by
+static std::string GetSerial(JoyShock* jc) {
+	std::string serial;
+	for (const wchar_t* c = jc->serial; c != nullptr && *c != 0; c++) {
+		if (*c <= L' ' || *c > L'~') {
+			return std::string();
+		}
+		serial.push_back((char)*c);
+	}
+	return serial;
+}
+
+// only call with _joyshocksWriteLock held
+static void LoadCalibrationProfiles(const std::vector<JoyShock*>& devices) {
+	if (_calibrationProfilePath.empty()) {
+		return;
+	}
+	_calibrationProfiles.load(_calibrationProfilePath);
+	for (JoyShock* jc : devices) {
+		CALIBRATION_PROFILE profile;
+		const std::string serial = GetSerial(jc);
+		if (!serial.empty() && _calibrationProfiles.find(serial, profile)) {
+			jc->apply_calibration_profile(profile);
+		}
+	}
+}
+
+// only call with _joyshocksWriteLock held. goes by what each device last published, so they can still be being polled
+static bool SaveCalibrationProfiles(const std::vector<JoyShock*>& devices) {
+	if (_calibrationProfilePath.empty()) {
+		return false;
+	}
+	for (JoyShock* jc : devices) {
+		const CALIBRATION_PROFILE profile = jc->get_published_state().calibration;
+		const std::string serial = GetSerial(jc);
+		// nothing worth remembering if it's never calibrated
+		const bool calibrated = profile.numSamples > 0 || profile.offsetX != 0.0f || profile.offsetY != 0.0f || profile.offsetZ != 0.0f;
+		if (!serial.empty() && calibrated) {
+			_calibrationProfiles.set(serial, profile);
+		}
+	}
+	return _calibrationProfiles.save(_calibrationProfilePath);
+}
+
+// handshake, so it starts sending reports
+static void InitJoyShock(JoyShock* jc) {
+	if (jc->controller_type == ControllerType::s_ds4) {
+		if (!jc->is_usb) {
+			jc->init_ds4_bt();
+		}
+		else {
+			jc->init_ds4_usb();
+		}
+	} // dualsense
+	else if (jc->controller_type == ControllerType::s_ds)
 	{
-		return iter->second;
-		// iter is item pair in the map. The value will be accessible as `iter->second`.
+	} // charging grip
+	else if (jc->is_usb) {
+		//printf("USB\n");
+		jc->init_usb();
 	}
-	return nullptr;
+	else {
+		//printf("BT\n");
+		jc->init_bt();
+	}
+	// all get time now for polling
+	jc->last_polled = std::chrono::steady_clock::now();
+	jc->delta_time = 0.0;
+
+	jc->deviceNumber = 0; // left
+
+	jc->set_calibration_window(_calibrationWindowSeconds);
+	jc->requested_motion_mode.store(_defaultMotionMode, std::memory_order_relaxed);
+	jc->requested_fusion_algorithm.store(_defaultFusionAlgorithm, std::memory_order_relaxed);
+
+	choose_report_parser(jc);
 }
 
-void pollIndividualLoop(JoyShock *jc) {
-	if (!jc->handle) { return; }
+// every connected device. only for connecting and disconnecting, which can't race with each other
+static std::vector<JoyShock*> GetAllJoyShocks() {
+	std::vector<JoyShock*> result;
+	for (int i = 0; i < _joyshocks.num_slots_used(); i++) {
+		JoyShock* jc = _joyshocks.get_at(i);
+		if (jc != nullptr) {
+			result.push_back(jc);
+		}
+	}
+	return result;
+}
 
-	hid_set_nonblocking(jc->handle, 0);
-	//hid_set_nonblocking(jc->handle, 1); // temporary, to see if it helps. this means we'll have a crazy spin
+// how many input reports without IMU data before we try to enable it again -- about a second's worth
+static int GetNoIMULimit(JoyShock* jc) {
+	return (int)(jc->get_poll_rate() + 0.5f);
+}
 
-	int numTimeOuts = 0;
-	int numNoIMU = 0;
-	bool hasIMU = false;
-	int noIMULimit;
-	switch (jc->controller_type)
+// called when a read gave us nothing for a whole second. returns false if we should forget this controller
+static bool HandleReadTimeout(JoyShock* jc) {
+	jc->num_timeouts++;
+	// 10 seconds of no signal means forget this controller
+	if (jc->num_timeouts == 10)
 	{
-	case ControllerType::s_ds4:
-		noIMULimit = 250;
-		break;
-	case ControllerType::s_ds:
-		noIMULimit = 250;
-		break;
-	case ControllerType::n_switch:
-	default:
-		noIMULimit = 67;
-	}
-	float wakeupTimer = 0.0f;
+		printf("Controller %d timed out\n", jc->intHandle);
+		Trace::instant("timed out", jc->intHandle);
+		return false;
+	}
+	Trace::instant("read timeout", jc->intHandle);
 
-	while (!jc->cancel_thread) {
-		// get input:
-		unsigned char buf[64];
-		memset(buf, 0, 64);
+	// try wake up the controller with the appropriate message
+	if (jc->controller_type != ControllerType::n_switch)
+	{
+		// TODO
+	}
+	else
+	{
+		TraceScope trace("re-initialise", jc->intHandle);
+		if (jc->is_usb)
+		{
+			printf("Attempting to re-initialise controller %d\n", jc->intHandle);
+			if (jc->init_usb())
+			{
+				jc->num_timeouts = 0;
+			}
+		}
+		else
+		{
+			printf("Attempting to re-initialise controller %d\n", jc->intHandle);
+			if (jc->init_bt())
+			{
+				jc->num_timeouts = 0;
+			}
+		}
+	}
+	return true;
+}
 
-		// 10 seconds of no signal means forget this controller
-		int res = hid_read_timeout(jc->handle, buf, 64, 1000);
+// called on polling threads. never waits: if the dispatcher has fallen too far behind, the report is dropped (and counted) rather than holding up polling
+static void QueueCallbacks(JoyShock* jc, const IMU_SAMPLE_EVENT* imuSamples, int numImuSamples) {
+	CALLBACK_EVENT event;
+	event.deviceId = jc->intHandle;
+	event.hasTouch = jc->controller_type != ControllerType::n_switch;
+	event.deltaTime = jc->delta_time;
+	event.simpleState = jc->simple_state;
+	event.lastSimpleState = jc->last_simple_state;
+	event.imuState = jc->imu_state;
+	event.lastImuState = jc->last_imu_state;
+	event.touchState = jc->touch_state;
+	event.lastTouchState = jc->last_touch_state;
+	event.numImuSamples = numImuSamples;
+	for (int i = 0; i < numImuSamples; i++) {
+		event.imuSamples[i] = imuSamples[i];
+	}
+	if (!_callbackQueue.try_push(event))
+	{
+		_callbacksDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	_callbacksQueued.fetch_add(1, std::memory_order_relaxed);
+	const int depth = _callbackQueue.size();
+	int maxDepth = _callbackQueueMaxDepth.load(std::memory_order_relaxed);
+	while (depth > maxDepth && !_callbackQueueMaxDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed)) {}
+	// pairs with the fence in DispatchLoop: either we see that it's going to sleep, or it sees what we just queued
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_dispatcherSleeping.load(std::memory_order_relaxed) && _dispatcherSleeping.exchange(false))
+	{
+		std::lock_guard<std::mutex> guard(_dispatcherWakeLock);
+		_dispatcherWake.notify_one();
+	}
+}
 
-		if (res == 0)
+static void DispatchLoop() {
+	Trace::name_thread("callback dispatcher");
+	CALLBACK_EVENT event;
+	while (!_cancelDispatcher)
+	{
+		if (!_callbackQueue.try_pop(event))
 		{
-			numTimeOuts++;
-			if (numTimeOuts == 10)
+			_dispatcherSleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (_callbackQueue.size() == 0)
 			{
-				printf("Controller %d timed out\n", jc->handle);
-				break;
+				std::unique_lock<std::mutex> lock(_dispatcherWakeLock);
+				// the timeout is only a backstop so that cancelling never depends on a report arriving
+				_dispatcherWake.wait_for(lock, std::chrono::milliseconds(100), [] { return !_dispatcherSleeping.load() || _cancelDispatcher.load(); });
 			}
-			else
+			_dispatcherSleeping.store(false, std::memory_order_relaxed);
+			continue;
+		}
+		TraceScope trace("callbacks", event.deviceId);
+		// same lock as inline callbacks, so JslSetCallback(nullptr) still means no more calls once it returns
+		_callbackLock.lock_shared();
+		if (_imuSampleCallback != nullptr) {
+			for (int i = 0; i < event.numImuSamples; i++) {
+				_imuSampleCallback(event.deviceId, event.imuSamples[i].imuState, event.imuSamples[i].motionState, event.imuSamples[i].deltaTime);
+			}
+		}
+		if (_pollCallback != nullptr) {
+			_pollCallback(event.deviceId, event.simpleState, event.lastSimpleState, event.imuState, event.lastImuState, event.deltaTime);
+		}
+		if (event.hasTouch && _pollTouchCallback != nullptr) {
+			_pollTouchCallback(event.deviceId, event.touchState, event.lastTouchState, event.deltaTime);
+		}
+		_callbackLock.unlock_shared();
+		_callbacksDispatched.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+// only call with _joyshocksWriteLock held
+static void StartDispatcher() {
+	if (_dispatcherThread != nullptr) {
+		return;
+	}
+	// anything left over from last time is stale
+	CALLBACK_EVENT stale;
+	while (_callbackQueue.try_pop(stale)) {}
+	_cancelDispatcher = false;
+	_dispatcherThread = new std::thread(DispatchLoop);
+}
+
+// only call with _joyshocksWriteLock held
+static void StopDispatcher() {
+	if (_dispatcherThread == nullptr) {
+		return;
+	}
+	_cancelDispatcher = true;
+	{
+		std::lock_guard<std::mutex> guard(_dispatcherWakeLock);
+		_dispatcherWake.notify_one();
+	}
+	_dispatcherThread->join();
+	delete _dispatcherThread;
+	_dispatcherThread = nullptr;
+}
+
+// everything we do with a report once we've read it, whichever thread read it
+static void HandleReport(JoyShock* jc, unsigned char* buf, int len) {
+	jc->num_timeouts = 0;
+	const uint64_t arrived = TickClock::now();
+	if (jc->last_arrival_ticks != 0) {
+		jc->latency[JS_LATENCY_INTER_ARRIVAL].record(arrived - jc->last_arrival_ticks);
+	}
+	jc->last_arrival_ticks = arrived;
+	bool hasIMU = false;
+	jc->num_imu_samples = 0;
+	// only worked out if someone wants them
+	IMU_SAMPLE_EVENT imuSamples[3];
+	int numImuSamples = 0;
+	const bool wantImuSamples = _imuSampleCallback != nullptr;
+	// we want to be able to do these check-and-calls without fear of interruption by another thread. there could be many threads (as many as connected controllers),
+	// and the callback could be time-consuming (up to the user), so we use a readers-writer-lock.
+	const bool handled = jc->parse_report != nullptr ? jc->parse_report(jc, buf, len, hasIMU) : handle_input(jc, buf, len, hasIMU);
+	if (handled) { // but the user won't necessarily have a callback at all, so we'll skip the lock altogether in that case
+		const uint64_t parsed = TickClock::now();
+		jc->latency[JS_LATENCY_PARSE].record(parsed - arrived);
+		jc->poll_rate.update(jc->delta_time);
+		Trace::complete("parse", jc->intHandle, arrived, parsed);
+		if (hasIMU)
+		{
+			jc->apply_motion_mode();
+			if (jc->cue_motion_reset)
 			{
-				// try wake up the controller with the appropriate message
-				if (jc->controller_type != ControllerType::n_switch)
-				{
-					// TODO
-				}
-				else
+				//printf("RESET motion\n");
+				jc->cue_motion_reset = false;
+				jc->reset_motion();
+			}
+			// each of the report's samples in turn, spread evenly over the time since the last report. or just the one, if they've been averaged
+			const IMU_STATE* samples = jc->num_imu_samples > 0 ? jc->imu_samples : &jc->imu_state;
+			const int numSamples = jc->num_imu_samples > 0 ? jc->num_imu_samples : 1;
+			const float sampleDeltaTime = jc->delta_time / numSamples;
+			MOTION_STATE sampleStates[JoyShock::max_report_samples];
+			jc->fuse_motion(samples, numSamples, sampleDeltaTime, wantImuSamples ? sampleStates : nullptr);
+			if (wantImuSamples)
+			{
+				for (int i = 0; i < numSamples; i++)
 				{
-					if (jc->is_usb)
-					{
-						printf("Attempting to re-initialise controller %d\n", jc->handle);
-						if (jc->init_usb())
-						{
-							numTimeOuts = 0;
-						}
-					}
-					else
-					{
-						printf("Attempting to re-initialise controller %d\n", jc->handle);
-						if (jc->init_bt())
-						{
-							numTimeOuts = 0;
-						}
-					}
+					imuSamples[numImuSamples++] = { samples[i], sampleStates[i], sampleDeltaTime };
 				}
 			}
+			const uint64_t fused = TickClock::now();
+			jc->latency[JS_LATENCY_MOTION].record(fused - parsed);
+			Trace::complete("fusion", jc->intHandle, parsed, fused);
+			//printf("gyro %.4f, %.4f, %.4f ... accel %.4f, %.4f, %.4f ... local accel %.4f, %.4f, %.4f ... grav %.4f, %.4f, %.4f ... quat %.4f, %.4f, %.4f, %.4f\n",
+			//	jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
+			//	jc->imu_state.accelX, jc->imu_state.accelY, jc->imu_state.accelZ,
+			//	jc->motion.Accel.x, jc->motion.Accel.y, jc->motion.Accel.z,
+			//	jc->motion.Grav.x, jc->motion.Grav.y, jc->motion.Grav.z,
+			//	jc->motion.Quaternion.w, jc->motion.Quaternion.x, jc->motion.Quaternion.y, jc->motion.Quaternion.z);
 		}
 		else
 		{
-			numTimeOuts = 0;
-			// we want to be able to do these check-and-calls without fear of interruption by another thread. there could be many threads (as many as connected controllers),
-			// and the callback could be time-consuming (up to the user), so we use a readers-writer-lock.
-			if (handle_input(jc, buf, 64, hasIMU)) { // but the user won't necessarily have a callback at all, so we'll skip the lock altogether in that case
-				if (hasIMU)
-				{
-					if (jc->cue_motion_reset)
-					{
-						//printf("RESET motion\n");
-						jc->cue_motion_reset = false;
-						jc->motion.Reset();
-					}
-					jc->motion.Update(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
-						jc->imu_state.accelX, jc->imu_state.accelY, jc->imu_state.accelZ,
-						jc->accel_magnitude, jc->delta_time);
-					//printf("gyro %.4f, %.4f, %.4f ... accel %.4f, %.4f, %.4f ... local accel %.4f, %.4f, %.4f ... grav %.4f, %.4f, %.4f ... quat %.4f, %.4f, %.4f, %.4f\n",
-					//	jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
-					//	jc->imu_state.accelX, jc->imu_state.accelY, jc->imu_state.accelZ,
-					//	jc->motion.Accel.x, jc->motion.Accel.y, jc->motion.Accel.z,
-					//	jc->motion.Grav.x, jc->motion.Grav.y, jc->motion.Grav.z,
-					//	jc->motion.Quaternion.w, jc->motion.Quaternion.x, jc->motion.Quaternion.y, jc->motion.Quaternion.z);
-				}
-				else
-				{
-					//printf("No IMU input detected\n");
-				}
-				if (_pollCallback != nullptr || _pollTouchCallback != nullptr)
-				{
-					_callbackLock.lock_shared();
-					if (_pollCallback != nullptr) {
-						_pollCallback(jc->intHandle, jc->simple_state, jc->last_simple_state, jc->imu_state, jc->last_imu_state, jc->delta_time);
-					}
-					// touchpad will have its own callback so that it doesn't change the existing api
-					if (jc->controller_type != ControllerType::n_switch && _pollTouchCallback != nullptr) {
-						_pollTouchCallback(jc->intHandle, jc->touch_state, jc->last_touch_state, jc->delta_time);
-					}
-					_callbackLock.unlock_shared();
-				}
-				// count how many have no IMU result. We want to periodically attempt to enable IMU if it's not present
-				if (!hasIMU)
-				{
-					numNoIMU++;
-					if (numNoIMU == noIMULimit)
-					{
-						memset(buf, 0, 64);
-						jc->enable_IMU(buf, 64);
-						numNoIMU = 0;
+			//printf("No IMU input detected\n");
+		}
+		jc->publish_state();
+		const uint64_t published = TickClock::now();
+		jc->latency[JS_LATENCY_READ_TO_PUBLISH].record(published - arrived);
+		if (_pollCallback != nullptr || _pollTouchCallback != nullptr || wantImuSamples)
+		{
+			if (_callbackDispatchMode.load(std::memory_order_relaxed) == JS_CALLBACK_DISPATCH_ASYNC)
+			{
+				QueueCallbacks(jc, imuSamples, numImuSamples);
+			}
+			else
+			{
+				_callbackLock.lock_shared();
+				if (_imuSampleCallback != nullptr) {
+					for (int i = 0; i < numImuSamples; i++) {
+						_imuSampleCallback(jc->intHandle, imuSamples[i].imuState, imuSamples[i].motionState, imuSamples[i].deltaTime);
 					}
 				}
-				else
-				{
-					numNoIMU = 0;
+				if (_pollCallback != nullptr) {
+					_pollCallback(jc->intHandle, jc->simple_state, jc->last_simple_state, jc->imu_state, jc->last_imu_state, jc->delta_time);
 				}
-				
-				// dualshock 4 bluetooth might need waking up
-				if (jc->controller_type == ControllerType::s_ds4 && !jc->is_usb)
-				{
-					wakeupTimer += jc->delta_time;
-					if (wakeupTimer > 30.0f)
-					{
-						jc->init_ds4_bt();
-						wakeupTimer = 0.0f;
-					}
+				// touchpad will have its own callback so that it doesn't change the existing api
+				if (jc->controller_type != ControllerType::n_switch && _pollTouchCallback != nullptr) {
+					_pollTouchCallback(jc->intHandle, jc->touch_state, jc->last_touch_state, jc->delta_time);
 				}
+				_callbackLock.unlock_shared();
+			}
+			const uint64_t calledBack = TickClock::now();
+			jc->latency[JS_LATENCY_CALLBACK].record(calledBack - published);
+			Trace::complete("callbacks", jc->intHandle, published, calledBack);
+		}
+		// count how many have no IMU result. We want to periodically attempt to enable IMU if it's not present
+		if (!hasIMU)
+		{
+			jc->num_no_imu++;
+			// the limit follows the measured poll rate, so it can drop below a count that's already going
+			if (jc->num_no_imu >= GetNoIMULimit(jc))
+			{
+				TraceScope trace("enable IMU", jc->intHandle);
+				unsigned char imuBuf[64];
+				jc->enable_IMU(imuBuf, 64);
+				jc->num_no_imu = 0;
+			}
+		}
+		else
+		{
+			jc->num_no_imu = 0;
+		}
+
+		// dualshock 4 bluetooth might need waking up
+		if (jc->controller_type == ControllerType::s_ds4 && !jc->is_usb)
+		{
+			jc->ds4_wakeup_timer += jc->delta_time;
+			if (jc->ds4_wakeup_timer > 30.0f)
+			{
+				TraceScope trace("DS4 wakeup", jc->intHandle);
+				jc->init_ds4_bt();
+				jc->ds4_wakeup_timer = 0.0f;
+			}
+		}
+	}
+}
+
+void pollIndividualLoop(JoyShock *jc) {
+	if (!jc->transport->is_open()) { return; }
+
+	char threadName[64];
+	snprintf(threadName, sizeof(threadName), "poll device %d", jc->intHandle);
+	Trace::name_thread(threadName);
+
+	jc->transport->set_nonblocking(0);
+	//jc->transport->set_nonblocking(1); // temporary, to see if it helps. this means we'll have a crazy spin
+
+	while (!jc->cancel_thread) {
+		// get input:
+		unsigned char buf[64];
+		memset(buf, 0, 64);
+
+		int res;
+		{
+			TraceScope trace("read", jc->intHandle);
+			res = jc->transport->read_timeout(buf, 64, 1000);
+		}
+
+		if (res == 0)
+		{
+			if (!HandleReadTimeout(jc))
+			{
+				break;
+			}
+		}
+		else if (res < 0)
+		{
+			printf("Controller %d disconnected\n", jc->intHandle);
+			break;
+		}
+		else
+		{
+			HandleReport(jc, buf, 64);
+		}
+	}
+}
+
+// reactor polling: one thread (or a few) waiting on every controller's hidraw node with epoll, instead of a blocking thread per controller
+static bool ReactorReadable(ReactorSource* source) {
+	JoyShock* jc = (JoyShock*)source->context;
+	if (jc->cancel_thread) {
+		return false;
+	}
+	// read everything that's waiting, one report at a time
+	for (int i = 0; i < 64; i++) {
+		unsigned char buf[64];
+		memset(buf, 0, 64);
+		int res;
+		{
+			TraceScope trace("read", jc->intHandle);
+			res = jc->read_reactor_report(buf, 64);
+		}
+		if (res == 0) {
+			break;
+		}
+		if (res < 0) {
+			printf("Controller %d disconnected\n", jc->intHandle);
+			return false;
+		}
+		HandleReport(jc, buf, 64);
+	}
+	return true;
+}
+
+static bool ReactorTimeout(ReactorSource* source) {
+	JoyShock* jc = (JoyShock*)source->context;
+	if (jc->cancel_thread) {
+		return false;
+	}
+	// hidapi's handle saw every report we read through the reactor. clear them out so re-initialising reads real responses
+	jc->drain_reports();
+	return HandleReadTimeout(jc);
+}
+
+static int _pollingMode = JS_POLL_THREAD_PER_DEVICE;
+static int _numReactorThreads = 1;
+static std::vector<Reactor*> _reactors;
+
+static void StopReactors() {
+	for (Reactor* reactor : _reactors) {
+		delete reactor;
+	}
+	_reactors.clear();
+}
+
+// puts every controller the reactor can watch on it, and returns the rest, which need a thread each.
+// that's all of them if the reactor wasn't asked for or can't be used. otherwise it's any that have nothing to wait on, like replayed controllers
+static std::vector<JoyShock*> StartReactors(const std::vector<JoyShock*>& devices) {
+	if (_pollingMode != JS_POLL_REACTOR || !Reactor::is_supported()) {
+		return devices;
+	}
+	std::vector<JoyShock*> reactorDevices;
+	std::vector<JoyShock*> individualDevices;
+	for (JoyShock* jc : devices)
+	{
+		if (jc->open_reactor_fd())
+		{
+			reactorDevices.push_back(jc);
+		}
+		else
+		{
+			individualDevices.push_back(jc);
+		}
+	}
+	if (reactorDevices.empty()) {
+		return individualDevices;
+	}
+	int numReactors = _numReactorThreads < 1 ? 1 : _numReactorThreads;
+	if (numReactors > (int)reactorDevices.size()) {
+		numReactors = (int)reactorDevices.size();
+	}
+	for (int i = 0; i < numReactors; i++) {
+		_reactors.push_back(new Reactor(ReactorReadable, ReactorTimeout, 1000));
+	}
+	for (int i = 0; i < (int)reactorDevices.size(); i++) {
+		_reactors[i % numReactors]->add(reactorDevices[i]->reactor_fd, reactorDevices[i]);
+	}
+	for (Reactor* reactor : _reactors) {
+		if (!reactor->start()) {
+			StopReactors();
+			for (JoyShock* jc : reactorDevices)
+			{
+				jc->close_reactor_fd();
 			}
+			return devices;
 		}
 	}
+	return individualDevices;
+}
+
+void JslSetPollingMode(int mode, int numThreads)
+{
+	// takes effect on the next JslConnectDevices
+	_pollingMode = mode;
+	_numReactorThreads = numThreads;
+}
+
+void JslSetCallbackDispatchMode(int mode)
+{
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_callbackDispatchMode = mode;
+	if (mode != JS_CALLBACK_DISPATCH_ASYNC) {
+		StopDispatcher();
+	}
+	else if (_joyshocks.count() > 0) {
+		StartDispatcher();
+	}
+}
+
+CALLBACK_QUEUE_STATS JslGetCallbackQueueStats()
+{
+	CALLBACK_QUEUE_STATS stats = {};
+	stats.depth = _callbackQueue.size();
+	stats.capacity = _callbackQueue.capacity();
+	stats.maxDepth = _callbackQueueMaxDepth.load();
+	stats.queued = _callbacksQueued.load();
+	stats.dispatched = _callbacksDispatched.load();
+	stats.dropped = _callbacksDropped.load();
+	return stats;
+}
+
+void JslResetCallbackQueueStats()
+{
+	_callbackQueueMaxDepth = 0;
+	_callbacksQueued = 0;
+	_callbacksDispatched = 0;
+	_callbacksDropped = 0;
+}
+
+void JslSetTracing(bool enabled)
+{
+	Trace::set_enabled(enabled);
+}
+
+int JslWriteTrace(const char* path)
+{
+	return Trace::write(path);
+}
+
+void JslSetRecordingDirectory(const char* directory)
+{
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_recordingDirectory = directory != nullptr ? directory : "";
+	_numRecordings = 0;
+}
+
+bool JslAddReplayDevice(const char* path, bool realTime)
+{
+	ReplayTransport check(path, false);
+	if (!check.is_valid()) {
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_replayDevices.push_back({ path, realTime });
+	return true;
+}
+
+void JslClearReplayDevices()
+{
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_replayDevices.clear();
+}
+
+bool JslAddSimulatedDevices(int type, int count, float packetLoss, float jitterMs, float disconnectAfterSeconds)
+{
+	if (type < JS_SIMULATE_DS4_USB || type > JS_SIMULATE_PRO_CONTROLLER_USB) {
+		return false;
+	}
+	SIMULATED_DEVICE_SETTINGS settings;
+	settings.type = type;
+	settings.packetLoss = packetLoss;
+	settings.jitter = jitterMs / 1000.0f;
+	settings.disconnectAfter = disconnectAfterSeconds;
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_simulatedDevices.insert(_simulatedDevices.end(), count > 0 ? count : 0, settings);
+	return true;
+}
+
+void JslClearSimulatedDevices()
+{
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_simulatedDevices.clear();
 }
 
+static void DisconnectAndDisposeAll();
+
 int JslConnectDevices()
 {
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
 	// for writing to console:
 	//freopen("CONOUT$", "w", stdout);
-	if (_joyshocks.size() > 0) {
+	if (_joyshocks.count() > 0) {
 		// already connected? clean up old stuff!
-		JslDisconnectAndDisposeAll();
+		DisconnectAndDisposeAll();
 	}
 
 	// most of the joycon and pro controller stuff here is thanks to mfosse's vjoy feeder
@@ -204,22 +793,19 @@ int JslConnectDevices()
 			// bluetooth, left / right joycon:
 			if (cur_dev->product_id == JOYCON_L_BT || cur_dev->product_id == JOYCON_R_BT) {
 				//printf("JOYCON\n");
-				JoyShock* jc = new JoyShock(cur_dev, GetUniqueHandle());
-				_joyshocks.emplace(jc->intHandle, jc);
+				AddJoyShock(cur_dev);
 			}
 
 			// pro controller:
 			if (cur_dev->product_id == PRO_CONTROLLER) {
-				JoyShock* jc = new JoyShock(cur_dev, GetUniqueHandle());
+				AddJoyShock(cur_dev);
 				//printf("PRO\n");
-				_joyshocks.emplace(jc->intHandle, jc);
 			}
 
 			// charging grip:
 			if (cur_dev->product_id == JOYCON_CHARGING_GRIP) {
-				JoyShock* jc = new JoyShock(cur_dev, GetUniqueHandle());
+				AddJoyShock(cur_dev);
 				//printf("GRIP\n");
-				_joyshocks.emplace(jc->intHandle, jc);
 			}
 
 		}
@@ -241,8 +827,7 @@ int JslConnectDevices()
 				cur_dev->product_id == DS4_USB_V2 ||
 				cur_dev->product_id == DS4_USB_DONGLE ||
 				cur_dev->product_id == DS4_BT) {
-				JoyShock* jc = new JoyShock(cur_dev, GetUniqueHandle());
-				_joyshocks.emplace(jc->intHandle, jc);
+				AddJoyShock(cur_dev);
 			}
 		}
 
@@ -259,8 +844,7 @@ int JslConnectDevices()
 			// usb or bluetooth ds4:
 			printf("DS\n");
 			if (cur_dev->product_id == DS_USB) {
-				JoyShock* jc = new JoyShock(cur_dev, GetUniqueHandle());
-				_joyshocks.emplace(jc->intHandle, jc);
+				AddJoyShock(cur_dev);
 			}
 		}
 
@@ -268,44 +852,24 @@ int JslConnectDevices()
 	}
 	hid_free_enumeration(devs);
 
+	AddReplayDevices();
+	AddSimulatedDevices();
+
 	// init joyshocks:
-	for (std::pair<int, JoyShock*> pair : _joyshocks)
+	std::vector<JoyShock*> devices = GetAllJoyShocks();
+	for (JoyShock* jc : devices)
 	{
-		JoyShock* jc = pair.second;
-		if (jc->controller_type == ControllerType::s_ds4) {
-			if (!jc->is_usb) {
-				jc->init_ds4_bt();
-			}
-			else {
-				jc->init_ds4_usb();
-			}
-		} // dualsense
-		else if (jc->controller_type == ControllerType::s_ds)
-		{
-		} // charging grip
-		else if (jc->is_usb) {
-			//printf("USB\n");
-			jc->init_usb();
-		}
-		else {
-			//printf("BT\n");
-			jc->init_bt();
-		}
-		// all get time now for polling
-		jc->last_polled = std::chrono::steady_clock::now();
-		jc->delta_time = 0.0;
-
-		jc->deviceNumber = 0; // left
+		InitJoyShock(jc);
 	}
+	LoadCalibrationProfiles(devices);
 
 	unsigned char buf[64];
 
 	// set lights:
 	//printf("setting LEDs...\n");
 	int i = 0;
-	for (std::pair<int, JoyShock*> pair : _joyshocks)
+	for (JoyShock* jc : devices)
 	{
-		JoyShock *jc = pair.second;
 		if (jc->controller_type != ControllerType::n_switch) {
 			// don't do joycon LED stuff with DS4
 			continue;
@@ -318,42 +882,76 @@ int JslConnectDevices()
 		i++;
 	}
 
+	if (_callbackDispatchMode == JS_CALLBACK_DISPATCH_ASYNC && !devices.empty()) {
+		StartDispatcher();
+	}
+
 	// now let's get polling!
-	for (std::pair<int, JoyShock*> pair : _joyshocks)
+	for (JoyShock* jc : StartReactors(devices))
 	{
-		JoyShock* jc = pair.second;
 		// threads for polling
 		jc->thread = new std::thread(pollIndividualLoop, jc);
 	}
 
-	return _joyshocks.size();
+	return (int)devices.size();
 }
 
 int JslGetConnectedDeviceHandles(int* deviceHandleArray, int size)
 {
+	ReadScope scope(_joyshockReaders);
 	int i = 0;
-	for (std::pair<int, JoyShock*> pair : _joyshocks)
+	for (int slot = 0; slot < _joyshocks.num_slots_used() && i < size; slot++)
 	{
-		if (i >= size) {
-			break;
+		JoyShock* jc = _joyshocks.get_at(slot);
+		if (jc == nullptr) {
+			continue;
 		}
-		deviceHandleArray[i] = pair.first;
+		deviceHandleArray[i] = jc->intHandle;
 		i++;
 	}
 	return i; // return num actually found
 }
 
 void JslDisconnectAndDisposeAll()
+{
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	DisconnectAndDisposeAll();
+}
+
+static void DisconnectAndDisposeAll()
 {
 	// no more callback
 	JslSetCallback(nullptr);
 
-	for (std::pair<int, JoyShock*> pair : _joyshocks)
+	// stop getters finding them, then wait for any getter that already found one to finish with it
+	std::vector<JoyShock*> devices = GetAllJoyShocks();
+	for (JoyShock* jc : devices)
+	{
+		_joyshocks.remove(jc->intHandle);
+	}
+	_joyshockReaders.synchronize();
+
+	for (JoyShock* jc : devices)
 	{
-		JoyShock* jc = pair.second;
-		// threads for polling
 		jc->cancel_thread = true;
-		jc->thread->join();
+	}
+	StopReactors();
+	StopDispatcher();
+	for (JoyShock* jc : devices)
+	{
+		// threads for polling
+		if (jc->thread != nullptr) {
+			jc->thread->join();
+			delete jc->thread;
+			jc->thread = nullptr;
+		}
+	}
+	// nothing's polling them any more, so this is everything they worked out
+	SaveCalibrationProfiles(devices);
+
+	for (JoyShock* jc : devices)
+	{
+		jc->close_reactor_fd();
 		if (jc->controller_type == ControllerType::s_ds4) {
 			if (jc->is_usb) {
 				jc->deinit_ds4_usb();
@@ -369,9 +967,8 @@ void JslDisconnectAndDisposeAll()
 			jc->deinit_usb();
 		}
 		  // cleanup
-		delete pair.second;
+		delete jc;
 	}
-	_joyshocks.clear();
 
 	// Finalize the hidapi library
 	int res = hid_exit();
@@ -402,42 +999,227 @@ void JslDisconnectAndDisposeAll()
 // if you want the whole state, this is the best way to do it
 JOY_SHOCK_STATE JslGetSimpleState(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state;
+		return jc->get_published_state().simple_state;
 	}
 	return {};
 }
 IMU_STATE JslGetIMUState(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state;
+		return jc->get_published_state().imu_state;
 	}
 	return {};
 }
 MOTION_STATE JslGetMotionState(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->get_motion_state();
+		return jc->get_motion_state(jc->get_published_state());
 	}
 	return {};
 }
+MOTION_STATE JslGetPredictedMotionState(int deviceId, long long targetTimestamp)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		const JOY_SHOCK_SNAPSHOT snapshot = jc->get_published_state();
+		const float seconds = (float)((targetTimestamp - snapshot.timestamp) / 1000000.0);
+		return MotionPredictor::predict(jc->get_motion_state(snapshot), snapshot.angular_velocity, snapshot.angular_acceleration, seconds);
+	}
+	return {};
+}
+long long JslGetTimestamp()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+void JslSetMotionMode(int deviceId, int mode)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr && mode >= JS_MOTION_EAGER && mode <= JS_MOTION_DISABLED) {
+		jc->requested_motion_mode.store(mode, std::memory_order_relaxed);
+	}
+}
+void JslSetDefaultMotionMode(int mode)
+{
+	if (mode < JS_MOTION_EAGER || mode > JS_MOTION_DISABLED) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_defaultMotionMode = mode;
+	for (JoyShock* jc : GetAllJoyShocks()) {
+		jc->requested_motion_mode.store(mode, std::memory_order_relaxed);
+	}
+}
+void JslSetFusionAlgorithm(int deviceId, int algorithm)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr && algorithm >= JS_FUSION_COMPLEMENTARY && algorithm <= JS_FUSION_KALMAN) {
+		jc->requested_fusion_algorithm.store(algorithm, std::memory_order_relaxed);
+	}
+}
+void JslSetDefaultFusionAlgorithm(int algorithm)
+{
+	if (algorithm < JS_FUSION_COMPLEMENTARY || algorithm > JS_FUSION_KALMAN) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_defaultFusionAlgorithm = algorithm;
+	for (JoyShock* jc : GetAllJoyShocks()) {
+		jc->requested_fusion_algorithm.store(algorithm, std::memory_order_relaxed);
+	}
+}
+void JslSetGravityWindow(int deviceId, float seconds)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr && seconds >= 0.0f) {
+		jc->gravity_window_seconds.store(seconds, std::memory_order_relaxed);
+	}
+}
+void JslSetPredictionAcceleration(int deviceId, bool enabled)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		jc->requested_prediction_acceleration.store(enabled, std::memory_order_relaxed);
+	}
+}
 TOUCH_STATE JslGetTouchState(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->touch_state;
+		return jc->get_published_state().touch_state;
 	}
 	return {};
 }
 
+int JslGetAllStates(DEVICE_SNAPSHOT* snapshots, int size)
+{
+	if (snapshots == nullptr) {
+		return 0;
+	}
+	ReadScope scope(_joyshockReaders);
+	int i = 0;
+	for (int slot = 0; slot < _joyshocks.num_slots_used() && i < size; slot++)
+	{
+		JoyShock* jc = _joyshocks.get_at(slot);
+		if (jc == nullptr) {
+			continue;
+		}
+		const JOY_SHOCK_SNAPSHOT snapshot = jc->get_published_state();
+		DEVICE_SNAPSHOT& out = snapshots[i];
+		out.deviceId = jc->intHandle;
+		out.sequence = snapshot.sequence;
+		out.timestamp = snapshot.timestamp;
+		out.deviceTimestamp = snapshot.device_timestamp;
+		out.simpleState = snapshot.simple_state;
+		out.imuState = snapshot.imu_state;
+		out.motionState = jc->get_motion_state(snapshot);
+		out.touchState = snapshot.touch_state;
+		i++;
+	}
+	return i; // return num actually filled
+}
+
+int JslGetStateHistory(int deviceId, unsigned long long since, STATE_SAMPLE* samples, int size)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr && samples != nullptr && size > 0) {
+		return jc->state_history.read_since(since, samples, size);
+	}
+	return 0;
+}
+DEVICE_STATS JslGetDeviceStats(int deviceId)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		DEVICE_STATS stats;
+		stats.received = jc->reports_received.load(std::memory_order_relaxed);
+		stats.dropped = jc->reports_dropped.load(std::memory_order_relaxed);
+		stats.duplicated = jc->reports_duplicated.load(std::memory_order_relaxed);
+		stats.outOfOrder = jc->reports_out_of_order.load(std::memory_order_relaxed);
+		return stats;
+	}
+	return {};
+}
+LATENCY_STATS JslGetLatencyStats(int deviceId, int metric)
+{
+	LATENCY_STATS stats = {};
+	JoyShockRef jc(deviceId);
+	if (jc == nullptr || metric < 0 || metric >= JoyShock::num_latency_metrics) {
+		return stats;
+	}
+	uint64_t counts[LatencyHistogram::num_buckets];
+	const uint64_t sum = jc->latency[metric].read(counts);
+	for (int i = 0; i < LatencyHistogram::num_buckets; i++) {
+		stats.count += counts[i];
+	}
+	if (stats.count == 0) {
+		return stats;
+	}
+	const double microsecondsPerTick = TickClock::microseconds_per_tick();
+	stats.mean = (float)(sum * microsecondsPerTick / stats.count);
+	// percentiles are reported as the top of the bucket they land in, so they're never flattering
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	float* results[] = { &stats.p50, &stats.p90, &stats.p99, &stats.p999 };
+	int next = 0;
+	uint64_t seen = 0;
+	bool foundMin = false;
+	for (int i = 0; i < LatencyHistogram::num_buckets; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		if (!foundMin) {
+			stats.min = (float)(LatencyHistogram::bucket_lower_bound(i) * microsecondsPerTick);
+			foundMin = true;
+		}
+		stats.max = (float)(LatencyHistogram::bucket_upper_bound(i) * microsecondsPerTick);
+		seen += counts[i];
+		while (next < 4 && seen >= (uint64_t)std::ceil(percentiles[next] * stats.count)) {
+			*results[next] = stats.max;
+			next++;
+		}
+	}
+	return stats;
+}
+
+int JslGetLatencyHistogram(int deviceId, int metric, float* bucketLimits, unsigned long long* counts, int size)
+{
+	JoyShockRef jc(deviceId);
+	if (jc == nullptr || metric < 0 || metric >= JoyShock::num_latency_metrics) {
+		return 0;
+	}
+	uint64_t bucketCounts[LatencyHistogram::num_buckets];
+	jc->latency[metric].read(bucketCounts);
+	const double microsecondsPerTick = TickClock::microseconds_per_tick();
+	int i = 0;
+	for (int bucket = 0; bucket < LatencyHistogram::num_buckets && i < size; bucket++) {
+		if (bucketCounts[bucket] == 0) {
+			continue;
+		}
+		bucketLimits[i] = (float)(LatencyHistogram::bucket_upper_bound(bucket) * microsecondsPerTick);
+		counts[i] = bucketCounts[bucket];
+		i++;
+	}
+	return i;
+}
+
+void JslResetLatencyStats(int deviceId)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		for (int i = 0; i < JoyShock::num_latency_metrics; i++) {
+			jc->latency[i].reset();
+		}
+	}
+}
+
 int JslGetButtons(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.buttons;
+		return jc->get_published_state().simple_state.buttons;
 	}
 	return 0;
 }
@@ -445,33 +1227,33 @@ int JslGetButtons(int deviceId)
 // get thumbsticks
 float JslGetLeftX(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.stickLX;
+		return jc->get_published_state().simple_state.stickLX;
 	}
 	return 0.0f;
 }
 float JslGetLeftY(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.stickLY;
+		return jc->get_published_state().simple_state.stickLY;
 	}
 	return 0.0f;
 }
 float JslGetRightX(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.stickRX;
+		return jc->get_published_state().simple_state.stickRX;
 	}
 	return 0.0f;
 }
 float JslGetRightY(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.stickRY;
+		return jc->get_published_state().simple_state.stickRY;
 	}
 	return 0.0f;
 }
@@ -479,17 +1261,17 @@ float JslGetRightY(int deviceId)
 // get triggers. Switch controllers don't have analogue triggers, but will report 0.0 or 1.0 so they can be used in the same way as others
 float JslGetLeftTrigger(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.lTrigger;
+		return jc->get_published_state().simple_state.lTrigger;
 	}
 	return 0.0f;
 }
 float JslGetRightTrigger(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->simple_state.rTrigger;
+		return jc->get_published_state().simple_state.rTrigger;
 	}
 	return 0.0f;
 }
@@ -497,25 +1279,25 @@ float JslGetRightTrigger(int deviceId)
 // get gyro
 float JslGetGyroX(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state.gyroX;
+		return jc->get_published_state().imu_state.gyroX;
 	}
 	return 0.0f;
 }
 float JslGetGyroY(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state.gyroY;
+		return jc->get_published_state().imu_state.gyroY;
 	}
 	return 0.0f;
 }
 float JslGetGyroZ(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state.gyroZ;
+		return jc->get_published_state().imu_state.gyroZ;
 	}
 	return 0.0f;
 }
@@ -523,25 +1305,25 @@ float JslGetGyroZ(int deviceId)
 // get accelerometor
 float JslGetAccelX(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state.accelX;
+		return jc->get_published_state().imu_state.accelX;
 	}
 	return 0.0f;
 }
 float JslGetAccelY(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state.accelY;
+		return jc->get_published_state().imu_state.accelY;
 	}
 	return 0.0f;
 }
 float JslGetAccelZ(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->imu_state.accelZ;
+		return jc->get_published_state().imu_state.accelZ;
 	}
 	return 0.0f;
 }
@@ -549,26 +1331,26 @@ float JslGetAccelZ(int deviceId)
 // get touchpad
 int JslGetTouchId(int deviceId, bool secondTouch)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		if (!secondTouch) {
-			return jc->touch_state.t0Id;
+			return jc->get_published_state().touch_state.t0Id;
 		}
 		else {
-			return jc->touch_state.t1Id;
+			return jc->get_published_state().touch_state.t1Id;
 		}
 	}
 	return false;
 }
 bool JslGetTouchDown(int deviceId, bool secondTouch)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		if (!secondTouch) {
-			return jc->touch_state.t0Down;
+			return jc->get_published_state().touch_state.t0Down;
 		}
 		else {
-			return jc->touch_state.t1Down;
+			return jc->get_published_state().touch_state.t1Down;
 		}
 	}
 	return false;
@@ -576,26 +1358,26 @@ bool JslGetTouchDown(int deviceId, bool secondTouch)
 
 float JslGetTouchX(int deviceId, bool secondTouch)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		if (!secondTouch) {
-			return jc->touch_state.t0X;
+			return jc->get_published_state().touch_state.t0X;
 		}
 		else {
-			return jc->touch_state.t1X;
+			return jc->get_published_state().touch_state.t1X;
 		}
 	}
 	return 0.0f;
 }
 float JslGetTouchY(int deviceId, bool secondTouch)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		if (!secondTouch) {
-			return jc->touch_state.t0Y;
+			return jc->get_published_state().touch_state.t0Y;
 		}
 		else {
-			return jc->touch_state.t1Y;
+			return jc->get_published_state().touch_state.t1Y;
 		}
 	}
 	return 0.0f;
@@ -604,7 +1386,7 @@ float JslGetTouchY(int deviceId, bool secondTouch)
 // analog parameters have different resolutions depending on device
 float JslGetStickStep(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		if (jc->controller_type != ControllerType::n_switch) {
 			return 1.0 / 128.0;
@@ -623,7 +1405,7 @@ float JslGetStickStep(int deviceId)
 }
 float JslGetTriggerStep(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		return jc->controller_type != ControllerType::n_switch ? 1 / 256.0 : 1.0;
 	}
@@ -631,37 +1413,46 @@ float JslGetTriggerStep(int deviceId)
 }
 float JslGetPollRate(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		return jc->controller_type != ControllerType::n_switch ? 250.0 : 66.6667;
+		// until it's been measured, what it should be
+		const float rate = jc->get_published_state().poll_rate.rate;
+		return rate > 0.0f ? rate : jc->get_nominal_poll_rate();
 	}
 	return 0.0f;
 }
 
+POLL_RATE_STATS JslGetPollRateStats(int deviceId)
+{
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		return jc->get_published_state().poll_rate;
+	}
+	return {};
+}
+
 // calibration
 void JslResetContinuousCalibration(int deviceId) {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
-		// TODO: might need a lock around this to prevent race conditions.
-		// risk of miscounting samples
-		jc->reset_continuous_calibration();
+		jc->request_calibration_reset();
 	}
 }
 void JslStartContinuousCalibration(int deviceId) {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		jc->use_continuous_calibration = true;
 		jc->cue_motion_reset = true;
 	}
 }
 void JslPauseContinuousCalibration(int deviceId) {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		jc->use_continuous_calibration = false;
 	}
 }
 void JslGetCalibrationOffset(int deviceId, float& xOffset, float& yOffset, float& zOffset) {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		xOffset = jc->offset_x;
 		yOffset = jc->offset_y;
@@ -669,7 +1460,7 @@ void JslGetCalibrationOffset(int deviceId, float& xOffset, float& yOffset, float
 	}
 }
 void JslSetCalibrationOffset(int deviceId, float xOffset, float yOffset, float zOffset) {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		jc->offset_x = xOffset;
 		jc->offset_y = yOffset;
@@ -677,6 +1468,60 @@ void JslSetCalibrationOffset(int deviceId, float xOffset, float yOffset, float z
 	}
 }
 
+void JslSetCalibrationWindow(int deviceId, float seconds) {
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		jc->set_calibration_window(seconds > 1.0f ? seconds : 1.0f);
+	}
+}
+
+void JslSetDefaultCalibrationWindow(float seconds) {
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_calibrationWindowSeconds = seconds > 1.0f ? seconds : 1.0f;
+	for (JoyShock* jc : GetAllJoyShocks()) {
+		jc->set_calibration_window(_calibrationWindowSeconds);
+	}
+}
+
+void JslSetCalibrationProfileFile(const char* path) {
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	_calibrationProfilePath = path != nullptr ? path : "";
+}
+
+bool JslSaveCalibrationProfiles() {
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	// devices are still being polled, so this is as of each one's last report
+	return SaveCalibrationProfiles(GetAllJoyShocks());
+}
+
+void JslSetAutomaticCalibration(int deviceId, bool enabled) {
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		jc->use_automatic_calibration.store(enabled, std::memory_order_relaxed);
+	}
+}
+
+AUTO_CALIBRATION_STATUS JslGetAutomaticCalibrationStatus(int deviceId) {
+	AUTO_CALIBRATION_STATUS status = {};
+	JoyShockRef jc(deviceId);
+	if (jc != nullptr) {
+		// the detector belongs to the polling thread. what it last published is safe to read
+		const JOY_SHOCK_SNAPSHOT snapshot = jc->get_published_state();
+		status.enabled = jc->use_automatic_calibration.load(std::memory_order_relaxed);
+		status.isStill = snapshot.is_still;
+		status.confidence = snapshot.calibration.confidence;
+	}
+	return status;
+}
+
+void JslSetIMUSamples(int deviceId, bool enabled) {
+	JoyShockRef jc(deviceId);
+	// only Switch controllers have more than one sample per report
+	if (jc != nullptr && jc->controller_type == ControllerType::n_switch) {
+		jc->use_imu_samples.store(enabled, std::memory_order_relaxed);
+	}
+}
+
 // this function will get called for each input event from each controller
 void JslSetCallback(void(*callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float)) {
 	// exclusive lock
@@ -692,10 +1537,17 @@ void JslSetTouchCallback(void(*callback)(int, TOUCH_STATE, TOUCH_STATE, float))
 	_callbackLock.unlock();
 }
 
+// this function will get called for each IMU sample that goes into sensor fusion, before the input event it came with
+void JslSetIMUSampleCallback(void(*callback)(int, IMU_STATE, MOTION_STATE, float)) {
+	_callbackLock.lock();
+	_imuSampleCallback = callback;
+	_callbackLock.unlock();
+}
+
 // what split type of controller is this?
 int JslGetControllerType(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		switch (jc->controller_type)
 		{
@@ -713,7 +1565,7 @@ int JslGetControllerType(int deviceId)
 // what split type of controller is this?
 int JslGetControllerSplitType(int deviceId)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		return jc->left_right;
 	}
@@ -723,7 +1575,7 @@ int JslGetControllerSplitType(int deviceId)
 int JslGetControllerColour(int deviceId)
 {
 	// this just reports body colour. Switch controllers also give buttons colour, and in Pro's case, left and right grips
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr) {
 		return jc->body_colour;
 	}
@@ -732,7 +1584,7 @@ int JslGetControllerColour(int deviceId)
 // set controller light colour (not all controllers have a light whose colour can be set, but that just means nothing will be done when this is called -- no harm)
 void JslSetLightColour(int deviceId, int colour)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr && jc->controller_type == ControllerType::s_ds4) {
 		jc->led_r = (colour >> 16) & 0xff;
 		jc->led_g = (colour >> 8) & 0xff;
@@ -748,7 +1600,7 @@ void JslSetLightColour(int deviceId, int colour)
 // set controller rumble
 void JslSetRumble(int deviceId, int smallRumble, int bigRumble)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr && jc->controller_type == ControllerType::s_ds4) {
 		jc->small_rumble = smallRumble;
 		jc->big_rumble = bigRumble;
@@ -763,7 +1615,7 @@ void JslSetRumble(int deviceId, int smallRumble, int bigRumble)
 // set controller player number indicator (not all controllers have a number indicator which can be set, but that just means nothing will be done when this is called -- no harm)
 void JslSetPlayerNumber(int deviceId, int number)
 {
-	JoyShock* jc = GetJoyShockFromHandle(deviceId);
+	JoyShockRef jc(deviceId);
 	if (jc != nullptr && jc->controller_type == ControllerType::n_switch) {
 		jc->player_number = number;
 		unsigned char buf[64];
@@ -17,6 +17,35 @@
 #define JS_SPLIT_TYPE_RIGHT 2
 #define JS_SPLIT_TYPE_FULL 3
 
+#define JS_POLL_THREAD_PER_DEVICE 0
+#define JS_POLL_REACTOR 1
+
+#define JS_CALLBACK_DISPATCH_INLINE 0
+#define JS_CALLBACK_DISPATCH_ASYNC 1
+
+#define JS_MOTION_EAGER 0
+#define JS_MOTION_LAZY 1
+#define JS_MOTION_DISABLED 2
+
+#define JS_FUSION_COMPLEMENTARY 0
+#define JS_FUSION_MADGWICK 1
+#define JS_FUSION_MAHONY 2
+#define JS_FUSION_KALMAN 3
+
+#define JS_LATENCY_INTER_ARRIVAL 0
+#define JS_LATENCY_PARSE 1
+#define JS_LATENCY_MOTION 2
+#define JS_LATENCY_CALLBACK 3
+#define JS_LATENCY_READ_TO_PUBLISH 4
+
+#define JS_SIMULATE_DS4_USB 0
+#define JS_SIMULATE_DS4_BT 1
+#define JS_SIMULATE_DUALSENSE_USB 2
+#define JS_SIMULATE_JOYCON_LEFT 3
+#define JS_SIMULATE_JOYCON_RIGHT 4
+#define JS_SIMULATE_PRO_CONTROLLER 5
+#define JS_SIMULATE_PRO_CONTROLLER_USB 6
+
 #define JSMASK_UP 0x00001
 #define JSMASK_DOWN 0x00002
 #define JSMASK_LEFT 0x00004
@@ -110,6 +139,83 @@ typedef struct TOUCH_STATE {
 	float t1Y;
 } TOUCH_STATE;
 
+typedef struct STATE_SAMPLE {
+	unsigned long long sequence;
+	long long timestamp;
+	long long deviceTimestamp;
+	float deltaTime;
+	JOY_SHOCK_STATE simpleState;
+	IMU_STATE imuState;
+	TOUCH_STATE touchState;
+} STATE_SAMPLE;
+
+typedef struct DEVICE_SNAPSHOT {
+	int deviceId;
+	unsigned long long sequence;
+	long long timestamp;
+	long long deviceTimestamp;
+	JOY_SHOCK_STATE simpleState;
+	IMU_STATE imuState;
+	MOTION_STATE motionState;
+	TOUCH_STATE touchState;
+} DEVICE_SNAPSHOT;
+
+typedef struct DEVICE_STATS {
+	unsigned long long received;
+	unsigned long long dropped;
+	unsigned long long duplicated;
+	unsigned long long outOfOrder;
+} DEVICE_STATS;
+
+typedef struct LATENCY_STATS {
+	unsigned long long count;
+	float min;
+	float mean;
+	float max;
+	float p50;
+	float p90;
+	float p99;
+	float p999;
+} LATENCY_STATS;
+
+typedef struct POLL_RATE_STATS {
+	float rate;
+	float minInterval;
+	float maxInterval;
+	float jitter;
+} POLL_RATE_STATS;
+
+typedef struct AUTO_CALIBRATION_STATUS {
+	bool enabled;
+	bool isStill;
+	float confidence;
+} AUTO_CALIBRATION_STATUS;
+
+typedef struct CALLBACK_QUEUE_STATS {
+	int depth;
+	int capacity;
+	int maxDepth;
+	unsigned long long queued;
+	unsigned long long dispatched;
+	unsigned long long dropped;
+} CALLBACK_QUEUE_STATS;
+
+// how controllers are read. By default each one gets its own thread. JS_POLL_REACTOR instead has numThreads threads wait on all of them at once (Linux only -- elsewhere it falls back to a thread per device).
+// Controllers the reactor can't wait on (replayed ones, say) still get their own thread, without taking the rest off the reactor.
+// Takes effect on the next JslConnectDevices
+extern "C" JOY_SHOCK_API void JslSetPollingMode(int mode, int numThreads = 1);
+// record everything each controller sends into a file in this directory (null to stop recording), to be played back with JslAddReplayDevice.
+// Takes effect on the next JslConnectDevices
+extern "C" JOY_SHOCK_API void JslSetRecordingDirectory(const char* directory);
+// play a recording back as if it were a controller, every time JslConnectDevices is called. realTime plays it at its original pace, otherwise as fast as it'll go.
+// returns false if the file isn't a recording
+extern "C" JOY_SHOCK_API bool JslAddReplayDevice(const char* path, bool realTime);
+extern "C" JOY_SHOCK_API void JslClearReplayDevices();
+// pretend count controllers of the given type (JS_SIMULATE_*) are connected, every time JslConnectDevices is called. for load testing.
+// packetLoss (0 to 1) is the chance of each report going missing, reports arrive up to jitterMs late, and they disconnect after
+// disconnectAfterSeconds (0 to stay connected). returns false if type isn't valid
+extern "C" JOY_SHOCK_API bool JslAddSimulatedDevices(int type, int count, float packetLoss, float jitterMs, float disconnectAfterSeconds);
+extern "C" JOY_SHOCK_API void JslClearSimulatedDevices();
 extern "C" JOY_SHOCK_API int JslConnectDevices();
 extern "C" JOY_SHOCK_API int JslGetConnectedDeviceHandles(int* deviceHandleArray, int size);
 extern "C" JOY_SHOCK_API void JslDisconnectAndDisposeAll();
@@ -141,6 +247,39 @@ extern "C" JOY_SHOCK_API JOY_SHOCK_STATE JslGetSimpleState(int deviceId);
 extern "C" JOY_SHOCK_API IMU_STATE JslGetIMUState(int deviceId);
 extern "C" JOY_SHOCK_API MOTION_STATE JslGetMotionState(int deviceId);
 extern "C" JOY_SHOCK_API TOUCH_STATE JslGetTouchState(int deviceId);
+// the motion state turned forward from the last report to targetTimestamp (JslGetTimestamp's clock, say when your frame will be shown) at the gyro's latest speed. at most 100ms ahead
+extern "C" JOY_SHOCK_API MOTION_STATE JslGetPredictedMotionState(int deviceId, long long targetTimestamp);
+// now, in microseconds, by the same clock as state timestamps
+extern "C" JOY_SHOCK_API long long JslGetTimestamp();
+// how sensor fusion's done for this device. JS_MOTION_EAGER fuses every IMU sample as it comes in. JS_MOTION_LAZY keeps them until motion's asked for
+// (or 64 have built up) and fuses them all at once then. JS_MOTION_DISABLED doesn't fuse at all, for when motion's never needed
+extern "C" JOY_SHOCK_API void JslSetMotionMode(int deviceId, int mode);
+// for every connected device, and devices when they connect. JS_MOTION_EAGER to start with
+extern "C" JOY_SHOCK_API void JslSetDefaultMotionMode(int mode);
+// which sensor fusion algorithm this device uses (JS_FUSION_*). JS_FUSION_COMPLEMENTARY to start with
+extern "C" JOY_SHOCK_API void JslSetFusionAlgorithm(int deviceId, int algorithm);
+// for every connected device, and devices when they connect
+extern "C" JOY_SHOCK_API void JslSetDefaultFusionAlgorithm(int algorithm);
+// how long gravity has to hold steady before sensor fusion corrects the orientation against it, in seconds. 0.04 to start with
+extern "C" JOY_SHOCK_API void JslSetGravityWindow(int deviceId, float seconds);
+// also estimate angular acceleration for JslGetPredictedMotionState. Better for quick flicks, noisier when holding steady. Off by default
+extern "C" JOY_SHOCK_API void JslSetPredictionAcceleration(int deviceId, bool enabled);
+// the latest state of every connected device in one go, which is cheaper than asking for each device and each state separately. returns how many snapshots were written
+extern "C" JOY_SHOCK_API int JslGetAllStates(DEVICE_SNAPSHOT* snapshots, int size);
+// every report since the one numbered 'since' (0 for everything still kept), oldest first, so you don't miss short presses or gyro between frames. returns how many samples were written
+extern "C" JOY_SHOCK_API int JslGetStateHistory(int deviceId, unsigned long long since, STATE_SAMPLE* samples, int size);
+// how many reports this device has sent, and how many went missing, came twice, or came out of order on the way
+extern "C" JOY_SHOCK_API DEVICE_STATS JslGetDeviceStats(int deviceId);
+// how long one stage of handling this device's reports (JS_LATENCY_*) has been taking, in microseconds
+extern "C" JOY_SHOCK_API LATENCY_STATS JslGetLatencyStats(int deviceId, int metric);
+// the histogram behind JslGetLatencyStats. for each bucket with anything in it, writes the bucket's upper limit (in microseconds) and count. returns how many buckets were written
+extern "C" JOY_SHOCK_API int JslGetLatencyHistogram(int deviceId, int metric, float* bucketLimits, unsigned long long* counts, int size);
+// start counting from scratch for all of this device's latency stats
+extern "C" JOY_SHOCK_API void JslResetLatencyStats(int deviceId);
+// record what the polling threads are doing (reads, parsing, fusion, callbacks, re-initialising controllers), to be written out with JslWriteTrace
+extern "C" JOY_SHOCK_API void JslSetTracing(bool enabled);
+// write what's been recorded since tracing was turned on as Chrome trace JSON (open it in chrome://tracing or ui.perfetto.dev). returns how many events were written, or -1 if the file couldn't be written
+extern "C" JOY_SHOCK_API int JslWriteTrace(const char* path);
 
 extern "C" JOY_SHOCK_API int JslGetButtons(int deviceId);
 
@@ -175,6 +314,8 @@ extern "C" JOY_SHOCK_API float JslGetTouchY(int deviceId, bool secondTouch = fal
 extern "C" JOY_SHOCK_API float JslGetStickStep(int deviceId);
 extern "C" JOY_SHOCK_API float JslGetTriggerStep(int deviceId);
 extern "C" JOY_SHOCK_API float JslGetPollRate(int deviceId);
+// how steadily the device has been reporting: the rate JslGetPollRate gives, the shortest and longest time between reports (ms), and how much that time varies (ms)
+extern "C" JOY_SHOCK_API POLL_RATE_STATS JslGetPollRateStats(int deviceId);
 
 // calibration
 extern "C" JOY_SHOCK_API void JslResetContinuousCalibration(int deviceId);
@@ -182,11 +323,29 @@ extern "C" JOY_SHOCK_API void JslStartContinuousCalibration(int deviceId);
 extern "C" JOY_SHOCK_API void JslPauseContinuousCalibration(int deviceId);
 extern "C" JOY_SHOCK_API void JslGetCalibrationOffset(int deviceId, float& xOffset, float& yOffset, float& zOffset);
 extern "C" JOY_SHOCK_API void JslSetCalibrationOffset(int deviceId, float xOffset, float yOffset, float zOffset);
+// how many seconds of samples continuous and automatic calibration average over (600 by default, 1 at least). For one device, or for every device, now and when connected
+extern "C" JOY_SHOCK_API void JslSetCalibrationWindow(int deviceId, float seconds);
+extern "C" JOY_SHOCK_API void JslSetDefaultCalibrationWindow(float seconds);
+// remember calibration by controller serial number in this file: loaded by JslConnectDevices, saved by JslDisconnectAndDisposeAll or JslSaveCalibrationProfiles. null to stop
+extern "C" JOY_SHOCK_API void JslSetCalibrationProfileFile(const char* path);
+extern "C" JOY_SHOCK_API bool JslSaveCalibrationProfiles();
+// calibrate whenever the controller's put down and left still, without being told. Continuous calibration takes priority while it's running
+extern "C" JOY_SHOCK_API void JslSetAutomaticCalibration(int deviceId, bool enabled);
+extern "C" JOY_SHOCK_API AUTO_CALIBRATION_STATUS JslGetAutomaticCalibrationStatus(int deviceId);
+// Switch controllers send 3 IMU samples with each report. By default they're averaged. Enabled, each one goes to continuous calibration and sensor fusion on its own
+extern "C" JOY_SHOCK_API void JslSetIMUSamples(int deviceId, bool enabled);
 
 // this function will get called for each input event from each controller
 extern "C" JOY_SHOCK_API void JslSetCallback(void(*callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float));
 // this function will get called for each input event, even if touch data didn't update
 extern "C" JOY_SHOCK_API void JslSetTouchCallback(void(*callback)(int, TOUCH_STATE, TOUCH_STATE, float));
+// this function will get called for each IMU sample that goes into sensor fusion, with the motion state right after it and its own delta time -- 3 per report from a Switch controller with JslSetIMUSamples, otherwise 1
+extern "C" JOY_SHOCK_API void JslSetIMUSampleCallback(void(*callback)(int, IMU_STATE, MOTION_STATE, float));
+// where callbacks are called from. By default it's the thread that read the report. JS_CALLBACK_DISPATCH_ASYNC queues reports for one dispatcher thread instead, so slow callbacks don't hold up polling
+extern "C" JOY_SHOCK_API void JslSetCallbackDispatchMode(int mode);
+// how the JS_CALLBACK_DISPATCH_ASYNC queue is keeping up
+extern "C" JOY_SHOCK_API CALLBACK_QUEUE_STATS JslGetCallbackQueueStats();
+extern "C" JOY_SHOCK_API void JslResetCallbackQueueStats();
 
 // what kind of controller is this?
 extern "C" JOY_SHOCK_API int JslGetControllerType(int deviceId);
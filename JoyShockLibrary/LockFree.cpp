@@ -0,0 +1,391 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Structures for handing data from the polling threads to the user's threads without either of them waiting on a lock.
+
+#define JSL_CACHE_LINE_SIZE 64
+
+// plain new only promises alignment up to alignof(std::max_align_t) before C++17, so anything with cache-line aligned members allocates through these
+inline void* jsl_aligned_alloc(size_t size) {
+	unsigned char* raw = (unsigned char*)malloc(size + JSL_CACHE_LINE_SIZE + sizeof(void*));
+	if (raw == nullptr) {
+		return nullptr;
+	}
+	uintptr_t aligned = ((uintptr_t)(raw + sizeof(void*)) + JSL_CACHE_LINE_SIZE - 1) & ~(uintptr_t)(JSL_CACHE_LINE_SIZE - 1);
+	((void**)aligned)[-1] = raw;
+	return (void*)aligned;
+}
+
+inline void jsl_aligned_free(void* p) {
+	if (p != nullptr) {
+		free(((void**)p)[-1]);
+	}
+}
+
+// Sequence lock. One writer, any number of readers.
+// The writer never waits. Readers copy the value and retry if the writer was partway through a store while they were copying, so they never see half of one store and half of another.
+// The value is kept as atomic words so that racing readers are well defined, which means T must be trivially copyable.
+template <typename T>
+class alignas(JSL_CACHE_LINE_SIZE) SeqLock {
+public:
+	SeqLock() : _sequence(0) {
+		T empty = {};
+		store(empty);
+		_sequence.store(0, std::memory_order_relaxed);
+	}
+
+	// only ever call this from one thread at a time
+	void store(const T& value) {
+		uint64_t words[num_words];
+		words[num_words - 1] = 0;
+		memcpy(words, &value, sizeof(T));
+
+		const uint64_t sequence = _sequence.load(std::memory_order_relaxed);
+		_sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (int i = 0; i < num_words; i++) {
+			_words[i].store(words[i], std::memory_order_relaxed);
+		}
+		_sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	// if version isn't null, it gets how many stores there had been when the value was copied
+	T load(uint64_t* version = nullptr) const {
+		uint64_t words[num_words];
+		for (int attempt = 0; ; attempt++) {
+			const uint64_t before = _sequence.load(std::memory_order_acquire);
+			if ((before & 1) == 0) {
+				for (int i = 0; i < num_words; i++) {
+					words[i] = _words[i].load(std::memory_order_relaxed);
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (_sequence.load(std::memory_order_relaxed) == before) {
+					if (version != nullptr) {
+						*version = before >> 1;
+					}
+					break;
+				}
+			}
+			// the writer only holds the lock for a few stores, but it might have been descheduled partway through
+			if (attempt >= 16) {
+				std::this_thread::yield();
+			}
+		}
+		T result;
+		memcpy(&result, words, sizeof(T));
+		return result;
+	}
+
+	// how many stores so far
+	uint64_t version() const {
+		return _sequence.load(std::memory_order_acquire) >> 1;
+	}
+
+private:
+	static const int num_words = (int)((sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+
+	std::atomic<uint64_t> _sequence;
+	std::atomic<uint64_t> _words[num_words];
+};
+
+// The last N values pushed by one writer, for readers that want everything since they last looked.
+// Each value is stamped with an increasing sequence number (starting at 1), which readers use as a cursor. Reading doesn't consume anything,
+// so any number of readers can follow the same history. A reader that falls more than N values behind just misses the oldest ones.
+// T must be trivially copyable and have an unsigned long long 'sequence' member.
+template <typename T, int N>
+class HistoryRing {
+public:
+	HistoryRing() : _head(0) {}
+
+	// only ever call this from one thread at a time
+	void push(T& value) {
+		const uint64_t sequence = _head.load(std::memory_order_relaxed) + 1;
+		value.sequence = sequence;
+		_slots[sequence % N].store(value);
+		_head.store(sequence, std::memory_order_release);
+	}
+
+	// copies up to max values with sequence numbers after since into out, oldest first. returns how many were copied
+	int read_since(uint64_t since, T* out, int max) const {
+		const uint64_t head = _head.load(std::memory_order_acquire);
+		uint64_t sequence = since + 1;
+		// the oldest slot is the next one the writer will overwrite, so don't bother with it
+		if (head >= N && sequence < head - N + 2) {
+			sequence = head - N + 2;
+		}
+		int count = 0;
+		for (; sequence <= head && count < max; sequence++) {
+			T value = _slots[sequence % N].load();
+			if (value.sequence != sequence) {
+				// the writer lapped us while we were reading
+				continue;
+			}
+			out[count++] = value;
+		}
+		return count;
+	}
+
+	// sequence number of the newest value, or 0 if nothing's been pushed yet
+	uint64_t head() const {
+		return _head.load(std::memory_order_acquire);
+	}
+
+private:
+	SeqLock<T> _slots[N];
+	std::atomic<uint64_t> _head;
+};
+
+// Read-copy-update style protection for things readers look up without locking.
+// Readers enter before looking something up and exit when they're done with it. A writer that has unpublished something calls synchronize(),
+// which waits until every reader that might have seen it has exited. Then it's safe to delete.
+// Readers never wait on writers. They only retry entering if a writer's synchronize() starts at the same moment.
+class ReadEpochs {
+public:
+	ReadEpochs() : _epoch(0) {
+		_readers[0] = 0;
+		_readers[1] = 0;
+	}
+
+	// returns a token to give back to exit()
+	int enter() {
+		for (;;) {
+			const uint64_t epoch = _epoch.load();
+			const int index = (int)(epoch & 1);
+			_readers[index].fetch_add(1);
+			// if a writer started waiting between us reading the epoch and announcing ourselves, it might not have seen us. try again
+			if (_epoch.load() == epoch) {
+				return index;
+			}
+			_readers[index].fetch_sub(1);
+		}
+	}
+
+	void exit(int token) {
+		_readers[token].fetch_sub(1, std::memory_order_release);
+	}
+
+	// only writers call this, and only one at a time
+	void synchronize() {
+		const int index = (int)(_epoch.fetch_add(1) & 1);
+		// anyone who enters from now on uses the other counter, and can't see what was unpublished before the epoch changed
+		for (int attempt = 0; _readers[index].load(std::memory_order_acquire) != 0; attempt++) {
+			if (attempt >= 16) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+private:
+	std::atomic<uint64_t> _epoch;
+	std::atomic<int> _readers[2];
+};
+
+// enters on construction and exits when it goes out of scope
+class ReadScope {
+public:
+	explicit ReadScope(ReadEpochs& epochs) : _epochs(epochs), _token(epochs.enter()) {}
+
+	~ReadScope() {
+		_epochs.exit(_token);
+	}
+
+	ReadScope(const ReadScope&) = delete;
+	ReadScope& operator=(const ReadScope&) = delete;
+
+private:
+	ReadEpochs& _epochs;
+	int _token;
+};
+
+// Fixed-capacity table of pointers, looked up by handle in constant time without locking.
+// A handle is a slot index plus that slot's generation. A slot's generation changes whenever its item is removed, so stale handles find nothing
+// rather than whatever reused the slot. Lookups are lock-free. Changes (reserve, publish, remove) must be serialised by the caller,
+// and removed items must not be deleted until readers are done with them (see ReadEpochs).
+template <typename T, int Capacity>
+class HandleTable {
+public:
+	static const int index_bits = 8;
+	static_assert(Capacity <= (1 << index_bits), "HandleTable capacity doesn't fit in the handle's index bits");
+
+	HandleTable() : _used(0) {
+		for (int i = 0; i < Capacity; i++) {
+			_slots[i].item = nullptr;
+			_slots[i].generation = 1;
+			_slots[i].reserved = false;
+		}
+	}
+
+	// claims a free slot and returns its handle, or -1 if the table is full. the handle finds nothing until publish() is called
+	int reserve() {
+		for (int i = 0; i < Capacity; i++) {
+			Slot& slot = _slots[i];
+			if (!slot.reserved) {
+				slot.reserved = true;
+				if (i >= _used.load(std::memory_order_relaxed)) {
+					_used.store(i + 1, std::memory_order_release);
+				}
+				return make_handle(i, slot.generation.load(std::memory_order_relaxed));
+			}
+		}
+		return -1;
+	}
+
+	void publish(int handle, T* item) {
+		_slots[handle & index_mask].item.store(item, std::memory_order_release);
+	}
+
+	// returns the item that was there, so the caller can delete it once readers are done with it
+	T* remove(int handle) {
+		Slot& slot = _slots[handle & index_mask];
+		if (!slot.reserved || slot.generation.load(std::memory_order_relaxed) != generation_of(handle)) {
+			return nullptr;
+		}
+		T* item = slot.item.load(std::memory_order_relaxed);
+		slot.item.store(nullptr, std::memory_order_release);
+		slot.generation.store(next_generation(generation_of(handle)), std::memory_order_release);
+		slot.reserved = false;
+		return item;
+	}
+
+	// null if the handle doesn't refer to a published item
+	T* get(int handle) const {
+		if (handle < 0) {
+			return nullptr;
+		}
+		const Slot& slot = _slots[handle & index_mask];
+		T* item = slot.item.load(std::memory_order_acquire);
+		// checking the generation after the item means a stale handle can't pick up something newer in its slot
+		if (slot.generation.load(std::memory_order_acquire) != generation_of(handle)) {
+			return nullptr;
+		}
+		return item;
+	}
+
+	// for walking every item: every slot that's ever been used is below this
+	int num_slots_used() const {
+		return _used.load(std::memory_order_acquire);
+	}
+
+	// the item in the given slot, if any. for walking the table
+	T* get_at(int index) const {
+		return _slots[index].item.load(std::memory_order_acquire);
+	}
+
+	// number of published items
+	int count() const {
+		int result = 0;
+		for (int i = 0; i < num_slots_used(); i++) {
+			if (get_at(i) != nullptr) {
+				result++;
+			}
+		}
+		return result;
+	}
+
+private:
+	static const int index_mask = (1 << index_bits) - 1;
+	// handles are ints and should stay positive
+	static const uint32_t max_generation = 0x7FFFFFFF >> index_bits;
+
+	struct Slot {
+		std::atomic<T*> item;
+		std::atomic<uint32_t> generation;
+		bool reserved;
+	};
+
+	Slot _slots[Capacity];
+	std::atomic<int> _used;
+
+	static int make_handle(int index, uint32_t generation) {
+		return (int)((generation << index_bits) | (uint32_t)index);
+	}
+
+	static uint32_t generation_of(int handle) {
+		return (uint32_t)handle >> index_bits;
+	}
+
+	static uint32_t next_generation(uint32_t generation) {
+		return generation >= max_generation ? 1 : generation + 1;
+	}
+};
+
+// Fixed-capacity queue for any number of producers and one consumer (Dmitry Vyukov's bounded queue).
+// Neither side ever waits: try_push fails if the queue is full and try_pop fails if it's empty, so what to do then is up to the caller.
+// Capacity must be a power of two.
+template <typename T, int Capacity>
+class BoundedQueue {
+public:
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "BoundedQueue capacity must be a power of two");
+
+	BoundedQueue() : _enqueuePos(0), _dequeuePos(0) {
+		for (int i = 0; i < Capacity; i++) {
+			_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// any thread. returns false if the queue is full
+	bool try_push(const T& value) {
+		Cell* cell;
+		uint64_t pos = _enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &_cells[pos & (Capacity - 1)];
+			const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+			const int64_t diff = (int64_t)sequence - (int64_t)pos;
+			if (diff == 0) {
+				if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = _enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// only ever call this from one thread at a time. returns false if the queue is empty
+	bool try_pop(T& value) {
+		const uint64_t pos = _dequeuePos.load(std::memory_order_relaxed);
+		Cell* cell = &_cells[pos & (Capacity - 1)];
+		const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+		if ((int64_t)sequence - (int64_t)(pos + 1) < 0) {
+			return false;
+		}
+		value = cell->value;
+		cell->sequence.store(pos + Capacity, std::memory_order_release);
+		_dequeuePos.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// roughly how many values are waiting. only exact when nobody's pushing or popping
+	int size() const {
+		const uint64_t dequeued = _dequeuePos.load(std::memory_order_relaxed);
+		const uint64_t enqueued = _enqueuePos.load(std::memory_order_relaxed);
+		return enqueued > dequeued ? (int)(enqueued - dequeued) : 0;
+	}
+
+	static int capacity() {
+		return Capacity;
+	}
+
+private:
+	struct Cell {
+		std::atomic<uint64_t> sequence;
+		T value;
+	};
+
+	Cell _cells[Capacity];
+	// producers and the consumer hammer different ends, so keep them off each other's cache line
+	alignas(JSL_CACHE_LINE_SIZE) std::atomic<uint64_t> _enqueuePos;
+	alignas(JSL_CACHE_LINE_SIZE) std::atomic<uint64_t> _dequeuePos;
+};
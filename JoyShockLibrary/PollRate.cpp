@@ -0,0 +1,81 @@
+#pragma once
+
+#include "JoyShockLibrary.h"
+#include <cmath>
+
+// Measures how often a device really reports, from the time between its reports (the controller's own timer where it has one).
+// Counts, times and squared times are kept as sums that fade with a fixed time constant, so the rate follows a device that changes
+// (a Bluetooth stack that's struggling, say) without jumping about with every late report. Min and max are over the last couple of windows.
+class PollRateEstimator {
+public:
+	// how far back the mean and jitter look, in seconds
+	static constexpr float time_constant = 2.0f;
+	// anything longer is the device going quiet, not its rate
+	static constexpr float max_interval = 0.25f;
+
+	void update(float interval) {
+		// the first one is measured from connecting, not from another report
+		if (!_started) {
+			_started = true;
+			return;
+		}
+		if (interval <= 0.0f || interval > max_interval) {
+			return;
+		}
+		const double fade = exp(-interval / time_constant);
+		_count = _count * fade + 1.0;
+		_total = _total * fade + interval;
+		_totalSquared = _totalSquared * fade + (double)interval * interval;
+
+		// min and max are the worst of this window and the one before, so one odd report ages out
+		if (_windowSeconds >= time_constant) {
+			_previousMin = _min;
+			_previousMax = _max;
+			_windowSeconds = 0.0f;
+			_min = interval;
+			_max = interval;
+		}
+		else {
+			_min = _windowSeconds == 0.0f || interval < _min ? interval : _min;
+			_max = interval > _max ? interval : _max;
+		}
+		_windowSeconds += interval;
+		if (_previousMin == 0.0f) {
+			_previousMin = _min;
+			_previousMax = _max;
+		}
+	}
+
+	bool has_rate() const {
+		return _count > 0.0;
+	}
+
+	// reports per second, or 0 if there haven't been any yet
+	float rate() const {
+		return _count > 0.0 ? (float)(_count / _total) : 0.0f;
+	}
+
+	POLL_RATE_STATS stats() const {
+		POLL_RATE_STATS stats = {};
+		if (_count > 0.0) {
+			const double mean = _total / _count;
+			const double variance = _totalSquared / _count - mean * mean;
+			stats.rate = (float)(1.0 / mean);
+			stats.minInterval = (_min < _previousMin ? _min : _previousMin) * 1000.0f;
+			stats.maxInterval = (_max > _previousMax ? _max : _previousMax) * 1000.0f;
+			stats.jitter = variance > 0.0 ? (float)(sqrt(variance) * 1000.0) : 0.0f;
+		}
+		return stats;
+	}
+
+private:
+	bool _started = false;
+	double _count = 0.0;
+	double _total = 0.0;
+	double _totalSquared = 0.0;
+	float _windowSeconds = 0.0f;
+	float _min = 0.0f;
+	float _max = 0.0f;
+	float _previousMin = 0.0f;
+	float _previousMax = 0.0f;
+};
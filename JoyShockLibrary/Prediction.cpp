@@ -0,0 +1,91 @@
+#pragma once
+
+#include "JoyShockLibrary.h"
+#include <cmath>
+
+// Extrapolating a device's orientation forward from the last report, so a reader can ask for where it'll be pointing when its frame's on screen.
+// The polling thread keeps track of angular velocity (and, if asked, angular acceleration) as each IMU sample's fused.
+// Readers take those from the snapshot and turn the orientation forward themselves, so prediction costs the polling thread next to nothing.
+// Uses Quat and Vec from SensorFusion.cpp.
+class MotionPredictor {
+public:
+	// how long the angular acceleration estimate averages over, in seconds. gyro noise gets a lot worse when you take its derivative
+	static constexpr float acceleration_time_constant = 0.05f;
+	// further ahead than this and we're guessing, not predicting
+	static constexpr float max_prediction_seconds = 0.1f;
+
+	// only the polling thread touches this. JoyShock::requested_prediction_acceleration is how anyone else changes it
+	bool use_acceleration = false;
+
+	void reset() {
+		*this = MotionPredictor();
+	}
+
+	// with each sample that's fused. gyro in degrees per second, after calibration
+	void update(float gyroX, float gyroY, float gyroZ, float deltaTime) {
+		const float gyro[3] = { gyroX, gyroY, gyroZ };
+		if (use_acceleration && _started && deltaTime > 0.0f) {
+			// a long gap tells us nothing about how it was speeding up
+			const float alpha = deltaTime > max_prediction_seconds ? 1.0f : deltaTime / (acceleration_time_constant + deltaTime);
+			for (int i = 0; i < 3; i++) {
+				_acceleration[i] += alpha * ((gyro[i] - _velocity[i]) / deltaTime - _acceleration[i]);
+			}
+		}
+		else if (!use_acceleration) {
+			_acceleration[0] = _acceleration[1] = _acceleration[2] = 0.0f;
+		}
+		_velocity[0] = gyroX;
+		_velocity[1] = gyroY;
+		_velocity[2] = gyroZ;
+		_started = true;
+	}
+
+	void get(float velocity[3], float acceleration[3]) const {
+		for (int i = 0; i < 3; i++) {
+			velocity[i] = _velocity[i];
+			acceleration[i] = _acceleration[i];
+		}
+	}
+
+	// motion turned forward by seconds, at the given angular velocity and acceleration (degrees per second, and per second squared, in the device's own frame).
+	// the orientation and gravity are turned. local acceleration is left as it was last reported
+	static MOTION_STATE predict(const MOTION_STATE& motion, const float velocity[3], const float acceleration[3], float seconds) {
+		if (!(seconds > 0.0f)) {
+			return motion;
+		}
+		seconds = seconds < max_prediction_seconds ? seconds : max_prediction_seconds;
+		// velocity changes over the prediction, so it's done in a few steps, each turning at its midpoint's speed
+		const int steps = acceleration[0] != 0.0f || acceleration[1] != 0.0f || acceleration[2] != 0.0f ? 4 : 1;
+		const float stepSeconds = seconds / steps;
+		Quat turn;
+		for (int step = 0; step < steps; step++) {
+			const float midpoint = (step + 0.5f) * stepSeconds;
+			const Vec axis = Vec(velocity[0] + acceleration[0] * midpoint, velocity[1] + acceleration[1] * midpoint, velocity[2] + acceleration[2] * midpoint);
+			const float angle = axis.Length() * (float)M_PI / 180.0f * stepSeconds;
+			if (angle > 0.0f) {
+				turn *= Quat::AngleAxis(angle, axis.x, axis.y, axis.z);
+			}
+		}
+
+		// local rotation, same as Motion::Update
+		Quat orientation = Quat(motion.quatW, motion.quatX, motion.quatY, motion.quatZ) * turn;
+		orientation.Normalize();
+		// gravity's in the device's frame, so it turns the other way
+		const Vec gravity = Vec(motion.gravX, motion.gravY, motion.gravZ) * turn.Inverse();
+
+		MOTION_STATE result = motion;
+		result.quatW = orientation.w;
+		result.quatX = orientation.x;
+		result.quatY = orientation.y;
+		result.quatZ = orientation.z;
+		result.gravX = gravity.x;
+		result.gravY = gravity.y;
+		result.gravZ = gravity.z;
+		return result;
+	}
+
+private:
+	bool _started = false;
+	float _velocity[3] = {};
+	float _acceleration[3] = {};
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "Trace.cpp"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#define JSL_HAS_REACTOR 1
+#else
+#define JSL_HAS_REACTOR 0
+#endif
+
+// A single thread that waits on many file descriptors at once, instead of having one blocking thread per device.
+// The reactor knows nothing about controllers -- whoever owns it decides what "readable" and "timed out" mean.
+// Only available where epoll is (Linux). Everywhere else, start() fails and the caller should fall back to a thread per device.
+
+struct ReactorSource {
+	int fd = -1;
+	void* context = nullptr;
+	std::chrono::steady_clock::time_point deadline;
+	bool finished = false;
+};
+
+class Reactor {
+public:
+	// called when the source's fd is readable. return false to stop watching the source
+	typedef bool(*ReadableCallback)(ReactorSource* source);
+	// called when the source hasn't been readable for timeoutMs. return false to stop watching the source
+	typedef bool(*TimeoutCallback)(ReactorSource* source);
+
+	// how many times epoll_wait returned, and how many source events it reported. handy for comparing against a thread per device
+	std::atomic<unsigned long long> wakeups;
+	std::atomic<unsigned long long> events;
+
+	Reactor(ReadableCallback onReadable, TimeoutCallback onTimeout, int timeoutMs)
+		: wakeups(0), events(0), _onReadable(onReadable), _onTimeout(onTimeout), _timeoutMs(timeoutMs)
+	{
+	}
+
+	~Reactor()
+	{
+		stop();
+		for (ReactorSource* source : _sources)
+		{
+			delete source;
+		}
+	}
+
+	static bool is_supported()
+	{
+		return JSL_HAS_REACTOR != 0;
+	}
+
+	// add sources before calling start()
+	bool add(int fd, void* context)
+	{
+		if (fd < 0 || _thread != nullptr)
+		{
+			return false;
+		}
+		ReactorSource* source = new ReactorSource();
+		source->fd = fd;
+		source->context = context;
+		_sources.push_back(source);
+		return true;
+	}
+
+	int num_sources() const
+	{
+		return (int)_sources.size();
+	}
+
+	bool start()
+	{
+#if JSL_HAS_REACTOR
+		if (_thread != nullptr)
+		{
+			return true;
+		}
+		_epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (_epollFd < 0)
+		{
+			return false;
+		}
+		const auto now = std::chrono::steady_clock::now();
+		for (ReactorSource* source : _sources)
+		{
+			epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.ptr = source;
+			if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, source->fd, &ev) != 0)
+			{
+				close(_epollFd);
+				_epollFd = -1;
+				return false;
+			}
+			source->deadline = now + std::chrono::milliseconds(_timeoutMs);
+			source->finished = false;
+		}
+		_cancel = false;
+		_thread = new std::thread(&Reactor::loop, this);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void stop()
+	{
+		if (_thread == nullptr)
+		{
+			return;
+		}
+		_cancel = true;
+		_thread->join();
+		delete _thread;
+		_thread = nullptr;
+#if JSL_HAS_REACTOR
+		close(_epollFd);
+		_epollFd = -1;
+#endif
+	}
+
+private:
+	ReadableCallback _onReadable;
+	TimeoutCallback _onTimeout;
+	int _timeoutMs;
+	std::vector<ReactorSource*> _sources;
+	std::thread* _thread = nullptr;
+	std::atomic<bool> _cancel{ false };
+	int _epollFd = -1;
+
+	// how long we're willing to wait before checking cancel_thread. keeps shutdown about as responsive as the per-device threads
+	static const int max_wait_ms = 1000;
+
+	void finish(ReactorSource* source)
+	{
+#if JSL_HAS_REACTOR
+		source->finished = true;
+		epoll_ctl(_epollFd, EPOLL_CTL_DEL, source->fd, nullptr);
+#endif
+	}
+
+	void loop()
+	{
+#if JSL_HAS_REACTOR
+		Trace::name_thread("reactor");
+		static const int max_events = 64;
+		epoll_event ready[max_events];
+		const std::chrono::milliseconds timeout(_timeoutMs);
+		// earliest deadline we know of. reports only ever push deadlines later, so this is a lower bound and we only rescan when we reach it
+		auto nextDeadline = std::chrono::steady_clock::now() + timeout;
+
+		while (!_cancel)
+		{
+			auto now = std::chrono::steady_clock::now();
+			int waitMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(nextDeadline - now).count() + 1;
+			if (waitMs < 0)
+			{
+				waitMs = 0;
+			}
+			else if (waitMs > max_wait_ms)
+			{
+				waitMs = max_wait_ms;
+			}
+
+			int numReady;
+			{
+				TraceScope trace("wait", -1);
+				numReady = epoll_wait(_epollFd, ready, max_events, waitMs);
+			}
+			wakeups.fetch_add(1, std::memory_order_relaxed);
+			if (numReady < 0 && errno != EINTR)
+			{
+				break;
+			}
+
+			now = std::chrono::steady_clock::now();
+			for (int i = 0; i < numReady; i++)
+			{
+				ReactorSource* source = (ReactorSource*)ready[i].data.ptr;
+				if (source->finished)
+				{
+					continue;
+				}
+				source->deadline = now + timeout;
+				if (!_onReadable(source) || (ready[i].events & (EPOLLERR | EPOLLHUP)) != 0)
+				{
+					finish(source);
+				}
+			}
+			if (numReady > 0)
+			{
+				events.fetch_add(numReady, std::memory_order_relaxed);
+			}
+
+			if (now >= nextDeadline)
+			{
+				nextDeadline = now + timeout;
+				for (ReactorSource* source : _sources)
+				{
+					if (source->finished)
+					{
+						continue;
+					}
+					if (now >= source->deadline)
+					{
+						// timeout callbacks may block for a while (re-initialising a controller), so take the time again afterwards
+						bool keep = _onTimeout(source);
+						source->deadline = std::chrono::steady_clock::now() + timeout;
+						if (!keep)
+						{
+							finish(source);
+							continue;
+						}
+					}
+					if (source->deadline < nextDeadline)
+					{
+						nextDeadline = source->deadline;
+					}
+				}
+			}
+		}
+#endif
+	}
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "JoyShockLibrary.h"
+#include "JoyShock.cpp"
+#include "SwitchImu.cpp"
+#include "InputHelpers.cpp"
+
+#include <chrono>
+#include <cmath>
+
+// Report decoding specialised for each kind of controller. handle_input works out what it's looking at on every report;
+// these are picked once, when the device connects, with everything about the report's layout known at compile time.
+// Buttons come out of lookup tables, one per byte of the report, instead of being shifted and masked into place one at a time.
+// They give exactly the same results as handle_input, which stays as the reference (jsl_bench checks them against each other).
+
+// what each value of one byte of buttons means
+struct ButtonTable {
+	int masks[256];
+
+	// bitN is the mask for bit N. with a hat, the low 4 bits are a d-pad direction rather than 4 buttons:
+	// 0x08 is released, 0=N, 1=NE, 2=E, 3=SE, 4=S, 5=SW, 6=W, 7=NW
+	constexpr ButtonTable(bool hat, int bit0, int bit1, int bit2, int bit3, int bit4, int bit5, int bit6, int bit7) : masks() {
+		const int bits[8] = { bit0, bit1, bit2, bit3, bit4, bit5, bit6, bit7 };
+		for (int value = 0; value < 256; value++) {
+			int mask = 0;
+			for (int bit = hat ? 4 : 0; bit < 8; bit++) {
+				if ((value & (1 << bit)) != 0) {
+					mask |= bits[bit];
+				}
+			}
+			if (hat) {
+				const int direction = value & 0x0F;
+				if (direction > 2 && direction < 6) mask |= JSMASK_DOWN; // down = SE | S | SW
+				if (direction == 7 || direction < 2) mask |= JSMASK_UP; // up = N | NE | NW
+				if (direction > 0 && direction < 4) mask |= JSMASK_RIGHT; // right = NE | E | SE
+				if (direction > 4 && direction < 8) mask |= JSMASK_LEFT; // left = SW | W | NW
+			}
+			masks[value] = mask;
+		}
+	}
+
+	int operator[](uint8_t value) const {
+		return masks[value];
+	}
+};
+
+// PlayStation controllers: the hat and face buttons, then shoulders, options and stick clicks, then PS and touchpad click (the rest of that byte is the report counter)
+constexpr ButtonTable _playStationFaceButtons(true, 0, 0, 0, 0, JSMASK_W, JSMASK_S, JSMASK_E, JSMASK_N);
+constexpr ButtonTable _playStationShoulderButtons(false, JSMASK_L, JSMASK_R, 0, 0, JSMASK_SHARE, JSMASK_OPTIONS, JSMASK_LCLICK, JSMASK_RCLICK);
+constexpr ButtonTable _playStationSystemButtons(false, JSMASK_PS, JSMASK_TOUCHPAD_CLICK, 0, 0, 0, 0, 0, 0);
+
+// Switch controllers: the right byte, the byte both sides share, and the left byte. Joy-Cons have SL and SR on the rail, the Pro Controller doesn't
+constexpr ButtonTable _joyConRightButtons(false, JSMASK_W, JSMASK_N, JSMASK_S, JSMASK_E, JSMASK_SR, JSMASK_SL, JSMASK_R, JSMASK_ZR);
+constexpr ButtonTable _joyConLeftButtons(false, JSMASK_DOWN, JSMASK_UP, JSMASK_RIGHT, JSMASK_LEFT, JSMASK_SR, JSMASK_SL, JSMASK_L, JSMASK_ZL);
+constexpr ButtonTable _proControllerRightButtons(false, JSMASK_W, JSMASK_N, JSMASK_S, JSMASK_E, 0, 0, JSMASK_R, JSMASK_ZR);
+constexpr ButtonTable _proControllerLeftButtons(false, JSMASK_DOWN, JSMASK_UP, JSMASK_RIGHT, JSMASK_LEFT, 0, 0, JSMASK_L, JSMASK_ZL);
+constexpr ButtonTable _joyConRightSharedButtons(false, 0, JSMASK_PLUS, JSMASK_RCLICK, 0, JSMASK_HOME, 0, 0, 0);
+constexpr ButtonTable _joyConLeftSharedButtons(false, JSMASK_MINUS, 0, 0, JSMASK_LCLICK, 0, JSMASK_CAPTURE, 0, 0);
+constexpr ButtonTable _proControllerSharedButtons(false, JSMASK_MINUS, JSMASK_PLUS, JSMASK_RCLICK, JSMASK_LCLICK, JSMASK_HOME, JSMASK_CAPTURE, 0, 0);
+
+// PlayStation sticks and triggers are a byte each
+struct AxisTable {
+	float values[256];
+
+	constexpr AxisTable(bool stick) : values() {
+		for (int value = 0; value < 256; value++) {
+			const double centred = (value - 127.0) / 127.0;
+			values[value] = stick ? (float)(centred > 1.0 ? 1.0 : centred) : value / 255.0f;
+		}
+	}
+
+	float operator[](uint8_t value) const {
+		return values[value];
+	}
+};
+
+constexpr AxisTable _playStationSticks(true);
+constexpr AxisTable _playStationTriggers(false);
+
+// Where everything is in each PlayStation input report
+struct Ds4UsbReport {
+	static constexpr int id = 0x01;
+	static constexpr bool dongle = true; // the wireless adapter sends reports with nothing in them when there's no controller
+	static constexpr int sticks = 1; // left x, left y, right x, right y
+	static constexpr int triggers = 8; // left, right
+	static constexpr int buttons = 5; // face, shoulder, system
+	static constexpr int counter = 7;
+	static constexpr int counter_shift = 2;
+	static constexpr int counter_bits = 6;
+	static constexpr int timer = 10;
+	static constexpr int timer_bits = 16;
+	static constexpr double timer_microseconds = 16.0 / 3.0;
+	static constexpr int gyro = 13;
+	static constexpr int accel = 19;
+	static constexpr int touch = 35;
+	static constexpr int min_length = 43; // to the end of the second touch
+};
+
+struct Ds4BluetoothReport {
+	static constexpr int id = 0x11;
+	static constexpr bool dongle = false;
+	static constexpr int sticks = 3;
+	static constexpr int triggers = 10;
+	static constexpr int buttons = 7;
+	static constexpr int counter = 9;
+	static constexpr int counter_shift = 2;
+	static constexpr int counter_bits = 6;
+	static constexpr int timer = 12;
+	static constexpr int timer_bits = 16;
+	static constexpr double timer_microseconds = 16.0 / 3.0;
+	static constexpr int gyro = 15;
+	static constexpr int accel = 21;
+	static constexpr int touch = 37;
+	static constexpr int min_length = 45;
+};
+
+struct DualSenseUsbReport {
+	static constexpr int id = -1; // handle_input doesn't check it
+	static constexpr bool dongle = false;
+	static constexpr int sticks = 1;
+	static constexpr int triggers = 5;
+	static constexpr int buttons = 8;
+	static constexpr int counter = 7;
+	static constexpr int counter_shift = 0;
+	static constexpr int counter_bits = 8;
+	static constexpr int timer = 28;
+	static constexpr int timer_bits = 32;
+	static constexpr double timer_microseconds = 1.0 / 3.0;
+	static constexpr int gyro = 16;
+	static constexpr int accel = 22;
+	static constexpr int touch = 33;
+	static constexpr int min_length = 41;
+};
+
+static inline int16_t read_int16(const uint8_t* data) {
+	return uint16_to_int16(data[0] | (data[1] << 8));
+}
+
+// what every report starts with. returns the time since the last report arrived
+static inline float begin_report(JoyShock* jc) {
+	jc->last_simple_state = jc->simple_state;
+	jc->simple_state.buttons = 0;
+	jc->last_imu_state = jc->imu_state;
+	auto time_now = std::chrono::steady_clock::now();
+	const float host_delta_time = (float)(std::chrono::duration_cast<std::chrono::microseconds>(time_now - jc->last_polled).count() / 1000000.0);
+	jc->delta_time = host_delta_time;
+	jc->last_polled = time_now;
+	return host_delta_time;
+}
+
+// pushSample is false when calibration has already been given this report's samples some other way
+static inline void calibrate_gyro(JoyShock* jc, bool pushSample = true) {
+	if (pushSample) {
+		jc->calibrate(jc->imu_state.gyroX, jc->imu_state.gyroY, jc->imu_state.gyroZ,
+			sqrtf(jc->imu_state.accelX * jc->imu_state.accelX + jc->imu_state.accelY * jc->imu_state.accelY + jc->imu_state.accelZ * jc->imu_state.accelZ), jc->delta_time);
+	}
+
+	jc->imu_state.gyroX -= jc->offset_x;
+	jc->imu_state.gyroY -= jc->offset_y;
+	jc->imu_state.gyroZ -= jc->offset_z;
+}
+
+template <typename Layout>
+bool parse_playstation_report(JoyShock* jc, uint8_t* packet, int len, bool& hasIMU) {
+	hasIMU = true;
+	if (packet[0] == 0) return false; // ignore non-responses
+	// everything's read from fixed places, so a short report would be read past its end
+	if (len < Layout::min_length) return false;
+	const float host_delta_time = begin_report(jc);
+	if (Layout::id >= 0 && packet[0] != Layout::id) {
+		return true;
+	}
+	if (Layout::dongle && (packet[31] & 0x04) == 0x04) {
+		return false;
+	}
+
+	const uint8_t* timer = packet + Layout::timer;
+	uint32_t timerValue = timer[0] | (timer[1] << 8);
+	if (Layout::timer_bits == 32) {
+		timerValue |= (timer[2] << 16) | ((uint32_t)timer[3] << 24);
+	}
+	jc->delta_time = jc->update_device_timer(timerValue, Layout::timer_bits, Layout::timer_microseconds, host_delta_time);
+	jc->track_report_counter(packet[Layout::counter] >> Layout::counter_shift, Layout::counter_bits, 1, host_delta_time, 0.004f);
+
+	const int16_t gyroSampleX = read_int16(packet + Layout::gyro);
+	const int16_t gyroSampleY = read_int16(packet + Layout::gyro + 2);
+	const int16_t gyroSampleZ = read_int16(packet + Layout::gyro + 4);
+	const int16_t accelSampleX = read_int16(packet + Layout::accel);
+	const int16_t accelSampleY = read_int16(packet + Layout::accel + 2);
+	const int16_t accelSampleZ = read_int16(packet + Layout::accel + 4);
+	hasIMU = (gyroSampleX | gyroSampleY | gyroSampleZ | accelSampleX | accelSampleY | accelSampleZ) != 0;
+
+	jc->imu_state.gyroX = (float)(gyroSampleX) * (2000.0 / 32767.0);
+	jc->imu_state.gyroY = (float)(gyroSampleY) * (2000.0 / 32767.0);
+	jc->imu_state.gyroZ = (float)(gyroSampleZ) * (2000.0 / 32767.0);
+	jc->imu_state.accelX = (float)(accelSampleX) / 8192.0;
+	jc->imu_state.accelY = (float)(accelSampleY) / 8192.0;
+	jc->imu_state.accelZ = (float)(accelSampleZ) / 8192.0;
+
+	jc->last_touch_state = jc->touch_state;
+	const uint8_t* touch = packet + Layout::touch;
+	jc->touch_state.t0Id = (int)(touch[0] & 0x7F);
+	jc->touch_state.t1Id = (int)(touch[4] & 0x7F);
+	jc->touch_state.t0Down = (touch[0] & 0x80) == 0;
+	jc->touch_state.t1Down = (touch[4] & 0x80) == 0;
+	jc->touch_state.t0X = (touch[1] | (touch[2] & 0x0F) << 8) / 1920.0f;
+	jc->touch_state.t0Y = ((touch[2] & 0xF0) >> 4 | touch[3] << 4) / 943.0f;
+	jc->touch_state.t1X = (touch[5] | (touch[6] & 0x0F) << 8) / 1920.0f;
+	jc->touch_state.t1Y = ((touch[6] & 0xF0) >> 4 | touch[7] << 4) / 943.0f;
+
+	const uint8_t* buttons = packet + Layout::buttons;
+	const uint8_t* triggers = packet + Layout::triggers;
+	jc->simple_state.buttons = _playStationFaceButtons[buttons[0]] | _playStationShoulderButtons[buttons[1]] | _playStationSystemButtons[buttons[2]] |
+		(triggers[0] != 0 ? JSMASK_ZL : 0) | (triggers[1] != 0 ? JSMASK_ZR : 0);
+	jc->simple_state.lTrigger = _playStationTriggers[triggers[0]];
+	jc->simple_state.rTrigger = _playStationTriggers[triggers[1]];
+
+	// y goes down
+	const uint8_t* sticks = packet + Layout::sticks;
+	jc->simple_state.stickLX = _playStationSticks[sticks[0]];
+	jc->simple_state.stickLY = _playStationSticks[255 - sticks[1]];
+	jc->simple_state.stickRX = _playStationSticks[sticks[2]];
+	jc->simple_state.stickRY = _playStationSticks[255 - sticks[3]];
+
+	calibrate_gyro(jc);
+	return true;
+}
+
+// each Switch report has 3 samples, 5ms apart. SwitchImu.cpp averages them, with SIMD if it can
+static inline void decode_switch_imu(JoyShock* jc, const uint8_t* packet, bool& hasIMU) {
+	float imu[6];
+	hasIMU = switch_imu_decoder()(packet + 13, jc->sensor_cal[1], imu);
+	jc->imu_state.accelX = imu[0];
+	jc->imu_state.accelY = imu[1];
+	jc->imu_state.accelZ = imu[2];
+	jc->imu_state.gyroX = imu[3];
+	jc->imu_state.gyroY = imu[4];
+	jc->imu_state.gyroZ = imu[5];
+
+	// just the once. if it changed in between, a report could go to calibration twice over, or not at all
+	const bool useImuSamples = jc->use_imu_samples.load(std::memory_order_relaxed);
+	if (useImuSamples) {
+		push_switch_imu_samples(jc, packet);
+	}
+	calibrate_gyro(jc, !useImuSamples);
+}
+
+// input reports run to the end of the third IMU sample. bluetooth button reports are read up to packet[3]
+static constexpr int switch_input_report_length = 49;
+static constexpr int switch_button_report_length = 4;
+
+// LeftRight is the same as JoyShock::left_right: 1 for a left Joy-Con, 2 for a right one, 3 for a Pro Controller
+template <int LeftRight>
+bool parse_switch_report(JoyShock* jc, uint8_t* packet, int len, bool& hasIMU) {
+	hasIMU = true;
+	if (packet[0] == 0) return false; // ignore non-responses
+	const bool isInput = packet[0] == 0x21 || packet[0] == 0x30 || packet[0] == 0x31;
+	if (isInput && len < switch_input_report_length) return false;
+	if (packet[0] == 0x3F && len < switch_button_report_length) return false;
+	const float host_delta_time = begin_report(jc);
+
+	// bluetooth button pressed packet:
+	if (packet[0] == 0x3F) {
+		jc->dstick = packet[3];
+	}
+
+	// only input reports have buttons. anything else is no buttons
+	uint8_t rightButtons = 0;
+	uint8_t sharedButtons = 0;
+	uint8_t leftButtons = 0;
+	if (isInput) {
+		jc->delta_time = jc->update_device_timer(packet[1], 8, 5000.0, host_delta_time);
+		jc->track_switch_timer(packet[1], host_delta_time);
+
+		rightButtons = packet[3];
+		sharedButtons = packet[4];
+		leftButtons = packet[5];
+
+		// each stick is two 12 bit values
+		const uint8_t* stick_data = packet + (LeftRight == 2 ? 9 : 6);
+		uint16_t stick_x = stick_data[0] | ((stick_data[1] & 0xF) << 8);
+		uint16_t stick_y = (stick_data[1] >> 4) | (stick_data[2] << 4);
+		if (LeftRight == 2) {
+			jc->CalcAnalogStick2(jc->simple_state.stickRX, jc->simple_state.stickRY, stick_x, stick_y, jc->stick_cal_x_r, jc->stick_cal_y_r);
+		}
+		else {
+			jc->CalcAnalogStick2(jc->simple_state.stickLX, jc->simple_state.stickLY, stick_x, stick_y, jc->stick_cal_x_l, jc->stick_cal_y_l);
+		}
+		if (LeftRight == 3) {
+			stick_data += 3;
+			stick_x = stick_data[0] | ((stick_data[1] & 0xF) << 8);
+			stick_y = (stick_data[1] >> 4) | (stick_data[2] << 4);
+			jc->CalcAnalogStick2(jc->simple_state.stickRX, jc->simple_state.stickRY, stick_x, stick_y, jc->stick_cal_x_r, jc->stick_cal_y_r);
+		}
+		jc->battery = (stick_data[1] & 0xF0) >> 4;
+
+		decode_switch_imu(jc, packet, hasIMU);
+	}
+	else {
+		// no new IMU data, so leave the last lot alone
+		hasIMU = false;
+	}
+
+	if (LeftRight == 1) {
+		jc->simple_state.buttons = _joyConLeftButtons[leftButtons] | _joyConLeftSharedButtons[sharedButtons];
+		jc->simple_state.lTrigger = (float)(leftButtons >> 7);
+		if (isInput) {
+			// just need to negate gyroZ
+			jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+		}
+	}
+	else if (LeftRight == 2) {
+		jc->simple_state.buttons = _joyConRightButtons[rightButtons] | _joyConRightSharedButtons[sharedButtons];
+		jc->simple_state.rTrigger = (float)(rightButtons >> 7);
+		if (isInput) {
+			// for some reason we need to negate x and y, and z on the right joycon
+			jc->imu_state.gyroX = -jc->imu_state.gyroX;
+			jc->imu_state.gyroY = -jc->imu_state.gyroY;
+			jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+			jc->imu_state.accelX = -jc->imu_state.accelX;
+			jc->imu_state.accelY = -jc->imu_state.accelY;
+		}
+	}
+	else {
+		jc->simple_state.buttons = _proControllerLeftButtons[leftButtons] | _proControllerRightButtons[rightButtons] | _proControllerSharedButtons[sharedButtons];
+		jc->simple_state.lTrigger = (float)(leftButtons >> 7);
+		jc->simple_state.rTrigger = (float)(rightButtons >> 7);
+		if (isInput) {
+			// just need to negate gyroZ
+			jc->imu_state.gyroZ = -jc->imu_state.gyroZ;
+		}
+	}
+	return true;
+}
+
+// once we know exactly what the device is
+static void choose_report_parser(JoyShock* jc) {
+	if (jc->controller_type == ControllerType::s_ds4) {
+		jc->parse_report = jc->is_usb ? &parse_playstation_report<Ds4UsbReport> : &parse_playstation_report<Ds4BluetoothReport>;
+	}
+	else if (jc->controller_type == ControllerType::s_ds) {
+		jc->parse_report = &parse_playstation_report<DualSenseUsbReport>;
+	}
+	else if (jc->left_right == 1) {
+		jc->parse_report = &parse_switch_report<1>;
+	}
+	else if (jc->left_right == 2) {
+		jc->parse_report = &parse_switch_report<2>;
+	}
+	else if (jc->left_right == 3) {
+		jc->parse_report = &parse_switch_report<3>;
+	}
+	else {
+		jc->parse_report = nullptr;
+	}
+}
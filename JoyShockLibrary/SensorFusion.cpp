@@ -233,16 +233,162 @@ struct Vec
 	}
 };
 
+// The smallest box holding every (global) gravity sample from the last little while, for telling when the controller's steady.
+// Samples stay in the box for a fixed time rather than a fixed number of samples, so it's the same window at 67Hz as it is at 250Hz.
+// Each axis has a monotonic deque for its min and another for its max (sample numbers, oldest first, whose values only ever go one way),
+// so adding a sample and getting the box costs O(1) amortised however many samples are in the window.
+struct GravityWindow
+{
+	// the window can't hold more samples than this, however long it is. a 32ms window at 1000Hz
+	static const int MaxSamples = 32;
+	// the clock's wound back by this much whenever it gets there, so it never gets big enough to lose precision. it's a power of 2, so winding back is exact
+	static constexpr float ClockWrap = 16.0f;
+	// when a sample that was never added was added, so it's never in the window
+	static constexpr float NeverAdded = -1e30f;
+
+	// samples from this long ago or longer are out (the newest is always in). 10 samples at 250Hz, which is what Motion used to look at.
+	// change it with SetWindowSeconds
+	float WindowSeconds = 0.04f;
+
+	Vec Samples[MaxSamples];
+	float SampleTimes[MaxSamples];
+	// how many have ever been added. the newest is at (NumSamples - 1) % MaxSamples
+	unsigned int NumSamples = 0;
+	float Clock = 0.0f;
+
+	// min x, y, z then max x, y, z. each is a ring of sample numbers
+	unsigned int Deques[6][MaxSamples];
+	int DequeStart[6];
+	int DequeLength[6];
+
+	GravityWindow()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		NumSamples = 0;
+		Clock = 0.0f;
+		for (int idx = 0; idx < MaxSamples; idx++)
+		{
+			SampleTimes[idx] = NeverAdded;
+		}
+		for (int deque = 0; deque < 6; deque++)
+		{
+			DequeStart[deque] = 0;
+			DequeLength[deque] = 0;
+		}
+	}
+
+	// time passes whether or not there's a sample to add
+	void Advance(float deltaTime)
+	{
+		if (deltaTime > 0.0f)
+		{
+			Clock += deltaTime;
+		}
+		if (Clock >= ClockWrap)
+		{
+			Clock -= ClockWrap;
+			for (int idx = 0; idx < MaxSamples; idx++)
+			{
+				SampleTimes[idx] -= ClockWrap;
+			}
+		}
+	}
+
+	void Add(const Vec& sample)
+	{
+		const unsigned int newest = NumSamples++;
+		Samples[newest % MaxSamples] = sample;
+		SampleTimes[newest % MaxSamples] = Clock;
+		Push(newest);
+	}
+
+	void SetWindowSeconds(float seconds)
+	{
+		WindowSeconds = seconds;
+		// samples that had already left a shorter window can be back in a longer one, so the deques are worked out again from everything that's kept
+		for (int deque = 0; deque < 6; deque++)
+		{
+			DequeLength[deque] = 0;
+		}
+		const unsigned int numKept = NumSamples < (unsigned int)MaxSamples ? NumSamples : (unsigned int)MaxSamples;
+		for (unsigned int sample = NumSamples - numKept; sample != NumSamples; sample++)
+		{
+			Push(sample);
+		}
+	}
+
+	// only meaningful once something's been added
+	Vec Min() const
+	{
+		return Vec(Front(0), Front(1), Front(2));
+	}
+
+	Vec Max() const
+	{
+		return Vec(Front(3), Front(4), Front(5));
+	}
+
+private:
+	static float Axis(const Vec& vec, int axis)
+	{
+		return axis == 0 ? vec.x : axis == 1 ? vec.y : vec.z;
+	}
+
+	// a sample that's already in Samples goes on the back of every deque
+	void Push(unsigned int newest)
+	{
+		for (int deque = 0; deque < 6; deque++)
+		{
+			// the front's the oldest, so it's the first to go
+			while (DequeLength[deque] > 0 && HasExpired(Deques[deque][DequeStart[deque]], newest))
+			{
+				DequeStart[deque] = (DequeStart[deque] + 1) % MaxSamples;
+				DequeLength[deque]--;
+			}
+			const bool isMax = deque >= 3;
+			const float value = Axis(Samples[newest % MaxSamples], deque % 3);
+			// anything that's no lower (for min) or no higher (for max) than the new sample can't be the answer again before the new one leaves
+			while (DequeLength[deque] > 0)
+			{
+				const float back = Axis(Samples[Back(deque) % MaxSamples], deque % 3);
+				if (isMax ? back > value : back < value)
+				{
+					break;
+				}
+				DequeLength[deque]--;
+			}
+			Deques[deque][(DequeStart[deque] + DequeLength[deque]) % MaxSamples] = newest;
+			DequeLength[deque]++;
+		}
+	}
+
+	unsigned int Back(int deque) const
+	{
+		return Deques[deque][(DequeStart[deque] + DequeLength[deque] - 1) % MaxSamples];
+	}
+
+	float Front(int deque) const
+	{
+		return Axis(Samples[Deques[deque][DequeStart[deque]] % MaxSamples], deque % 3);
+	}
+
+	bool HasExpired(unsigned int sample, unsigned int newest) const
+	{
+		return newest - sample >= (unsigned int)MaxSamples || Clock - SampleTimes[sample % MaxSamples] >= WindowSeconds;
+	}
+};
+
 struct Motion
 {
 	Quat Quaternion;
 	Vec Accel;
 	Vec Grav;
 
-	const int NumGravDirectionSamples = 10;
-	Vec GravDirectionSamples[10];
-	int LastGravityIdx = 9;
-	int NumGravDirectionSamplesCounted = 0;
+	GravityWindow Gravity;
 	float TimeCorrecting = 0.0f;
 
 	Motion()
@@ -271,7 +417,7 @@ struct Motion
 		Quaternion.Set(1.0f, 0.0f, 0.0f, 0.0f);
 		Accel.Set(0.0f, 0.0f, 0.0f);
 		Grav.Set(0.0f, 0.0f, 0.0f);
-		NumGravDirectionSamplesCounted = 0;
+		Gravity.Reset();
 	}
 
 	/// <summary>
@@ -289,50 +435,17 @@ struct Motion
 		Quaternion *= rotation; // do it this way because it's a local rotation, not global
 		//printf("Quat: %.4f %.4f %.4f %.4f _",
 		//	Quaternion.w, Quaternion.x, Quaternion.y, Quaternion.z);
+		Gravity.Advance(deltaTime);
 		float accelMagnitude = accel.Length();
 		if (accelMagnitude > 0.0f)
 		{
 			const Vec accelNorm = accel / accelMagnitude;
-			LastGravityIdx = (LastGravityIdx + NumGravDirectionSamples - 1) % NumGravDirectionSamples;
 			// for comparing and perhaps smoothing gravity samples, we need them to be global
 			Vec absoluteAccel = accel * Quaternion;
-			GravDirectionSamples[LastGravityIdx] = absoluteAccel;
-			Vec gravityMin = absoluteAccel;
-			Vec gravityMax = absoluteAccel;
-			//GravDirectionSamples[LastGravityIdx] = accel;
-			//Vec gravityMin = accel;
-			//Vec gravityMax = accel;
+			Gravity.Add(absoluteAccel);
+			const Vec gravityMin = Gravity.Min();
+			const Vec gravityMax = Gravity.Max();
 			const float steadyGravityThreshold = 0.05f;
-			NumGravDirectionSamplesCounted++;
-			const int numGravSamples = NumGravDirectionSamplesCounted < NumGravDirectionSamples ? NumGravDirectionSamplesCounted : NumGravDirectionSamples;
-			for (int idx = 1; idx < numGravSamples; idx++)
-			{
-				Vec thisSample = GravDirectionSamples[(LastGravityIdx + idx) % NumGravDirectionSamples];
-				if (thisSample.x > gravityMax.x)
-				{
-					gravityMax.x = thisSample.x;
-				}
-				if (thisSample.y > gravityMax.y)
-				{
-					gravityMax.y = thisSample.y;
-				}
-				if (thisSample.z > gravityMax.z)
-				{
-					gravityMax.z = thisSample.z;
-				}
-				if (thisSample.x < gravityMin.x)
-				{
-					gravityMin.x = thisSample.x;
-				}
-				if (thisSample.y < gravityMin.y)
-				{
-					gravityMin.y = thisSample.y;
-				}
-				if (thisSample.y < gravityMin.y)
-				{
-					gravityMin.z = thisSample.z;
-				}
-			}
 			const Vec gravityBoxSize = gravityMax - gravityMin;
 			//printf(" Gravity Box Size: %.4f _ ", gravityBoxSize.Length());
 			if (gravityBoxSize.x <= steadyGravityThreshold &&
@@ -0,0 +1,49 @@
+#pragma once
+
+// What SIMD we can compile for, and what the CPU we're on can run. SSE2 is a given on any x64 build.
+// AVX2 code has to be marked as such (JSL_TARGET_AVX2 on a function, or JSL_BEGIN_TARGET_AVX2 ... JSL_END_TARGET_AVX2 around everything defined
+// in between), and only called once cpu_has_avx2() says so.
+
+#if defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <intrin.h>
+#include <immintrin.h>
+#define JSL_HAS_SSE2 1
+#define JSL_TARGET_AVX2
+#define JSL_BEGIN_TARGET_AVX2
+#define JSL_END_TARGET_AVX2
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__SSE2__))
+#include <immintrin.h>
+#define JSL_HAS_SSE2 1
+#define JSL_TARGET_AVX2 __attribute__((target("avx2")))
+#if defined(__clang__)
+#define JSL_BEGIN_TARGET_AVX2 _Pragma("clang attribute push (__attribute__((target(\"avx2\"))), apply_to = function)")
+#define JSL_END_TARGET_AVX2 _Pragma("clang attribute pop")
+#else
+#define JSL_BEGIN_TARGET_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2\")")
+#define JSL_END_TARGET_AVX2 _Pragma("GCC pop_options")
+#endif
+#else
+#define JSL_HAS_SSE2 0
+#endif
+
+#if JSL_HAS_SSE2
+inline bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	// the OS has to save the AVX registers too
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
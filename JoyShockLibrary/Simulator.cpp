@@ -0,0 +1,423 @@
+#pragma once
+
+#include "JoyShock.cpp"
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <vector>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+// Pretends to be a controller, for load testing without a pile of real ones.
+// It answers the handshakes JoyShock does when connecting (Switch USB commands, subcommands and SPI flash reads), then streams
+// valid reports at the real controller's rate, with a slowly turning gyro and a button that's pressed every other second.
+// It can also drop reports, deliver them late, and disconnect, to see how the library copes.
+
+struct SIMULATED_DEVICE_SETTINGS {
+	int type; // JS_SIMULATE_*
+	float packetLoss; // chance of each report going missing, from 0 to 1
+	float jitter; // reports arrive up to this many seconds late
+	float disconnectAfter; // seconds after connecting, or 0 to stay connected
+};
+
+class SimulatedTransport : public Transport {
+public:
+	SimulatedTransport(const SIMULATED_DEVICE_SETTINGS& settings, unsigned int seed)
+		: _settings(settings), _random(seed), _start(std::chrono::steady_clock::now())
+	{
+		const bool isSwitch = settings.type == JS_SIMULATE_JOYCON_LEFT || settings.type == JS_SIMULATE_JOYCON_RIGHT ||
+			settings.type == JS_SIMULATE_PRO_CONTROLLER || settings.type == JS_SIMULATE_PRO_CONTROLLER_USB;
+		_period = std::chrono::microseconds(!isSwitch ? 4000 : settings.type == JS_SIMULATE_PRO_CONTROLLER_USB ? 8000 : 15000);
+		_nextDue = _start + _period;
+	}
+
+	~SimulatedTransport() override {
+		close_poll_fd();
+	}
+
+	// what the device looks like to hidapi
+	static void describe(int type, struct hid_device_info& dev) {
+		switch (type) {
+		case JS_SIMULATE_DS4_USB:
+			dev.vendor_id = DS4_VENDOR;
+			dev.product_id = DS4_USB_V2;
+			break;
+		case JS_SIMULATE_DS4_BT:
+			dev.vendor_id = DS4_VENDOR;
+			dev.product_id = DS4_BT;
+			break;
+		case JS_SIMULATE_DUALSENSE_USB:
+			dev.vendor_id = DS_VENDOR;
+			dev.product_id = DS_USB;
+			break;
+		case JS_SIMULATE_JOYCON_LEFT:
+			dev.vendor_id = JOYCON_VENDOR;
+			dev.product_id = JOYCON_L_BT;
+			break;
+		case JS_SIMULATE_JOYCON_RIGHT:
+			dev.vendor_id = JOYCON_VENDOR;
+			dev.product_id = JOYCON_R_BT;
+			break;
+		case JS_SIMULATE_PRO_CONTROLLER:
+		case JS_SIMULATE_PRO_CONTROLLER_USB:
+		default:
+			dev.vendor_id = JOYCON_VENDOR;
+			dev.product_id = PRO_CONTROLLER;
+			break;
+		}
+		dev.interface_number = -1;
+	}
+
+	bool is_open() const override {
+		return true;
+	}
+
+	int write(const unsigned char* data, size_t length) override {
+		if (disconnected()) {
+			return -1;
+		}
+		std::lock_guard<std::mutex> guard(_lock);
+		respond(data, length);
+		return (int)length;
+	}
+
+	int read_timeout(unsigned char* data, size_t length, int milliseconds) override {
+		return next_report(data, length, milliseconds);
+	}
+
+	int read(unsigned char* data, size_t length) override {
+		return next_report(data, length, _nonblocking ? 0 : -1);
+	}
+
+	int set_nonblocking(int nonblock) override {
+		_nonblocking = nonblock != 0;
+		return 0;
+	}
+
+	// a timer that goes off whenever the next report is due
+	int open_poll_fd() override {
+#ifdef __linux__
+		if (_timerFd < 0) {
+			_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (_timerFd >= 0) {
+				std::lock_guard<std::mutex> guard(_lock);
+				arm_timer();
+			}
+		}
+		return _timerFd;
+#else
+		return -1;
+#endif
+	}
+
+	void close_poll_fd() override {
+#ifdef __linux__
+		if (_timerFd >= 0) {
+			close(_timerFd);
+			_timerFd = -1;
+		}
+#endif
+	}
+
+	// the next report straight away, whether or not it's due, and never lost. for benchmarks, which want lots of realistic reports quickly
+	int generate(unsigned char* data, size_t length) {
+		std::lock_guard<std::mutex> guard(_lock);
+		unsigned char report[64];
+		make_report(report);
+		_reportNumber++;
+		return copy_out(report, sizeof(report), data, length);
+	}
+
+	int read_ready(unsigned char* data, size_t length) override {
+#ifdef __linux__
+		uint64_t expirations;
+		if (::read(_timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+			return -1;
+		}
+		const int res = next_report(data, length, 0);
+		std::lock_guard<std::mutex> guard(_lock);
+		arm_timer();
+		return res;
+#else
+		return -1;
+#endif
+	}
+
+private:
+	SIMULATED_DEVICE_SETTINGS _settings;
+	std::mt19937 _random;
+	std::chrono::steady_clock::time_point _start;
+	std::chrono::microseconds _period;
+	// when the next report will be ready (with jitter)
+	std::chrono::steady_clock::time_point _nextDue;
+	// reports so far, including dropped ones
+	unsigned int _reportNumber = 0;
+	bool _nonblocking = false;
+	int _timerFd = -1;
+	// replies to writes, which come before the next report
+	std::deque<std::vector<unsigned char>> _replies;
+	std::mutex _lock;
+
+	bool is_switch() const {
+		return _settings.type == JS_SIMULATE_JOYCON_LEFT || _settings.type == JS_SIMULATE_JOYCON_RIGHT ||
+			_settings.type == JS_SIMULATE_PRO_CONTROLLER || _settings.type == JS_SIMULATE_PRO_CONTROLLER_USB;
+	}
+
+	bool disconnected() const {
+		return _settings.disconnectAfter > 0.0f &&
+			std::chrono::steady_clock::now() - _start > std::chrono::duration<float>(_settings.disconnectAfter);
+	}
+
+	// waits up to milliseconds (forever if it's negative) for a reply or the next report
+	int next_report(unsigned char* data, size_t length, int milliseconds) {
+		const auto giveUp = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+		for (;;) {
+			if (disconnected()) {
+				return -1;
+			}
+			std::unique_lock<std::mutex> guard(_lock);
+			if (!_replies.empty()) {
+				const std::vector<unsigned char> reply = _replies.front();
+				_replies.pop_front();
+				return copy_out(reply.data(), reply.size(), data, length);
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (now >= _nextDue) {
+				unsigned char report[64];
+				const bool lost = make_report(report);
+				schedule_next();
+				if (lost) {
+					continue;
+				}
+				return copy_out(report, sizeof(report), data, length);
+			}
+			if (milliseconds >= 0 && now >= giveUp) {
+				return 0;
+			}
+			auto wakeAt = _nextDue;
+			if (milliseconds >= 0 && giveUp < wakeAt) {
+				wakeAt = giveUp;
+			}
+			guard.unlock();
+			std::this_thread::sleep_until(wakeAt);
+		}
+	}
+
+	static int copy_out(const unsigned char* report, size_t reportLength, unsigned char* data, size_t length) {
+		const size_t copied = reportLength < length ? reportLength : length;
+		memcpy(data, report, copied);
+		return (int)copied;
+	}
+
+	void schedule_next() {
+		_reportNumber++;
+		// jitter delays reports without moving the ones after them, so late reports bunch up like they do over Bluetooth
+		auto due = _start + _period * (_reportNumber + 1);
+		if (_settings.jitter > 0.0f) {
+			std::uniform_real_distribution<float> delay(0.0f, _settings.jitter);
+			due += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<float>(delay(_random)));
+		}
+		// reports can't overtake each other
+		if (due < _nextDue) {
+			due = _nextDue;
+		}
+		_nextDue = due;
+	}
+
+#ifdef __linux__
+	void arm_timer() {
+		if (_timerFd < 0) {
+			return;
+		}
+		itimerspec timer = {};
+		if (!_replies.empty()) {
+			// as soon as possible
+			timer.it_value.tv_nsec = 1;
+		}
+		else {
+			const auto until = std::chrono::duration_cast<std::chrono::nanoseconds>(_nextDue - std::chrono::steady_clock::now()).count();
+			timer.it_value.tv_sec = until > 0 ? (time_t)(until / 1000000000) : 0;
+			timer.it_value.tv_nsec = until > 0 ? (long)(until % 1000000000) : 1;
+			if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0) {
+				timer.it_value.tv_nsec = 1;
+			}
+		}
+		timerfd_settime(_timerFd, 0, &timer, nullptr);
+	}
+#endif
+
+	static void put16(unsigned char* out, int value) {
+		out[0] = (unsigned char)(value & 0xFF);
+		out[1] = (unsigned char)((value >> 8) & 0xFF);
+	}
+
+	// Switch sticks are two 12 bit values packed into three bytes
+	static void put_stick(unsigned char* out, int x, int y) {
+		out[0] = (unsigned char)(x & 0xFF);
+		out[1] = (unsigned char)(((x >> 8) & 0x0F) | ((y & 0x0F) << 4));
+		out[2] = (unsigned char)((y >> 4) & 0xFF);
+	}
+
+	// fills in the next report. returns true if it's going to be lost on the way
+	bool make_report(unsigned char* report) {
+		memset(report, 0, 64);
+		const float seconds = (float)(_reportNumber + 1) * std::chrono::duration<float>(_period).count();
+		// turning back and forth at up to 90 degrees per second, held steady against gravity
+		const float turning = 90.0f * sinf(seconds);
+		const bool pressed = ((int)seconds & 1) != 0;
+
+		switch (_settings.type) {
+		case JS_SIMULATE_DS4_USB:
+		case JS_SIMULATE_DS4_BT: {
+			int offset = 0;
+			if (_settings.type == JS_SIMULATE_DS4_BT) {
+				report[0] = 0x11;
+				report[1] = 0xC0;
+				offset = 2;
+			}
+			else {
+				report[0] = 0x01;
+			}
+			report[offset + 1] = report[offset + 2] = report[offset + 3] = report[offset + 4] = 0x80;
+			// hat released, and cross
+			report[offset + 5] = 0x08 | (pressed ? 0x20 : 0x00);
+			report[offset + 7] = (unsigned char)((_reportNumber & 0x3F) << 2);
+			// 16/3 microseconds per tick
+			put16(report + offset + 10, (int)((_reportNumber * 750) & 0xFFFF));
+			put16(report + offset + 13, (int)(turning * 32767.0f / 2000.0f));
+			put16(report + offset + 21, 8192);
+			// no touches
+			report[offset + 35] = 0x80;
+			report[offset + 39] = 0x80;
+			break;
+		}
+		case JS_SIMULATE_DUALSENSE_USB: {
+			const int offset = 1;
+			report[0] = 0x01;
+			report[offset + 0] = report[offset + 1] = report[offset + 2] = report[offset + 3] = 0x80;
+			report[offset + 6] = (unsigned char)_reportNumber;
+			report[offset + 7] = 0x08 | (pressed ? 0x20 : 0x00);
+			put16(report + offset + 15, (int)(turning * 32767.0f / 2000.0f));
+			put16(report + offset + 23, 8192);
+			// 1/3 microseconds per tick
+			const uint32_t timestamp = _reportNumber * 12000;
+			put16(report + offset + 27, (int)(timestamp & 0xFFFF));
+			put16(report + offset + 29, (int)(timestamp >> 16));
+			report[offset + 32] = 0x80;
+			report[offset + 36] = 0x80;
+			break;
+		}
+		default: {
+			report[0] = 0x30;
+			switch_header(report);
+			// b on the right, down on the left
+			if (pressed) {
+				report[3] |= 0x04;
+				report[5] |= 0x01;
+			}
+			// three IMU samples. the Switch's axes don't line up with JoyShock's, so this comes out as gravity along y and turning about x
+			for (int i = 0; i < 3; i++) {
+				unsigned char* sample = report + 13 + i * 12;
+				put16(sample + 4, 4096);
+				put16(sample + 8, (int)(-turning * 32767.0f / 2294.0f));
+			}
+			break;
+		}
+		}
+
+		if (_settings.packetLoss > 0.0f) {
+			std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+			return chance(_random) < _settings.packetLoss;
+		}
+		return false;
+	}
+
+	// timer, battery and connection, no buttons, sticks centred
+	void switch_header(unsigned char* report) {
+		// the timer counts 5ms ticks, which isn't a whole number of reports over USB
+		report[1] = (unsigned char)(_reportNumber * (unsigned long long)_period.count() / 5000);
+		report[2] = 0x8E;
+		put_stick(report + 6, 0x800, 0x800);
+		put_stick(report + 9, 0x800, 0x800);
+	}
+
+	void respond(const unsigned char* data, size_t length) {
+		if (!is_switch() || length < 2) {
+			// PlayStation controllers don't answer anything JoyShock sends them
+			return;
+		}
+		const bool usb = _settings.type == JS_SIMULATE_PRO_CONTROLLER_USB;
+		if (data[0] == 0x80 && data[1] != 0x92) {
+			// USB commands only get an answer over USB. over Bluetooth, that's how JoyShock finds out it isn't USB
+			if (usb) {
+				std::vector<unsigned char> reply(64, 0);
+				reply[0] = 0x81;
+				reply[1] = data[1];
+				_replies.push_back(reply);
+			}
+			return;
+		}
+		// subcommands, possibly wrapped up for USB
+		const unsigned char* command = data;
+		size_t commandLength = length;
+		if (data[0] == 0x80 && data[1] == 0x92) {
+			command += 8;
+			commandLength -= commandLength > 8 ? 8 : commandLength;
+		}
+		if (commandLength < 11 || command[0] != 0x01) {
+			return;
+		}
+		std::vector<unsigned char> reply(64, 0);
+		reply[0] = 0x21;
+		switch_header(reply.data());
+		const unsigned char subcommand = command[10];
+		reply[13] = 0x80;
+		reply[14] = subcommand;
+		if (subcommand == 0x10 && commandLength >= 16) {
+			// SPI flash read. address and size come straight after the subcommand
+			const uint32_t address = command[11] | (command[12] << 8) | (command[13] << 16) | ((uint32_t)command[14] << 24);
+			const int size = command[15];
+			reply[13] = 0x90;
+			memcpy(&reply[15], &command[11], 4);
+			reply[19] = (unsigned char)size;
+			read_flash(address, size, &reply[20]);
+		}
+		_replies.push_back(reply);
+	}
+
+	// just enough of the SPI flash for JoyShock's calibration: neutral sticks and sensors, no user calibration
+	static void read_flash(uint32_t address, int size, unsigned char* out) {
+		unsigned char flash[0x40] = {};
+		if (address == 0x6020) {
+			// accelerometer origin and sensitivity, gyro origin and sensitivity
+			put16(flash + 6, 16384);
+			put16(flash + 8, 16384);
+			put16(flash + 10, 16384);
+			put16(flash + 18, 13371);
+			put16(flash + 20, 13371);
+			put16(flash + 22, 13371);
+		}
+		else if (address == 0x603D) {
+			// left: above centre, centre, below centre. right: centre, below centre, above centre
+			put_stick(flash + 0, 0x600, 0x600);
+			put_stick(flash + 3, 0x800, 0x800);
+			put_stick(flash + 6, 0x600, 0x600);
+			put_stick(flash + 9, 0x800, 0x800);
+			put_stick(flash + 12, 0x600, 0x600);
+			put_stick(flash + 15, 0x600, 0x600);
+		}
+		else if (address == 0x6050) {
+			// body, buttons, grips
+			const unsigned char colours[12] = { 0x32, 0x32, 0x32, 0xFF, 0xFF, 0xFF, 0x0A, 0xB9, 0xE6, 0xFF, 0x3C, 0x28 };
+			memcpy(flash, colours, sizeof(colours));
+		}
+		memcpy(out, flash, size < (int)sizeof(flash) ? size : sizeof(flash));
+	}
+};
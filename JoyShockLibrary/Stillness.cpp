@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cmath>
+
+// Works out whether a controller is sitting still, one IMU sample at a time, for automatic calibration.
+// Still means the gyro and the accelerometer's magnitude have both been steady (low variance) for a little while, with the accelerometer reading about 1g.
+// Then whatever the gyro says is just its bias plus noise, so that's all automatic calibration collects.
+// Means and variances are exponentially weighted with a fixed time constant, so they behave the same at any poll rate.
+class StillnessDetector {
+public:
+	// how long it takes the variances to forget movement, in seconds
+	static constexpr float time_constant = 0.15f;
+	// and how long it has to look still before samples count, so the tail end of a movement doesn't sneak in
+	static constexpr float settle_seconds = 0.25f;
+	// how much still time it takes for the offset to be trusted
+	static constexpr float converged_seconds = 0.5f;
+	// gyro noise (degrees per second, all axes together) and accelerometer noise (g) that still counts as still.
+	// DualShock 4s and Joy-Cons at rest are well under half of these; in hand they're well over
+	static constexpr float max_gyro_deviation = 1.0f;
+	static constexpr float max_accel_deviation = 0.015f;
+	// bias is rarely more than a few degrees per second. anything faster is the controller actually turning, however smoothly
+	static constexpr float max_gyro_speed = 10.0f;
+
+	void reset() {
+		*this = StillnessDetector();
+	}
+
+	// returns true if this sample should go into calibration
+	bool update(float x, float y, float z, float accelMagnitude, float deltaTime) {
+		if (!_started) {
+			_started = true;
+			_gyroMean[0] = x;
+			_gyroMean[1] = y;
+			_gyroMean[2] = z;
+			_accelMean = accelMagnitude;
+			return false;
+		}
+		// a long gap tells us nothing about what happened in between
+		if (deltaTime > 0.1f) {
+			_steadySeconds = 0.0f;
+			deltaTime = 0.1f;
+		}
+		const float alpha = deltaTime / (time_constant + deltaTime);
+		const float gyro[3] = { x, y, z };
+		float gyroDeviation = 0.0f;
+		float gyroSpeed = 0.0f;
+		for (int i = 0; i < 3; i++) {
+			const float difference = gyro[i] - _gyroMean[i];
+			_gyroMean[i] += alpha * difference;
+			gyroDeviation += difference * difference;
+			gyroSpeed += _gyroMean[i] * _gyroMean[i];
+		}
+		_gyroVariance = (1.0f - alpha) * (_gyroVariance + alpha * gyroDeviation);
+		const float accelDifference = accelMagnitude - _accelMean;
+		_accelMean += alpha * accelDifference;
+		_accelVariance = (1.0f - alpha) * (_accelVariance + alpha * accelDifference * accelDifference);
+
+		const bool steady = _gyroVariance < max_gyro_deviation * max_gyro_deviation &&
+			_accelVariance < max_accel_deviation * max_accel_deviation &&
+			gyroSpeed < max_gyro_speed * max_gyro_speed &&
+			fabsf(_accelMean - 1.0f) < 0.1f;
+		if (!steady) {
+			_steadySeconds = 0.0f;
+			return false;
+		}
+		_steadySeconds += deltaTime;
+		if (_steadySeconds < settle_seconds) {
+			return false;
+		}
+		_calibratedSeconds += deltaTime;
+		return true;
+	}
+
+	// pick up with the confidence a saved calibration had
+	void restore(float confidence) {
+		_calibratedSeconds = (confidence < 0.0f ? 0.0f : confidence > 1.0f ? 1.0f : confidence) * converged_seconds;
+	}
+
+	// still right now, and has been for long enough to count
+	bool is_still() const {
+		return _steadySeconds >= settle_seconds;
+	}
+
+	// 0 to 1, how much still time has gone into calibration
+	float confidence() const {
+		return _calibratedSeconds >= converged_seconds ? 1.0f : _calibratedSeconds / converged_seconds;
+	}
+
+private:
+	bool _started = false;
+	float _gyroMean[3] = {};
+	float _gyroVariance = 0.0f;
+	float _accelMean = 0.0f;
+	float _accelVariance = 0.0f;
+	float _steadySeconds = 0.0f;
+	float _calibratedSeconds = 0.0f;
+};
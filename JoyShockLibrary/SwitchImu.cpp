@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "Simd.cpp"
+
+// Decoding the IMU block of a Switch input report: three samples, 5ms apart, each accel then gyro as 6 little-endian int16s starting at packet[13].
+// The samples are averaged, the gyro has its factory calibration taken off, and everything is scaled and turned to JoyShock's axes.
+// There's a scalar version and vectorised ones. Whichever the CPU can run best is picked the first time it's needed.
+// The vectorised ones give exactly the same floats as the scalar one: the sums are exact in integers, and each rounding step is the same operation
+// in the same precision (jsl_bench checks).
+
+// out is accelX, accelY, accelZ, gyroX, gyroY, gyroZ, before any continuous calibration or per-controller axis flips.
+// samples needs to be readable for 48 bytes, which it always is in a 64 byte report. returns false if the first sample is all zero, meaning the IMU's off
+typedef bool (*SwitchImuDecoder)(const uint8_t* samples, const int16_t gyroOrigin[3], float out[6]);
+
+static const double switch_gyro_scale = 2294.0 / 32767.0;
+
+inline bool decode_switch_imu_scalar(const uint8_t* samples, const int16_t gyroOrigin[3], float out[6]) {
+	int16_t values[18];
+	for (int i = 0; i < 18; i++) {
+		values[i] = (int16_t)(samples[i * 2] | (samples[i * 2 + 1] << 8));
+	}
+	// sample order on the wire is z, x, y for accel, and x, y, z for gyro
+	float accelX = 0.0f;
+	float accelY = 0.0f;
+	float accelZ = 0.0f;
+	float totalGyroX = 0.0f;
+	float totalGyroY = 0.0f;
+	float totalGyroZ = 0.0f;
+	for (int i = 0; i < 3; i++) {
+		const int16_t* sample = values + i * 6;
+		accelZ += sample[0];
+		accelX += sample[1];
+		accelY += sample[2];
+		totalGyroX += sample[3] - gyroOrigin[0];
+		totalGyroY += sample[4] - gyroOrigin[1];
+		totalGyroZ += sample[5] - gyroOrigin[2];
+	}
+	accelX /= 3;
+	accelY /= 3;
+	accelZ /= 3;
+	totalGyroX /= 3;
+	totalGyroY /= 3;
+	totalGyroZ /= 3;
+	out[0] = (float)(accelX) / -4096.0;
+	out[1] = (float)(accelY) / 4096.0;
+	out[2] = (float)(accelZ) / -4096.0;
+	out[3] = -(float)(totalGyroY) * switch_gyro_scale;
+	out[4] = (float)(totalGyroZ) * switch_gyro_scale;
+	out[5] = (float)(totalGyroX) * switch_gyro_scale;
+	return (values[0] | values[1] | values[2] | values[3] | values[4] | values[5]) != 0;
+}
+
+// just one of the three samples, scaled and turned the same way. for when they're used one at a time (JoyShock::use_imu_samples)
+inline void decode_switch_imu_sample(const uint8_t* sample, const int16_t gyroOrigin[3], float out[6]) {
+	int16_t values[6];
+	for (int i = 0; i < 6; i++) {
+		values[i] = (int16_t)(sample[i * 2] | (sample[i * 2 + 1] << 8));
+	}
+	out[0] = (float)(values[1]) / -4096.0;
+	out[1] = (float)(values[2]) / 4096.0;
+	out[2] = (float)(values[0]) / -4096.0;
+	out[3] = -(float)(values[4] - gyroOrigin[1]) * switch_gyro_scale;
+	out[4] = (float)(values[5] - gyroOrigin[2]) * switch_gyro_scale;
+	out[5] = (float)(values[3] - gyroOrigin[0]) * switch_gyro_scale;
+}
+
+#if JSL_HAS_SSE2
+// the averages are in two registers: z, x, y accel then x gyro, and y, z gyro
+inline bool finish_switch_imu_sse2(__m128i sums, __m128i gyroSums, __m128i firstSample, const int16_t gyroOrigin[3], float out[6]) {
+	// take the calibration off all three samples at once
+	sums = _mm_sub_epi32(sums, _mm_set_epi32(gyroOrigin[0] * 3, 0, 0, 0));
+	gyroSums = _mm_sub_epi32(gyroSums, _mm_set_epi32(0, 0, gyroOrigin[2] * 3, gyroOrigin[1] * 3));
+	const __m128 three = _mm_set1_ps(3.0f);
+	const __m128 averages = _mm_div_ps(_mm_cvtepi32_ps(sums), three);
+	const __m128 gyroAverages = _mm_div_ps(_mm_cvtepi32_ps(gyroSums), three);
+
+	// accel x, y, z (and gyro x, which gets scaled as a double below) -- scaling by a power of two is exact in floats
+	const __m128 accel = _mm_mul_ps(_mm_shuffle_ps(averages, averages, _MM_SHUFFLE(3, 0, 2, 1)), _mm_set_ps(0.0f, -1.0f / 4096.0f, 1.0f / 4096.0f, -1.0f / 4096.0f));
+	// gyro y, z, then x, in doubles so they're rounded exactly like the scalar version
+	const __m128d scale = _mm_set1_pd(switch_gyro_scale);
+	const __m128d gyroYZ = _mm_mul_pd(_mm_cvtps_pd(gyroAverages), scale);
+	const __m128d gyroX = _mm_mul_pd(_mm_cvtps_pd(_mm_shuffle_ps(averages, averages, _MM_SHUFFLE(3, 3, 3, 3))), scale);
+	// gyro order is -y, z, x
+	const __m128 gyro = _mm_xor_ps(_mm_movelh_ps(_mm_cvtpd_ps(gyroYZ), _mm_cvtpd_ps(gyroX)), _mm_set_ps(0.0f, 0.0f, 0.0f, -0.0f));
+
+	float accelOut[4];
+	float gyroOut[4];
+	_mm_storeu_ps(accelOut, accel);
+	_mm_storeu_ps(gyroOut, gyro);
+	memcpy(out, accelOut, 3 * sizeof(float));
+	memcpy(out + 3, gyroOut, 3 * sizeof(float));
+
+	// the first 6 values of the first sample. the last two lanes belong to the next sample, so they're left out
+	const __m128i zero = _mm_cmpeq_epi16(firstSample, _mm_setzero_si128());
+	return (_mm_movemask_epi8(zero) & 0x0FFF) != 0x0FFF;
+}
+
+inline bool decode_switch_imu_sse2(const uint8_t* samples, const int16_t gyroOrigin[3], float out[6]) {
+	const __m128i first = _mm_loadu_si128((const __m128i*)samples);
+	const __m128i second = _mm_loadu_si128((const __m128i*)(samples + 12));
+	const __m128i third = _mm_loadu_si128((const __m128i*)(samples + 24));
+	// sign extend to 32 bits by putting each value in the top half and shifting back down
+	__m128i sums = _mm_srai_epi32(_mm_unpacklo_epi16(first, first), 16);
+	sums = _mm_add_epi32(sums, _mm_srai_epi32(_mm_unpacklo_epi16(second, second), 16));
+	sums = _mm_add_epi32(sums, _mm_srai_epi32(_mm_unpacklo_epi16(third, third), 16));
+	__m128i gyroSums = _mm_srai_epi32(_mm_unpackhi_epi16(first, first), 16);
+	gyroSums = _mm_add_epi32(gyroSums, _mm_srai_epi32(_mm_unpackhi_epi16(second, second), 16));
+	gyroSums = _mm_add_epi32(gyroSums, _mm_srai_epi32(_mm_unpackhi_epi16(third, third), 16));
+	return finish_switch_imu_sse2(sums, gyroSums, first, gyroOrigin, out);
+}
+
+JSL_TARGET_AVX2 inline bool decode_switch_imu_avx2(const uint8_t* samples, const int16_t gyroOrigin[3], float out[6]) {
+	// each sample sign extends to all 8 lanes at once (the last 2 belong to the next sample, and are ignored)
+	const __m128i first = _mm_loadu_si128((const __m128i*)samples);
+	__m256i sums = _mm256_cvtepi16_epi32(first);
+	sums = _mm256_add_epi32(sums, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(samples + 12))));
+	sums = _mm256_add_epi32(sums, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(samples + 24))));
+	return finish_switch_imu_sse2(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1), first, gyroOrigin, out);
+}
+
+#endif
+
+struct SWITCH_IMU_DECODER_INFO {
+	const char* name;
+	SwitchImuDecoder decode;
+	bool supported; // whether this CPU can run it
+};
+
+// every decoder there is, the scalar reference first
+inline int get_switch_imu_decoders(SWITCH_IMU_DECODER_INFO* decoders) {
+	int count = 0;
+	decoders[count++] = { "scalar", &decode_switch_imu_scalar, true };
+#if JSL_HAS_SSE2
+	decoders[count++] = { "sse2", &decode_switch_imu_sse2, true };
+	decoders[count++] = { "avx2", &decode_switch_imu_avx2, cpu_has_avx2() };
+#endif
+	return count;
+}
+
+// the best decoder this CPU can run
+inline SwitchImuDecoder switch_imu_decoder() {
+	static const SwitchImuDecoder best = []() {
+		SWITCH_IMU_DECODER_INFO decoders[4];
+		const int count = get_switch_imu_decoders(decoders);
+		SwitchImuDecoder chosen = decoders[0].decode;
+		for (int i = 0; i < count; i++) {
+			if (decoders[i].supported) {
+				chosen = decoders[i].decode;
+			}
+		}
+		return chosen;
+	}();
+	return best;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "LockFree.cpp"
+#include "Histogram.cpp"
+
+// Optional tracing of what the polling threads are up to, for lining up stutters with what caused them.
+// Every thread that records anything gets its own ring of the most recent events, so recording never waits on another thread.
+// When tracing is off, recording costs one relaxed load and a branch. Writing a trace turns the rings into Chrome's trace JSON,
+// which chrome://tracing and ui.perfetto.dev both open.
+
+struct TRACE_EVENT {
+	unsigned long long sequence;
+	const char* name; // always a string literal, so we can keep the pointer
+	uint64_t start;
+	uint64_t end; // same as start for instant events
+	int deviceId;
+	bool instant;
+};
+
+class TraceBuffer {
+public:
+	// about 8 seconds of everything from a 250Hz controller
+	static const int size = 8192;
+
+	HistoryRing<TRACE_EVENT, size> events;
+	// events up to here were recorded before tracing was last turned on
+	std::atomic<uint64_t> cleared;
+	// which thread's events these are. buffers left behind by finished threads get reused, so this can change
+	std::atomic<int> thread;
+	std::atomic<bool> in_use;
+	char thread_name[64];
+
+	TraceBuffer() : cleared(0), thread(0), in_use(true) {
+		thread_name[0] = 0;
+	}
+
+	static void* operator new(size_t size) {
+		void* p = jsl_aligned_alloc(size);
+		if (p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	static void operator delete(void* p) {
+		jsl_aligned_free(p);
+	}
+};
+
+class Trace {
+public:
+	static bool enabled() {
+		return _enabled().load(std::memory_order_relaxed);
+	}
+
+	static void set_enabled(bool enable) {
+		std::lock_guard<std::mutex> guard(_buffersLock());
+		if (enable && !enabled()) {
+			// start afresh
+			for (TraceBuffer* buffer : _buffers()) {
+				buffer->cleared.store(buffer->events.head(), std::memory_order_relaxed);
+			}
+		}
+		_enabled().store(enable);
+	}
+
+	// something that took from start to end (in TickClock ticks)
+	static void complete(const char* name, int deviceId, uint64_t start, uint64_t end) {
+		if (!enabled()) {
+			return;
+		}
+		TRACE_EVENT event;
+		event.name = name;
+		event.start = start;
+		event.end = end;
+		event.deviceId = deviceId;
+		event.instant = false;
+		buffer()->events.push(event);
+	}
+
+	static void instant(const char* name, int deviceId) {
+		if (!enabled()) {
+			return;
+		}
+		TRACE_EVENT event;
+		event.name = name;
+		event.start = event.end = TickClock::now();
+		event.deviceId = deviceId;
+		event.instant = true;
+		buffer()->events.push(event);
+	}
+
+	// names the calling thread in traces. cheap enough to call whether or not tracing is on
+	static void name_thread(const char* name) {
+		ThreadBuffer& threadBuffer = thread_buffer();
+		snprintf(threadBuffer.name, sizeof(threadBuffer.name), "%s", name);
+		if (threadBuffer.buffer != nullptr) {
+			std::lock_guard<std::mutex> guard(_buffersLock());
+			snprintf(threadBuffer.buffer->thread_name, sizeof(threadBuffer.buffer->thread_name), "%s", name);
+		}
+	}
+
+	// returns how many events were written, or -1 if the file couldn't be written
+	static int write(const char* path) {
+		FILE* file = fopen(path, "w");
+		if (file == nullptr) {
+			return -1;
+		}
+		std::lock_guard<std::mutex> guard(_buffersLock());
+		const double microsecondsPerTick = TickClock::microseconds_per_tick();
+		std::vector<TRACE_EVENT> events(TraceBuffer::size);
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"JoyShockLibrary\"}}");
+		int written = 0;
+		for (TraceBuffer* buffer : _buffers()) {
+			const int tid = buffer->thread.load();
+			if (buffer->thread_name[0] != 0) {
+				fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tid, buffer->thread_name);
+			}
+			const int count = buffer->events.read_since(buffer->cleared.load(), events.data(), TraceBuffer::size);
+			for (int i = 0; i < count; i++) {
+				const TRACE_EVENT& event = events[i];
+				const double start = event.start * microsecondsPerTick;
+				if (event.instant) {
+					fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"device\":%d}}",
+						event.name, tid, start, event.deviceId);
+				}
+				else {
+					fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"device\":%d}}",
+						event.name, tid, start, (event.end - event.start) * microsecondsPerTick, event.deviceId);
+				}
+				written++;
+			}
+		}
+		fprintf(file, "\n]}\n");
+		const bool ok = ferror(file) == 0;
+		fclose(file);
+		return ok ? written : -1;
+	}
+
+private:
+	static const int max_buffers = 32;
+
+	// hands the buffer back for another thread to use when this thread finishes
+	struct ThreadBuffer {
+		TraceBuffer* buffer = nullptr;
+		char name[64] = {};
+		~ThreadBuffer() {
+			if (buffer != nullptr) {
+				buffer->in_use.store(false);
+			}
+		}
+	};
+
+	static ThreadBuffer& thread_buffer() {
+		static thread_local ThreadBuffer threadBuffer;
+		return threadBuffer;
+	}
+
+	static TraceBuffer* buffer() {
+		ThreadBuffer& threadBuffer = thread_buffer();
+		if (threadBuffer.buffer == nullptr) {
+			threadBuffer.buffer = claim_buffer(threadBuffer.name);
+		}
+		return threadBuffer.buffer;
+	}
+
+	// only happens the first time a thread records anything
+	static TraceBuffer* claim_buffer(const char* name) {
+		std::lock_guard<std::mutex> guard(_buffersLock());
+		static int nextThread = 1;
+		TraceBuffer* claimed = nullptr;
+		// keep finished threads' events around for as long as we reasonably can. only once there are lots of buffers do we start reusing them
+		if ((int)_buffers().size() >= max_buffers) {
+			for (TraceBuffer* buffer : _buffers()) {
+				if (!buffer->in_use.load()) {
+					claimed = buffer;
+					break;
+				}
+			}
+		}
+		if (claimed == nullptr) {
+			claimed = new TraceBuffer();
+			_buffers().push_back(claimed);
+		}
+		// the old thread's events aren't this thread's, so don't write them out under its name
+		claimed->cleared.store(claimed->events.head(), std::memory_order_relaxed);
+		claimed->thread.store(nextThread++);
+		snprintf(claimed->thread_name, sizeof(claimed->thread_name), "%s", name);
+		claimed->in_use.store(true);
+		return claimed;
+	}
+
+	// function statics, so that they're ready whenever the first thread wants them
+	static std::atomic<bool>& _enabled() {
+		static std::atomic<bool> enabled(false);
+		return enabled;
+	}
+
+	static std::mutex& _buffersLock() {
+		static std::mutex lock;
+		return lock;
+	}
+
+	// buffers are never freed, so a trace can include threads that have already finished
+	static std::vector<TraceBuffer*>& _buffers() {
+		static std::vector<TraceBuffer*> buffers;
+		return buffers;
+	}
+};
+
+// traces whatever happens between construction and going out of scope
+class TraceScope {
+public:
+	TraceScope(const char* name, int deviceId) : _name(name), _deviceId(deviceId), _start(Trace::enabled() ? TickClock::now() : 0) {}
+
+	~TraceScope() {
+		if (_start != 0) {
+			Trace::complete(_name, _deviceId, _start, TickClock::now());
+		}
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* _name;
+	int _deviceId;
+	uint64_t _start;
+};
@@ -0,0 +1,401 @@
+#pragma once
+
+#include "hidapi.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// How a JoyShock talks to its controller. Normally that's hidapi, but it can also be a recording of a controller played back,
+// so that parsing, fusion and callbacks can be exercised (and benchmarked) without any controllers attached.
+// Reads and writes behave like hidapi's: a read returns the report length, 0 if there was nothing to read in time, or -1 if the device is gone.
+class Transport {
+public:
+	virtual ~Transport() {}
+
+	virtual bool is_open() const = 0;
+	virtual int write(const unsigned char* data, size_t length) = 0;
+	// waits up to milliseconds for a report. -1 waits forever
+	virtual int read_timeout(unsigned char* data, size_t length, int milliseconds) = 0;
+	// waits for a report unless set_nonblocking(1) was called
+	virtual int read(unsigned char* data, size_t length) = 0;
+	virtual int set_nonblocking(int nonblock) = 0;
+
+	// For waiting on lots of devices at once (see Reactor): a file descriptor that's readable whenever read_ready has something.
+	// Returns -1 if there isn't one, in which case the device needs a thread of its own.
+	virtual int open_poll_fd() {
+		return -1;
+	}
+
+	virtual void close_poll_fd() {}
+
+	// a report that's already waiting on the poll fd. never blocks. 0 if there's nothing waiting
+	virtual int read_ready(unsigned char*, size_t) {
+		return -1;
+	}
+
+	// throw away any reports waiting to be read
+	virtual void drain() {
+		unsigned char buf[64];
+		set_nonblocking(1);
+		for (int i = 0; i < 256 && read(buf, 64) > 0; i++) {}
+		set_nonblocking(0);
+	}
+};
+
+class HidTransport : public Transport {
+public:
+	explicit HidTransport(const char* path) : _path(path), _handle(hid_open_path(path)) {}
+
+	~HidTransport() override {
+		close_poll_fd();
+		if (_handle != nullptr) {
+			hid_close(_handle);
+		}
+	}
+
+	bool is_open() const override {
+		return _handle != nullptr;
+	}
+
+	int write(const unsigned char* data, size_t length) override {
+		return _handle != nullptr ? hid_write(_handle, data, length) : -1;
+	}
+
+	int read_timeout(unsigned char* data, size_t length, int milliseconds) override {
+		return _handle != nullptr ? hid_read_timeout(_handle, data, length, milliseconds) : -1;
+	}
+
+	int read(unsigned char* data, size_t length) override {
+		return _handle != nullptr ? hid_read(_handle, data, length) : -1;
+	}
+
+	int set_nonblocking(int nonblock) override {
+		return _handle != nullptr ? hid_set_nonblocking(_handle, nonblock) : -1;
+	}
+
+	// hidapi doesn't give us a file descriptor to wait on. on Linux it talks to hidraw nodes, so we open our own.
+	// the kernel gives every open handle its own copy of each report, so drain() hidapi's handle before going back to reading through it
+	int open_poll_fd() override {
+#ifdef __linux__
+		if (_pollFd < 0) {
+			_pollFd = open(_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		}
+		return _pollFd;
+#else
+		return -1;
+#endif
+	}
+
+	void close_poll_fd() override {
+#ifdef __linux__
+		if (_pollFd >= 0) {
+			close(_pollFd);
+			_pollFd = -1;
+		}
+#endif
+	}
+
+	int read_ready(unsigned char* data, size_t length) override {
+#ifdef __linux__
+		int res = (int)::read(_pollFd, data, length);
+		if (res < 0) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		}
+		return res;
+#else
+		return -1;
+#endif
+	}
+
+private:
+	std::string _path;
+	hid_device* _handle;
+	int _pollFd = -1;
+};
+
+// What's at the start of a recording: enough about the device to treat it the same way when it's played back.
+// Then come the records, each one a kind byte, the time since the previous record in microseconds, and (for reads and writes) the data.
+// The times and lengths are stored 7 bits at a time, lowest first, with the top bit set on all but the last byte.
+struct RECORDING_HEADER {
+	unsigned short vendorId;
+	unsigned short productId;
+	int interfaceNumber;
+	std::string serial;
+};
+
+class Recording {
+public:
+	enum RecordKind {
+		record_read = 0, // data is the report read. empty means the read timed out
+		record_write = 1,
+		record_read_failed = 2,
+	};
+
+	static const int version = 1;
+
+	static void write_varint(std::vector<unsigned char>& out, unsigned long long value) {
+		while (value >= 0x80) {
+			out.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((unsigned char)value);
+	}
+
+	// returns false if we ran out of data
+	static bool read_varint(const std::vector<unsigned char>& in, size_t& position, unsigned long long& value) {
+		value = 0;
+		for (int shift = 0; shift < 64 && position < in.size(); shift += 7) {
+			const unsigned char byte = in[position++];
+			value |= (unsigned long long)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Passes everything through to another transport, and writes down what came back (and what was sent) with when it happened.
+class RecordingTransport : public Transport {
+public:
+	// takes ownership of inner. check is_recording() to see if the file could be created
+	RecordingTransport(Transport* inner, const char* path, const RECORDING_HEADER& header)
+		: _inner(inner), _file(fopen(path, "wb")), _last(std::chrono::steady_clock::now())
+	{
+		if (_file == nullptr) {
+			return;
+		}
+		std::vector<unsigned char> out;
+		const char magic[] = { 'J', 'S', 'L', 'R' };
+		out.insert(out.end(), magic, magic + 4);
+		Recording::write_varint(out, Recording::version);
+		Recording::write_varint(out, header.vendorId);
+		Recording::write_varint(out, header.productId);
+		// interface numbers can be -1
+		Recording::write_varint(out, (unsigned long long)(header.interfaceNumber + 1));
+		Recording::write_varint(out, header.serial.size());
+		out.insert(out.end(), header.serial.begin(), header.serial.end());
+		fwrite(out.data(), 1, out.size(), _file);
+	}
+
+	~RecordingTransport() override {
+		if (_file != nullptr) {
+			fclose(_file);
+		}
+		delete _inner;
+	}
+
+	bool is_recording() const {
+		return _file != nullptr;
+	}
+
+	bool is_open() const override {
+		return _inner->is_open();
+	}
+
+	int write(const unsigned char* data, size_t length) override {
+		const int res = _inner->write(data, length);
+		record(Recording::record_write, data, length);
+		return res;
+	}
+
+	int read_timeout(unsigned char* data, size_t length, int milliseconds) override {
+		return record_read(data, _inner->read_timeout(data, length, milliseconds));
+	}
+
+	int read(unsigned char* data, size_t length) override {
+		return record_read(data, _inner->read(data, length));
+	}
+
+	int set_nonblocking(int nonblock) override {
+		return _inner->set_nonblocking(nonblock);
+	}
+
+	int open_poll_fd() override {
+		return _inner->open_poll_fd();
+	}
+
+	void close_poll_fd() override {
+		_inner->close_poll_fd();
+	}
+
+	int read_ready(unsigned char* data, size_t length) override {
+		const int res = _inner->read_ready(data, length);
+		// nothing waiting isn't worth writing down -- the reactor only asks when something is
+		if (res != 0) {
+			record_read(data, res);
+		}
+		return res;
+	}
+
+private:
+	Transport* _inner;
+	FILE* _file;
+	std::chrono::steady_clock::time_point _last;
+	// writes can come from any thread (setting lights, say), while reads come from the polling thread
+	std::mutex _lock;
+
+	int record_read(const unsigned char* data, int res) {
+		if (res < 0) {
+			record(Recording::record_read_failed, nullptr, 0);
+		}
+		else {
+			record(Recording::record_read, data, res);
+		}
+		return res;
+	}
+
+	void record(Recording::RecordKind kind, const unsigned char* data, size_t length) {
+		if (_file == nullptr) {
+			return;
+		}
+		std::lock_guard<std::mutex> guard(_lock);
+		const auto now = std::chrono::steady_clock::now();
+		std::vector<unsigned char> out;
+		out.push_back((unsigned char)kind);
+		Recording::write_varint(out, std::chrono::duration_cast<std::chrono::microseconds>(now - _last).count());
+		_last = now;
+		if (kind != Recording::record_read_failed) {
+			Recording::write_varint(out, length);
+			out.insert(out.end(), data, data + length);
+		}
+		fwrite(out.data(), 1, out.size(), _file);
+	}
+};
+
+// Plays a recording back. Every read gets whatever the next recorded read got, whichever kind of read it is, so as long as the same code
+// asks for the same things, it sees the same thing the original did. Writes go nowhere.
+// In real time, reads wait until as long after the first read as they originally happened. Otherwise they return straight away.
+// Once the recording runs out, the device is gone.
+class ReplayTransport : public Transport {
+public:
+	ReplayTransport(const char* path, bool realTime) : _realTime(realTime) {
+		FILE* file = fopen(path, "rb");
+		if (file == nullptr) {
+			return;
+		}
+		unsigned char chunk[4096];
+		size_t read;
+		while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+			_data.insert(_data.end(), chunk, chunk + read);
+		}
+		fclose(file);
+		_valid = parse_header();
+	}
+
+	bool is_valid() const {
+		return _valid;
+	}
+
+	const RECORDING_HEADER& header() const {
+		return _header;
+	}
+
+	bool is_open() const override {
+		return _valid;
+	}
+
+	int write(const unsigned char*, size_t length) override {
+		return _valid ? (int)length : -1;
+	}
+
+	int read_timeout(unsigned char* data, size_t length, int) override {
+		return next_read(data, length);
+	}
+
+	int read(unsigned char* data, size_t length) override {
+		return next_read(data, length);
+	}
+
+	int set_nonblocking(int) override {
+		return _valid ? 0 : -1;
+	}
+
+private:
+	bool _realTime;
+	bool _valid = false;
+	RECORDING_HEADER _header;
+	std::vector<unsigned char> _data;
+	size_t _position = 0;
+	// when the next record happened, relative to the first one
+	unsigned long long _recordTime = 0;
+	bool _started = false;
+	std::chrono::steady_clock::time_point _start;
+
+	bool parse_header() {
+		if (_data.size() < 4 || memcmp(_data.data(), "JSLR", 4) != 0) {
+			return false;
+		}
+		_position = 4;
+		unsigned long long version, vendorId, productId, interfaceNumber, serialLength;
+		if (!Recording::read_varint(_data, _position, version) || version != Recording::version ||
+			!Recording::read_varint(_data, _position, vendorId) ||
+			!Recording::read_varint(_data, _position, productId) ||
+			!Recording::read_varint(_data, _position, interfaceNumber) ||
+			!Recording::read_varint(_data, _position, serialLength) ||
+			_position + serialLength > _data.size()) {
+			return false;
+		}
+		_header.vendorId = (unsigned short)vendorId;
+		_header.productId = (unsigned short)productId;
+		_header.interfaceNumber = (int)interfaceNumber - 1;
+		_header.serial.assign((const char*)_data.data() + _position, serialLength);
+		_position += serialLength;
+		return true;
+	}
+
+	int next_read(unsigned char* data, size_t length) {
+		if (!_valid) {
+			return -1;
+		}
+		while (_position < _data.size()) {
+			const unsigned char kind = _data[_position++];
+			unsigned long long delta, recordLength = 0;
+			if (!Recording::read_varint(_data, _position, delta)) {
+				break;
+			}
+			if (kind != Recording::record_read_failed &&
+				(!Recording::read_varint(_data, _position, recordLength) || _position + recordLength > _data.size())) {
+				break;
+			}
+			const unsigned char* record = _data.data() + _position;
+			_position += recordLength;
+			// the time before the first read is just how long connecting took
+			_recordTime = _started ? _recordTime + delta : 0;
+			if (kind == Recording::record_write) {
+				continue;
+			}
+			wait_until_due();
+			if (kind == Recording::record_read_failed) {
+				return -1;
+			}
+			const size_t copied = recordLength < length ? (size_t)recordLength : length;
+			memcpy(data, record, copied);
+			return (int)copied;
+		}
+		// that's the end of the recording
+		_valid = false;
+		return -1;
+	}
+
+	void wait_until_due() {
+		if (!_started) {
+			_started = true;
+			_start = std::chrono::steady_clock::now();
+			return;
+		}
+		if (_realTime) {
+			std::this_thread::sleep_until(_start + std::chrono::microseconds(_recordTime));
+		}
+	}
+};
@@ -0,0 +1,1070 @@
+// Bench.cpp : microbenchmarks for the work JoyShockLibrary does on every report -- decoding, calibration, sensor fusion -- and for the getters.
+// Reports are synthetic, from the simulated controllers, or played back from recordings made with JslSetRecordingDirectory.
+// Nothing is polled: every benchmark runs on this thread, so results only measure the work itself.
+// Specialised report parsers are checked against handle_input, SIMD Switch IMU decoders against the scalar one, sensor fusion's gravity window against looking at every sample, batched sensor fusion against Motion::Update, and continuous calibration against
+// the way it used to work it out, before anything's timed.
+// Each benchmark is run a few times and the median is reported, as nanoseconds per operation and operations per second.
+// Sensor fusion algorithms also report how far from the truth they are on a synthetic trace, and from the accelerometer while the controller's still on recordings.
+//
+// usage: jsl_bench [--json results.json] [--replay recording.jslrec]... [--filter text] [--operations n] [--repetitions n]
+
+#include "../JoyShockLibrary.cpp"
+#include "MotionBatch.cpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct BenchResult {
+	std::string name;
+	const char* unit; // what one operation is
+	int operations;
+	double nsPerOperation; // median of the repetitions
+	double minNsPerOperation;
+	double tiltError = -1.0; // for sensor fusion, average degrees from which way up really is. negative if it doesn't apply
+};
+
+static std::vector<BenchResult> _results;
+static std::string _filter;
+static int _operations = 200000;
+static int _repetitions = 7;
+
+// whatever the benchmarks compute goes here, so it can't be optimised away
+static volatile float _sink;
+
+template <typename Operation>
+static void RunBenchmark(const std::string& name, const char* unit, Operation operation) {
+	if (!_filter.empty() && name.find(_filter) == std::string::npos) {
+		return;
+	}
+	for (int i = 0; i < _operations / 10; i++) {
+		operation(i);
+	}
+	std::vector<double> runs;
+	for (int r = 0; r < _repetitions; r++) {
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < _operations; i++) {
+			operation(i);
+		}
+		const auto end = std::chrono::steady_clock::now();
+		runs.push_back(std::chrono::duration<double, std::nano>(end - start).count() / _operations);
+	}
+	std::sort(runs.begin(), runs.end());
+	BenchResult result;
+	result.name = name;
+	result.unit = unit;
+	result.operations = _operations;
+	result.nsPerOperation = runs[runs.size() / 2];
+	result.minNsPerOperation = runs[0];
+	printf("%-44s %10.1f ns/%-7s %14.0f %ss/s\n", name.c_str(), result.nsPerOperation, unit, 1e9 / result.nsPerOperation, unit);
+	fflush(stdout);
+	_results.push_back(result);
+}
+
+static bool WriteJson(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) {
+		return false;
+	}
+	fprintf(file, "{\"repetitions\":%d,\"benchmarks\":[", _repetitions);
+	for (size_t i = 0; i < _results.size(); i++) {
+		const BenchResult& result = _results[i];
+		std::string name;
+		for (char c : result.name) {
+			if (c == '"' || c == '\\') {
+				name.push_back('\\');
+			}
+			name.push_back(c);
+		}
+		fprintf(file, "%s\n{\"name\":\"%s\",\"unit\":\"%s\",\"operations\":%d,\"ns_per_op\":%.3f,\"min_ns_per_op\":%.3f,\"ops_per_second\":%.1f",
+			i == 0 ? "" : ",", name.c_str(), result.unit, result.operations, result.nsPerOperation, result.minNsPerOperation, 1e9 / result.nsPerOperation);
+		if (result.tiltError >= 0.0) {
+			fprintf(file, ",\"tilt_error_degrees\":%.4f", result.tiltError);
+		}
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n]}\n");
+	const bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+
+// a device that's been through the same handshake as a connected one, but isn't being polled
+struct BenchDevice {
+	std::string name;
+	JoyShock* jc;
+	std::vector<std::vector<unsigned char>> reports;
+};
+
+static JoyShock* AddBenchDevice(struct hid_device_info& dev, Transport* transport) {
+	std::lock_guard<std::mutex> guard(_joyshocksWriteLock);
+	JoyShock* jc = AddJoyShock(&dev, transport);
+	if (jc != nullptr) {
+		InitJoyShock(jc);
+	}
+	return jc;
+}
+
+// rewrite a report as another kind of report from the same controller
+typedef void (*ReportConversion)(unsigned char* report);
+
+static void ToSwitchSubcommandReply(unsigned char* report) {
+	// same header as a 0x30, followed by a reply that isn't IMU data
+	report[0] = 0x21;
+	report[13] = 0x80;
+	report[14] = 0x48;
+	memset(report + 15, 0, 64 - 15);
+}
+
+static void ToSwitchSimpleReport(unsigned char* report) {
+	// the simple HID report Switch controllers send before they're told to send 0x30s: buttons, hat, and 16 bit sticks
+	unsigned char simple[64] = {};
+	simple[0] = 0x3F;
+	simple[1] = report[3];
+	simple[2] = report[4];
+	simple[3] = 0x08;
+	for (int i = 4; i < 12; i += 2) {
+		simple[i] = 0x00;
+		simple[i + 1] = 0x80;
+	}
+	memcpy(report, simple, 64);
+}
+
+static BenchDevice SimulatedDevice(const char* name, int type, int numReports, ReportConversion conversion = nullptr) {
+	SIMULATED_DEVICE_SETTINGS settings = {};
+	settings.type = type;
+	SimulatedTransport* transport = new SimulatedTransport(settings, 1);
+	struct hid_device_info dev = {};
+	SimulatedTransport::describe(type, dev);
+	std::string path = std::string("bench:") + name;
+	wchar_t serial[] = L"bench";
+	dev.path = (char*)path.c_str();
+	dev.serial_number = serial;
+	BenchDevice device;
+	device.name = name;
+	device.jc = AddBenchDevice(dev, transport);
+	for (int i = 0; i < numReports; i++) {
+		std::vector<unsigned char> report(64);
+		transport->generate(report.data(), report.size());
+		if (conversion != nullptr) {
+			conversion(report.data());
+		}
+		device.reports.push_back(report);
+	}
+	return device;
+}
+
+// the device is connected with the recording's own handshake, then everything after that is benchmarked
+static bool ReplayedDevice(const char* path, BenchDevice& device) {
+	ReplayTransport* transport = new ReplayTransport(path, false);
+	if (!transport->is_valid()) {
+		delete transport;
+		return false;
+	}
+	const RECORDING_HEADER header = transport->header();
+	std::wstring serial(header.serial.begin(), header.serial.end());
+	struct hid_device_info dev = {};
+	dev.path = (char*)path;
+	dev.vendor_id = header.vendorId;
+	dev.product_id = header.productId;
+	dev.interface_number = header.interfaceNumber;
+	dev.serial_number = (wchar_t*)serial.c_str();
+	device.name = std::string("replay:") + path;
+	device.jc = AddBenchDevice(dev, transport);
+	if (device.jc == nullptr) {
+		return false;
+	}
+	unsigned char buf[64];
+	int res;
+	while ((res = transport->read(buf, sizeof(buf))) >= 0) {
+		if (res > 0) {
+			device.reports.push_back(std::vector<unsigned char>(buf, buf + sizeof(buf)));
+		}
+	}
+	return !device.reports.empty();
+}
+
+static bool SameTouches(const TOUCH_STATE& a, const TOUCH_STATE& b) {
+	return a.t0Id == b.t0Id && a.t1Id == b.t1Id && a.t0Down == b.t0Down && a.t1Down == b.t1Down &&
+		a.t0X == b.t0X && a.t0Y == b.t0Y && a.t1X == b.t1X && a.t1Y == b.t1Y;
+}
+
+// the specialised parser has to make exactly what handle_input makes of every report, or its timings don't mean anything
+static bool CheckParser(const BenchDevice& device) {
+	JoyShock* jc = device.jc;
+	if (jc == nullptr || jc->parse_report == nullptr) {
+		return true;
+	}
+	unsigned char buf[64];
+	for (size_t i = 0; i < device.reports.size(); i++) {
+		const std::vector<unsigned char>& report = device.reports[i];
+		const int len = (int)report.size();
+		bool referenceIMU;
+		memcpy(buf, report.data(), len);
+		jc->num_imu_samples = 0;
+		const bool referenceHandled = handle_input(jc, buf, len, referenceIMU);
+		const JOY_SHOCK_STATE referenceState = jc->simple_state;
+		const IMU_STATE referenceIMUState = jc->imu_state;
+		const TOUCH_STATE referenceTouches = jc->touch_state;
+		const int referenceNumSamples = jc->num_imu_samples;
+		IMU_STATE referenceSamples[3];
+		memcpy(referenceSamples, jc->imu_samples, sizeof(referenceSamples));
+		bool hasIMU;
+		memcpy(buf, report.data(), len);
+		jc->num_imu_samples = 0;
+		const bool handled = jc->parse_report(jc, buf, len, hasIMU);
+		if (handled != referenceHandled || hasIMU != referenceIMU ||
+			memcmp(&jc->simple_state, &referenceState, sizeof(referenceState)) != 0 ||
+			memcmp(&jc->imu_state, &referenceIMUState, sizeof(referenceIMUState)) != 0 ||
+			!SameTouches(jc->touch_state, referenceTouches) ||
+			jc->num_imu_samples != referenceNumSamples ||
+			memcmp(jc->imu_samples, referenceSamples, referenceNumSamples * sizeof(IMU_STATE)) != 0) {
+			printf("parse_report doesn't match handle_input for report %d of %s\n", (int)i, device.name.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// every IMU decoder the CPU can run has to give exactly the floats the scalar one gives, bit for bit.
+// blocks come from the Switch reports, and from random noise with random calibration to get at the extremes
+static bool CheckSwitchImuDecoders(const std::vector<BenchDevice>& devices) {
+	struct ImuBlock {
+		unsigned char samples[64];
+		int16_t origin[3];
+	};
+	std::vector<ImuBlock> blocks;
+	for (const BenchDevice& device : devices) {
+		if (device.jc == nullptr || device.jc->controller_type != ControllerType::n_switch) {
+			continue;
+		}
+		for (const std::vector<unsigned char>& report : device.reports) {
+			if (report.size() < 49) {
+				continue;
+			}
+			ImuBlock block = {};
+			memcpy(block.samples, report.data() + 13, std::min<size_t>(report.size() - 13, sizeof(block.samples)));
+			memcpy(block.origin, device.jc->sensor_cal[1], sizeof(block.origin));
+			blocks.push_back(block);
+		}
+	}
+	uint32_t random = 12345;
+	for (int i = 0; i < 100000; i++) {
+		ImuBlock block = {};
+		for (int b = 0; b < 36; b++) {
+			random = random * 1664525u + 1013904223u;
+			block.samples[b] = (unsigned char)(random >> 24);
+		}
+		for (int k = 0; k < 3; k++) {
+			random = random * 1664525u + 1013904223u;
+			block.origin[k] = (int16_t)(random >> 16);
+		}
+		if (i % 16 == 0) {
+			// first sample all zero
+			memset(block.samples, 0, 12);
+		}
+		blocks.push_back(block);
+	}
+
+	SWITCH_IMU_DECODER_INFO decoders[4];
+	const int numDecoders = get_switch_imu_decoders(decoders);
+	for (int d = 1; d < numDecoders; d++) {
+		if (!decoders[d].supported) {
+			continue;
+		}
+		for (size_t i = 0; i < blocks.size(); i++) {
+			float reference[6];
+			float out[6];
+			const bool referenceIMU = decoders[0].decode(blocks[i].samples, blocks[i].origin, reference);
+			const bool hasIMU = decoders[d].decode(blocks[i].samples, blocks[i].origin, out);
+			if (hasIMU != referenceIMU || memcmp(reference, out, sizeof(out)) != 0) {
+				printf("%s Switch IMU decoder doesn't match the scalar one for block %d\n", decoders[d].name, (int)i);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void BenchmarkSwitchImu(const BenchDevice& device) {
+	if (device.jc == nullptr || device.reports.empty()) {
+		return;
+	}
+	const int numReports = (int)device.reports.size();
+	const int16_t* origin = device.jc->sensor_cal[1];
+	SWITCH_IMU_DECODER_INFO decoders[4];
+	const int numDecoders = get_switch_imu_decoders(decoders);
+	for (int d = 0; d < numDecoders; d++) {
+		if (!decoders[d].supported) {
+			continue;
+		}
+		const SwitchImuDecoder decode = decoders[d].decode;
+		RunBenchmark(std::string("switch_imu/") + decoders[d].name, "packet", [&](int i) {
+			float out[6];
+			decode(device.reports[i % numReports].data() + 13, origin, out);
+			_sink = out[3];
+		});
+	}
+}
+
+// continuous calibration's average, worked out the way it used to be: a walk over every window for every sample
+static bool ReferenceAverageGyro(JoyShock* jc, float average[4]) {
+	float weight = 0.0f;
+	float total[4] = {};
+	int samplesWanted = jc->get_gyro_average_window_total_samples_for_device();
+	const float samplesPerWindow = (float)(jc->get_gyro_average_window_single_samples_for_device());
+	for (int i = 0; i < JoyShock::num_gyro_average_windows && samplesWanted > 0; i++) {
+		const GYRO_AVERAGE_WINDOW& window = jc->gyro_average_window[(i + jc->gyro_average_window_front_index) % JoyShock::num_gyro_average_windows];
+		if (window.numSamples == 0) {
+			continue;
+		}
+		float thisWeight;
+		const float numSamples = (float)(window.numSamples);
+		if (samplesWanted < window.numSamples) {
+			thisWeight = (float)(samplesWanted) / window.numSamples;
+			samplesWanted = 0;
+		}
+		else {
+			thisWeight = numSamples / samplesPerWindow;
+			samplesWanted -= window.numSamples;
+		}
+		total[0] += (window.x / numSamples) * thisWeight;
+		total[1] += (window.y / numSamples) * thisWeight;
+		total[2] += (window.z / numSamples) * thisWeight;
+		total[3] += (window.accelMagnitude / numSamples) * thisWeight;
+		weight += thisWeight;
+	}
+	if (weight <= 0.0f) {
+		return false;
+	}
+	for (int k = 0; k < 4; k++) {
+		average[k] = total[k] / weight;
+	}
+	return true;
+}
+
+// in degrees. from the distance between them rather than acos of their dot product, which can't tell small angles apart
+static double AngleBetween(const MOTION_STATE& a, const MOTION_STATE& b) {
+	const double dot = (double)a.quatW * b.quatW + (double)a.quatX * b.quatX + (double)a.quatY * b.quatY + (double)a.quatZ * b.quatZ;
+	const double sign = dot < 0.0 ? -1.0 : 1.0;
+	const double w = a.quatW - sign * b.quatW;
+	const double x = a.quatX - sign * b.quatX;
+	const double y = a.quatY - sign * b.quatY;
+	const double z = a.quatZ - sign * b.quatZ;
+	const double halfDistance = sqrt(w * w + x * x + y * y + z * z) * 0.5;
+	return 4.0 * asin(halfDistance < 1.0 ? halfDistance : 1.0) * 180.0 / M_PI;
+}
+
+// the running totals have to give the same average as walking every window, give or take float rounding
+static bool MatchesReferenceAverage(JoyShock* jc, const float average[4]) {
+	float reference[4];
+	const bool hasReference = ReferenceAverageGyro(jc, reference);
+	if (hasReference != jc->has_gyro_average) {
+		return false;
+	}
+	for (int k = 0; k < 4 && hasReference; k++) {
+		if (fabsf(average[k] - reference[k]) > 1e-4f * (1.0f + fabsf(reference[k]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// short windows so they fill up and move on a lot, and changes of length part way through so they're not all the same size.
+// samples go through calibrate() and window changes through set_calibration_window(), the way the polling thread sees them.
+// a change of length has to change the average straight away, before there are any more samples
+static bool CheckCalibration(JoyShock* jc) {
+	const float windowSeconds = jc->requested_calibration_window_seconds.load();
+	const bool useContinuousCalibration = jc->use_continuous_calibration;
+	const float offsets[4] = { jc->offset_x, jc->offset_y, jc->offset_z, jc->accel_magnitude };
+	jc->set_calibration_window(3.0f);
+	jc->use_continuous_calibration = true;
+	jc->reset_continuous_calibration();
+	bool matches = true;
+	for (int i = 0; i < 20000 && matches; i++) {
+		if (i == 8000 || i == 12000) {
+			jc->set_calibration_window(i == 8000 ? 1.0f : 4.5f);
+			jc->apply_calibration_window();
+			float average[4] = {};
+			jc->get_average_gyro(average[0], average[1], average[2], average[3]);
+			if (!MatchesReferenceAverage(jc, average)) {
+				printf("Continuous calibration doesn't match the reference after the window changed at %d samples\n", i);
+				matches = false;
+				break;
+			}
+		}
+		const float wobble = (float)((i * 7919) % 101) * 0.01f;
+		jc->calibrate(0.5f + wobble, -0.25f * wobble, 3.0f - wobble, 1.0f + wobble * 0.1f, 0.004f);
+		const float average[4] = { jc->offset_x, jc->offset_y, jc->offset_z, jc->accel_magnitude };
+		if (!MatchesReferenceAverage(jc, average)) {
+			printf("Continuous calibration doesn't match the reference after %d samples\n", i + 1);
+			matches = false;
+		}
+	}
+	jc->set_calibration_window(windowSeconds);
+	jc->apply_calibration_window();
+	jc->use_continuous_calibration = useContinuousCalibration;
+	jc->reset_continuous_calibration();
+	jc->offset_x = offsets[0];
+	jc->offset_y = offsets[1];
+	jc->offset_z = offsets[2];
+	jc->accel_magnitude = offsets[3];
+	return matches;
+}
+
+// turning forward from a fused orientation should land much closer to where fusion gets to next than standing still does
+static bool CheckPrediction() {
+	const float deltaTime = 0.004f;
+	const int ahead = 5;
+	const int numSamples = 2000;
+	bool good = true;
+	for (int useAcceleration = 0; useAcceleration < 2; useAcceleration++) {
+		Motion motion;
+		MotionPredictor predictor;
+		predictor.use_acceleration = useAcceleration != 0;
+		std::vector<MOTION_STATE> states(numSamples);
+		std::vector<float> velocities(numSamples * 3);
+		std::vector<float> accelerations(numSamples * 3);
+		for (int i = 0; i < numSamples; i++) {
+			const float seconds = i * deltaTime;
+			const float gyro[3] = { 300.0f * sinf(seconds * 6.0f), 100.0f * cosf(seconds * 3.0f), 50.0f };
+			// no accelerometer, so it's all gyro
+			motion.Update(gyro[0], gyro[1], gyro[2], 0.0f, 0.0f, 0.0f, 1.0f, deltaTime);
+			predictor.update(gyro[0], gyro[1], gyro[2], deltaTime);
+			states[i] = motion.GetMotionState();
+			predictor.get(&velocities[i * 3], &accelerations[i * 3]);
+		}
+		double predictedError = 0.0;
+		double unpredictedError = 0.0;
+		for (int i = 10; i + ahead < numSamples; i++) {
+			const MOTION_STATE predicted = MotionPredictor::predict(states[i], &velocities[i * 3], &accelerations[i * 3], ahead * deltaTime);
+			predictedError += AngleBetween(predicted, states[i + ahead]);
+			unpredictedError += AngleBetween(states[i], states[i + ahead]);
+		}
+		if (predictedError * 4.0 > unpredictedError) {
+			printf("Predicting %s acceleration is off by %.3f degrees on average, compared to %.3f without predicting\n",
+				useAcceleration ? "with" : "without", predictedError / (numSamples - 10 - ahead), unpredictedError / (numSamples - 10 - ahead));
+			good = false;
+		}
+	}
+	return good;
+}
+
+// lazy fusion should end up exactly where eager fusion does, whether it catches up because it's asked or because its buffer filled.
+// each gets a fresh device, since Motion::Reset doesn't reset everything
+static bool CheckMotionModes() {
+	MOTION_STATE results[2];
+	const int modes[2] = { JS_MOTION_EAGER, JS_MOTION_LAZY };
+	const char* names[2] = { "motion_eager", "motion_lazy" };
+	for (int m = 0; m < 2; m++) {
+		JoyShock* jc = SimulatedDevice(names[m], JS_SIMULATE_DS4_USB, 0).jc;
+		if (jc == nullptr) {
+			printf("Couldn't set up %s\n", names[m]);
+			return false;
+		}
+		jc->requested_motion_mode = modes[m];
+		jc->apply_motion_mode();
+		for (int i = 0; i < 1000; i++) {
+			const float seconds = i * 0.004f;
+			IMU_STATE sample = {};
+			sample.gyroX = 90.0f * sinf(seconds);
+			sample.gyroY = 20.0f;
+			sample.gyroZ = -45.0f * cosf(seconds * 2.0f);
+			sample.accelX = 0.1f * sinf(seconds * 3.0f);
+			sample.accelY = 1.0f;
+			jc->fuse_motion(&sample, 1, 0.004f, nullptr);
+		}
+		jc->publish_state();
+		results[m] = jc->get_motion_state(jc->get_published_state());
+	}
+	if (memcmp(&results[0], &results[1], sizeof(MOTION_STATE)) != 0) {
+		printf("Lazy fusion doesn't match eager fusion\n");
+		return false;
+	}
+	return true;
+}
+
+// the gravity window's box has to be exactly what looking at every sample gives: the newest, and any of the last MaxSamples that are younger than the window.
+// times are whole 1024ths of a second so both sides can add them up exactly, and it runs long enough for the clock to wind back a few times.
+// then two things that used to be wrong: every axis's minimum counts (z's used to be stuck on the newest sample's), and a window's the same length
+// of time at Switch and DualShock 4 rates
+static bool CheckGravityWindow() {
+	struct TimedSample {
+		double time;
+		Vec sample;
+	};
+	GravityWindow window;
+	std::vector<TimedSample> samples;
+	double now = 0.0;
+	uint32_t random = 54321;
+	for (int i = 0; i < 100000; i++) {
+		if (i % 20000 == 0) {
+			const float windows[5] = { 0.04f, 0.0f, 0.25f, 1.0f / 1024.0f, 0.015625f };
+			window.SetWindowSeconds(windows[i / 20000]);
+		}
+		random = random * 1664525u + 1013904223u;
+		// mostly about 4ms, sometimes nothing at all or a long gap
+		int ticks = 2 + (int)(random >> 29);
+		if ((random & 0xff) == 0) {
+			ticks = (random & 0x100) ? 0 : 200;
+		}
+		const float deltaTime = ticks / 1024.0f;
+		window.Advance(deltaTime);
+		now += deltaTime;
+		if ((random & 0x3f00) == 0) {
+			// no accelerometer this time, so nothing's added
+			continue;
+		}
+		Vec sample;
+		float* axes[3] = { &sample.x, &sample.y, &sample.z };
+		for (float* axis : axes) {
+			random = random * 1664525u + 1013904223u;
+			*axis = (float)(random >> 16) / 65536.0f - 0.5f;
+		}
+		window.Add(sample);
+		samples.push_back({ now, sample });
+
+		Vec expectedMin = sample;
+		Vec expectedMax = sample;
+		for (size_t back = 1; back < samples.size() && back < (size_t)GravityWindow::MaxSamples; back++) {
+			const TimedSample& older = samples[samples.size() - 1 - back];
+			if (now - older.time >= window.WindowSeconds) {
+				break;
+			}
+			expectedMin.Set(std::min(expectedMin.x, older.sample.x), std::min(expectedMin.y, older.sample.y), std::min(expectedMin.z, older.sample.z));
+			expectedMax.Set(std::max(expectedMax.x, older.sample.x), std::max(expectedMax.y, older.sample.y), std::max(expectedMax.z, older.sample.z));
+		}
+		const Vec min = window.Min();
+		const Vec max = window.Max();
+		if (memcmp(&min, &expectedMin, sizeof(Vec)) != 0 || memcmp(&max, &expectedMax, sizeof(Vec)) != 0) {
+			printf("Gravity window's box is wrong after %d samples\n", i + 1);
+			return false;
+		}
+	}
+
+	GravityWindow falling;
+	falling.Add(Vec(0.0f, 0.0f, 0.9f));
+	falling.Advance(0.004f);
+	falling.Add(Vec(0.0f, 0.0f, 1.0f));
+	if (falling.Min().z != 0.9f) {
+		printf("Gravity window's z minimum is %f, not 0.9\n", falling.Min().z);
+		return false;
+	}
+
+	// drifting steadily, the box is as big as the drift over the window, less up to one report's worth
+	const float drift = 1.0f;
+	const float rates[2] = { 66.67f, 250.0f };
+	for (float rate : rates) {
+		GravityWindow drifting;
+		const float interval = 1.0f / rate;
+		for (int i = 0; i < 100; i++) {
+			drifting.Advance(interval);
+			drifting.Add(Vec(0.0f, -1.0f, drift * interval * i));
+		}
+		const float box = drifting.Max().z - drifting.Min().z;
+		if (box > drift * drifting.WindowSeconds || box < drift * (drifting.WindowSeconds - interval) - 1e-5f) {
+			printf("Gravity window at %.0fHz spans %.1fms, not %.1fms\n", rate, box / drift * 1000.0f, drifting.WindowSeconds * 1000.0f);
+			return false;
+		}
+	}
+	return true;
+}
+
+// each batch kernel has to take a step the way Motion::Update does, give or take float rounding and its own cos, acos and exp2.
+// over many steps tiny differences can grow (whether a sample counts as steady, say), so every lane starts each step from where the
+// reference got to. lanes turn, sit still, skip samples, lose their accelerometer, change rate and have different gravity windows, and there are more than fit one pack
+static bool CheckMotionBatch() {
+	const int numLanes = 13;
+	MOTION_BATCH_KERNEL_INFO kernels[4];
+	const int numKernels = get_motion_batch_kernels(kernels);
+	for (int k = 0; k < numKernels; k++) {
+		if (!kernels[k].supported) {
+			continue;
+		}
+		MotionBatch batch(numLanes);
+		std::vector<Motion> reference(numLanes);
+		for (int lane = 0; lane < numLanes; lane++) {
+			reference[lane].Gravity.SetWindowSeconds(lane % 3 == 0 ? 0.1f : 0.04f);
+		}
+		for (int step = 0; step < 20000; step++) {
+			for (int lane = 0; lane < numLanes; lane++) {
+				if ((step * 7 + lane * 3) % 11 == 0) {
+					continue;
+				}
+				const float seconds = step * 0.004f + lane;
+				const bool turning = (step / 500 + lane) % 3 == 0;
+				float gyro[3] = { 0.3f * sinf(seconds * 50.0f), 0.2f, 0.1f * cosf(seconds * 40.0f) };
+				float accel[3] = { 0.001f * sinf(seconds * 77.0f), 0.98f, 0.002f };
+				if (turning) {
+					gyro[0] = 200.0f * sinf(seconds * 3.0f);
+					gyro[1] = 80.0f * cosf(seconds * 2.0f);
+					gyro[2] = -50.0f;
+					accel[0] = 0.3f * sinf(seconds * 5.0f);
+					accel[2] = 0.2f;
+				}
+				if ((step + lane) % 997 == 0) {
+					accel[0] = accel[1] = accel[2] = 0.0f;
+				}
+				const float deltaTime = 0.004f + 0.0005f * ((step + lane) % 3);
+				batch.set_motion(lane, reference[lane]);
+				reference[lane].Update(gyro[0], gyro[1], gyro[2], accel[0], accel[1], accel[2], 1.0f, deltaTime);
+				batch.set_sample(lane, gyro[0], gyro[1], gyro[2], accel[0], accel[1], accel[2], 1.0f, deltaTime);
+			}
+			batch.update(kernels[k].update);
+			for (int lane = 0; lane < numLanes; lane++) {
+				const MOTION_STATE expected = reference[lane].GetMotionState();
+				const MOTION_STATE actual = batch.get_motion_state(lane);
+				const float vectorError = std::max({ fabsf(expected.gravX - actual.gravX), fabsf(expected.gravY - actual.gravY), fabsf(expected.gravZ - actual.gravZ),
+					fabsf(expected.accelX - actual.accelX), fabsf(expected.accelY - actual.accelY), fabsf(expected.accelZ - actual.accelZ) });
+				if (AngleBetween(expected, actual) > 0.01 || vectorError > 1e-3f) {
+					printf("%s motion batch doesn't match Motion::Update for lane %d at step %d\n", kernels[k].name, lane, step);
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// IMU samples to fuse, and which way up really was for each one if we know
+struct FusionTrace {
+	std::string name;
+	std::vector<MOTION_SAMPLE> samples;
+	std::vector<Vec> up;
+};
+
+// a minute at 250Hz: three seconds of turning and shaking about, then three seconds still, over and over. the gyro has noise and a bias
+// calibration missed of (0.8, -0.5, 0.3) degrees per second; the accelerometer has noise, and acceleration on top of gravity while it's moving
+static FusionTrace SyntheticFusionTrace() {
+	FusionTrace trace;
+	trace.name = "synthetic";
+	const float deltaTime = 0.004f;
+	const Vec bias = Vec(0.8f, -0.5f, 0.3f);
+	Quat orientation = Quat::AngleAxis(0.3f, 1.0f, 0.0f, 0.5f);
+	uint32_t random = 777;
+	auto noise = [&random]() {
+		random = random * 1664525u + 1013904223u;
+		return (float)(random >> 8) / 8388608.0f - 1.0f;
+	};
+	for (int i = 0; i < 60 * 250; i++) {
+		const float seconds = i * deltaTime;
+		const bool moving = fmodf(seconds, 6.0f) < 3.0f;
+		Vec turning;
+		Vec acceleration;
+		if (moving) {
+			turning.Set(120.0f * sinf(seconds * 2.1f), 90.0f * cosf(seconds * 1.3f), 60.0f * sinf(seconds * 0.7f + 1.0f));
+			acceleration.Set(0.4f * sinf(seconds * 5.0f), 0.3f * cosf(seconds * 4.0f), 0.2f * sinf(seconds * 7.0f));
+		}
+		orientation *= Quat::AngleAxis(turning.Length() * deltaTime * (float)M_PI / 180.0f, turning.x, turning.y, turning.z);
+		orientation.Normalize();
+		const Vec up = Vec(0.0f, 1.0f, 0.0f) * orientation.Inverse();
+		const Vec gyro = turning + bias + Vec(noise(), noise(), noise()) * 0.3f;
+		const Vec accel = up + acceleration + Vec(noise(), noise(), noise()) * 0.01f;
+		trace.samples.push_back({ gyro.x, gyro.y, gyro.z, accel.x, accel.y, accel.z, 1.0f, deltaTime });
+		trace.up.push_back(up);
+	}
+	return trace;
+}
+
+// a device's reports, decoded and calibrated the way the polling thread would
+static FusionTrace DeviceFusionTrace(const BenchDevice& device) {
+	FusionTrace trace;
+	trace.name = device.name;
+	std::vector<unsigned char> buf(64);
+	for (const std::vector<unsigned char>& report : device.reports) {
+		memcpy(buf.data(), report.data(), report.size());
+		bool hasIMU = false;
+		handle_input(device.jc, buf.data(), (int)report.size(), hasIMU);
+		if (hasIMU) {
+			const IMU_STATE& imu = device.jc->imu_state;
+			trace.samples.push_back({ imu.gyroX, imu.gyroY, imu.gyroZ, imu.accelX, imu.accelY, imu.accelZ, device.jc->accel_magnitude, device.jc->delta_time });
+		}
+	}
+	return trace;
+}
+
+static double AngleBetween(const Vec& a, const Vec& b) {
+	const double cosine = a.Normalized().Dot(b.Normalized());
+	return acos(cosine < -1.0 ? -1.0 : cosine > 1.0 ? 1.0 : cosine) * 180.0 / M_PI;
+}
+
+// average degrees between which way up the algorithm thinks it is and which way up it really is. if that isn't known (a recording), it's compared
+// with the accelerometer instead, only while the controller's still. the first two seconds are left out, while it finds its feet
+static double FusionTiltError(MotionFusion* fusion, const FusionTrace& trace, double* stillError = nullptr) {
+	StillnessDetector stillness;
+	double error = 0.0;
+	double errorWhileStill = 0.0;
+	int numSamples = 0;
+	int numStill = 0;
+	float seconds = 0.0f;
+	for (size_t i = 0; i < trace.samples.size(); i++) {
+		const MOTION_SAMPLE& sample = trace.samples[i];
+		MOTION_STATE state;
+		fusion->fuse(&sample, 1, nullptr, &state);
+		const Vec accel = Vec(sample.accelX, sample.accelY, sample.accelZ);
+		const bool still = stillness.update(sample.gyroX, sample.gyroY, sample.gyroZ, accel.Length(), sample.deltaTime);
+		seconds += sample.deltaTime;
+		if (seconds < 2.0f) {
+			continue;
+		}
+		const Vec up = Vec(-state.gravX, -state.gravY, -state.gravZ);
+		if (!trace.up.empty()) {
+			const double sampleError = AngleBetween(up, trace.up[i]);
+			error += sampleError;
+			numSamples++;
+			if (still) {
+				errorWhileStill += sampleError;
+				numStill++;
+			}
+		}
+		else if (still) {
+			error += AngleBetween(up, accel);
+			numSamples++;
+		}
+	}
+	if (stillError != nullptr) {
+		*stillError = numStill > 0 ? errorWhileStill / numStill : -1.0;
+	}
+	return numSamples > 0 ? error / numSamples : -1.0;
+}
+
+// every algorithm should find which way up is on the synthetic trace, and the Kalman filter should find the gyro's bias.
+// the complementary filter through FusionAlgorithm has to be exactly Motion, and a device changing algorithm carries on from where it was
+static bool CheckFusionAlgorithms() {
+	const FusionTrace trace = SyntheticFusionTrace();
+	const char* names[4] = { "complementary", "madgwick", "mahony", "kalman" };
+	for (int algorithm = JS_FUSION_COMPLEMENTARY; algorithm <= JS_FUSION_KALMAN; algorithm++) {
+		MotionFusion* fusion = make_motion_fusion(algorithm);
+		double stillError;
+		FusionTiltError(fusion, trace, &stillError);
+		if (!(stillError < 3.0)) {
+			printf("Sensor fusion with %s is %.2f degrees off while still\n", names[algorithm], stillError);
+			delete fusion;
+			return false;
+		}
+		if (algorithm == JS_FUSION_KALMAN) {
+			const Vec bias = static_cast<FusionAlgorithm<BiasKalmanFusion>*>(fusion)->fusion.Bias * (180.0f / (float)M_PI);
+			if (fabsf(bias.x - 0.8f) > 0.2f || fabsf(bias.y + 0.5f) > 0.2f || fabsf(bias.z - 0.3f) > 0.2f) {
+				printf("Kalman filter thinks the gyro's bias is (%.2f, %.2f, %.2f), not (0.8, -0.5, 0.3)\n", bias.x, bias.y, bias.z);
+				delete fusion;
+				return false;
+			}
+		}
+		delete fusion;
+	}
+
+	Motion motion;
+	FusionAlgorithm<Motion> wrapped;
+	for (const MOTION_SAMPLE& sample : trace.samples) {
+		motion.Update(sample.gyroX, sample.gyroY, sample.gyroZ, sample.accelX, sample.accelY, sample.accelZ, sample.gravityLength, sample.deltaTime);
+		const MOTION_STATE expected = motion.GetMotionState();
+		MOTION_STATE actual;
+		wrapped.fuse(&sample, 1, nullptr, &actual);
+		if (memcmp(&expected, &actual, sizeof(MOTION_STATE)) != 0) {
+			printf("FusionAlgorithm<Motion> doesn't match Motion\n");
+			return false;
+		}
+	}
+
+	JoyShock* jc = SimulatedDevice("fusion_switch", JS_SIMULATE_DS4_USB, 0).jc;
+	if (jc == nullptr) {
+		printf("Couldn't set up fusion_switch\n");
+		return false;
+	}
+	IMU_STATE sample = {};
+	sample.gyroX = 45.0f;
+	sample.accelY = 1.0f;
+	for (int i = 0; i < 250; i++) {
+		jc->fuse_motion(&sample, 1, 0.004f, nullptr);
+	}
+	const MOTION_STATE before = jc->fused_motion_state;
+	jc->requested_fusion_algorithm = JS_FUSION_MADGWICK;
+	jc->apply_motion_mode();
+	if (jc->fusion_algorithm != JS_FUSION_MADGWICK || AngleBetween(before, jc->fused_motion_state) > 1e-3) {
+		printf("Changing sensor fusion algorithm lost the orientation\n");
+		return false;
+	}
+	return true;
+}
+
+static void BenchmarkReports(const BenchDevice& device) {
+	if (device.jc == nullptr || device.reports.empty()) {
+		printf("Couldn't set up %s\n", device.name.c_str());
+		return;
+	}
+	JoyShock* jc = device.jc;
+	const int numReports = (int)device.reports.size();
+	// handle_input changes the report it's given, so give it a copy
+	std::vector<unsigned char> buf(64);
+	RunBenchmark("handle_input/" + device.name, "packet", [&](int i) {
+		const std::vector<unsigned char>& report = device.reports[i % numReports];
+		memcpy(buf.data(), report.data(), report.size());
+		bool hasIMU;
+		handle_input(jc, buf.data(), (int)report.size(), hasIMU);
+		_sink = jc->imu_state.gyroX;
+	});
+	if (jc->parse_report != nullptr) {
+		RunBenchmark("parse_report/" + device.name, "packet", [&](int i) {
+			const std::vector<unsigned char>& report = device.reports[i % numReports];
+			memcpy(buf.data(), report.data(), report.size());
+			bool hasIMU;
+			jc->parse_report(jc, buf.data(), (int)report.size(), hasIMU);
+			_sink = jc->imu_state.gyroX;
+		});
+	}
+	// everything the polling thread does with a report, short of reading it
+	RunBenchmark("HandleReport/" + device.name, "packet", [&](int i) {
+		const std::vector<unsigned char>& report = device.reports[i % numReports];
+		memcpy(buf.data(), report.data(), report.size());
+		HandleReport(jc, buf.data(), (int)report.size());
+	});
+}
+
+// HandleReport again, with fusion put off or skipped
+static void BenchmarkMotionModes(const BenchDevice& device) {
+	JoyShock* jc = device.jc;
+	const int numReports = (int)device.reports.size();
+	std::vector<unsigned char> buf(64);
+	const int modes[2] = { JS_MOTION_LAZY, JS_MOTION_DISABLED };
+	const char* names[2] = { "lazy", "disabled" };
+	for (int m = 0; m < 2; m++) {
+		jc->requested_motion_mode = modes[m];
+		RunBenchmark("HandleReport/" + device.name + "/" + names[m], "packet", [&](int i) {
+			const std::vector<unsigned char>& report = device.reports[i % numReports];
+			memcpy(buf.data(), report.data(), report.size());
+			HandleReport(jc, buf.data(), (int)report.size());
+		});
+	}
+	jc->requested_motion_mode = JS_MOTION_EAGER;
+}
+
+static void BenchmarkSticks(JoyShock* jc) {
+	uint16_t values[1024];
+	for (int i = 0; i < 1024; i++) {
+		values[i] = (uint16_t)((i * 2654435761u) >> 20);
+	}
+	RunBenchmark("CalcAnalogStick2", "call", [&](int i) {
+		float x, y;
+		jc->CalcAnalogStick2(x, y, values[i & 1023], values[(i + 512) & 1023], jc->stick_cal_x_l, jc->stick_cal_y_l);
+		_sink = x + y;
+	});
+}
+
+static void BenchmarkCalibration(JoyShock* jc) {
+	RunBenchmark("push_sensor_samples+get_average_gyro", "sample", [&](int i) {
+		const float wobble = (float)(i & 63) * 0.01f;
+		jc->push_sensor_samples(0.5f + wobble, -0.25f, 0.125f - wobble, 1.0f);
+		float x, y, z, accelMagnitude;
+		jc->get_average_gyro(x, y, z, accelMagnitude);
+		_sink = x + y + z + accelMagnitude;
+	});
+}
+
+static void BenchmarkMotion() {
+	Motion motion;
+	RunBenchmark("Motion::Update", "sample", [&](int i) {
+		const float turning = 90.0f * sinf(i * 0.004f);
+		motion.Update(turning, 0.5f, -0.25f, 0.0f, 1.0f, 0.05f, 1.0f, 0.004f);
+		_sink = motion.Quaternion.w;
+	});
+}
+
+// one operation is one sample for one device, so these compare directly with Motion::Update
+static void BenchmarkMotionBatch() {
+	const int numLanes = 16;
+	MOTION_BATCH_KERNEL_INFO kernels[4];
+	const int numKernels = get_motion_batch_kernels(kernels);
+	for (int k = 0; k < numKernels; k++) {
+		if (!kernels[k].supported) {
+			continue;
+		}
+		MotionBatch batch(numLanes);
+		const MotionBatchKernel update = kernels[k].update;
+		RunBenchmark(std::string("motion_batch/") + kernels[k].name, "sample", [&](int i) {
+			const int lane = i % numLanes;
+			const float turning = 90.0f * sinf(i * 0.004f);
+			batch.set_sample(lane, turning, 0.5f, -0.25f, 0.0f, 1.0f, 0.05f, 1.0f, 0.004f);
+			if (lane == numLanes - 1) {
+				batch.update(update);
+				_sink = batch.get_motion_state(0).quatW;
+			}
+		});
+	}
+}
+
+// cost per sample and accuracy of every algorithm, on the synthetic trace and on recordings (or a simulated controller, if there aren't any)
+static void BenchmarkFusionAlgorithms(const std::vector<BenchDevice>& devices) {
+	std::vector<FusionTrace> traces;
+	traces.push_back(SyntheticFusionTrace());
+	for (const BenchDevice& device : devices) {
+		if (device.jc != nullptr && device.name.compare(0, 7, "replay:") == 0) {
+			traces.push_back(DeviceFusionTrace(device));
+		}
+	}
+	if (traces.size() == 1 && devices[0].jc != nullptr) {
+		traces.push_back(DeviceFusionTrace(devices[0]));
+	}
+	const char* names[4] = { "complementary", "madgwick", "mahony", "kalman" };
+	for (const FusionTrace& trace : traces) {
+		if (trace.samples.empty()) {
+			continue;
+		}
+		const int numSamples = (int)trace.samples.size();
+		for (int algorithm = JS_FUSION_COMPLEMENTARY; algorithm <= JS_FUSION_KALMAN; algorithm++) {
+			const std::string name = std::string("fusion/") + names[algorithm] + "/" + trace.name;
+			MotionFusion* fusion = make_motion_fusion(algorithm);
+			RunBenchmark(name, "sample", [&](int i) {
+				MOTION_STATE state;
+				fusion->fuse(&trace.samples[i % numSamples], 1, nullptr, &state);
+				_sink = state.quatW;
+			});
+			if (_results.empty() || _results.back().name != name) {
+				delete fusion;
+				continue;
+			}
+			fusion->reset();
+			double stillError;
+			const double tiltError = FusionTiltError(fusion, trace, &stillError);
+			_results.back().tiltError = tiltError;
+			if (tiltError < 0.0) {
+				printf("    no still samples to compare with\n");
+			}
+			else if (stillError >= 0.0) {
+				printf("    %.3f degrees from up on average, %.3f while still\n", tiltError, stillError);
+			}
+			else {
+				printf("    %.3f degrees from the accelerometer while still\n", tiltError);
+			}
+			delete fusion;
+		}
+	}
+}
+
+static void BenchmarkGetters(int handle) {
+	RunBenchmark("JslGetSimpleState", "call", [&](int i) {
+		_sink = JslGetSimpleState(handle).stickLX;
+	});
+	RunBenchmark("JslGetIMUState", "call", [&](int i) {
+		_sink = JslGetIMUState(handle).gyroX;
+	});
+	RunBenchmark("JslGetMotionState", "call", [&](int i) {
+		_sink = JslGetMotionState(handle).quatW;
+	});
+	RunBenchmark("JslGetPredictedMotionState", "call", [&](int i) {
+		_sink = JslGetPredictedMotionState(handle, JslGetTimestamp() + 16000).quatW;
+	});
+	RunBenchmark("JslGetTouchState", "call", [&](int i) {
+		_sink = JslGetTouchState(handle).t0X;
+	});
+	RunBenchmark("JslGetButtons", "call", [&](int i) {
+		_sink = (float)JslGetButtons(handle);
+	});
+	RunBenchmark("JslGetGyroX", "call", [&](int i) {
+		_sink = JslGetGyroX(handle);
+	});
+	DEVICE_SNAPSHOT snapshots[8];
+	RunBenchmark("JslGetAllStates", "call", [&](int i) {
+		_sink = (float)JslGetAllStates(snapshots, 8);
+	});
+}
+
+int main(int argc, char** argv) {
+	const char* jsonPath = nullptr;
+	std::vector<const char*> replays;
+	for (int i = 1; i < argc; i++) {
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--json") == 0 && hasValue) {
+			jsonPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && hasValue) {
+			replays.push_back(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--filter") == 0 && hasValue) {
+			_filter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--operations") == 0 && hasValue) {
+			_operations = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--repetitions") == 0 && hasValue) {
+			_repetitions = std::max(1, atoi(argv[++i]));
+		}
+		else {
+			printf("usage: %s [--json results.json] [--replay recording.jslrec]... [--filter text] [--operations n] [--repetitions n]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// connecting prints a lot. get it out of the way before there are results to print
+	const int numReports = 1024;
+	std::vector<BenchDevice> devices;
+	devices.push_back(SimulatedDevice("ds4_usb_0x01", JS_SIMULATE_DS4_USB, numReports));
+	devices.push_back(SimulatedDevice("ds4_bt_0x11", JS_SIMULATE_DS4_BT, numReports));
+	devices.push_back(SimulatedDevice("dualsense_usb_0x01", JS_SIMULATE_DUALSENSE_USB, numReports));
+	devices.push_back(SimulatedDevice("switch_pro_0x30", JS_SIMULATE_PRO_CONTROLLER, numReports));
+	devices.push_back(SimulatedDevice("switch_pro_0x21", JS_SIMULATE_PRO_CONTROLLER, numReports, ToSwitchSubcommandReply));
+	devices.push_back(SimulatedDevice("switch_pro_0x3f", JS_SIMULATE_PRO_CONTROLLER, numReports, ToSwitchSimpleReport));
+	devices.push_back(SimulatedDevice("joycon_left_0x30", JS_SIMULATE_JOYCON_LEFT, numReports));
+	// each of the 3 IMU samples fused separately
+	devices.push_back(SimulatedDevice("joycon_right_0x30_imu_samples", JS_SIMULATE_JOYCON_RIGHT, numReports));
+	if (devices.back().jc != nullptr) {
+		devices.back().jc->use_imu_samples = true;
+	}
+	for (const char* path : replays) {
+		BenchDevice device;
+		if (!ReplayedDevice(path, device)) {
+			printf("Couldn't replay %s\n", path);
+			continue;
+		}
+		devices.push_back(device);
+	}
+	printf("\n");
+
+	bool parsersMatch = true;
+	for (const BenchDevice& device : devices) {
+		parsersMatch &= CheckParser(device);
+	}
+	parsersMatch &= CheckSwitchImuDecoders(devices);
+	if (devices[0].jc != nullptr) {
+		parsersMatch &= CheckCalibration(devices[0].jc);
+	}
+	parsersMatch &= CheckPrediction();
+	parsersMatch &= CheckMotionModes();
+	parsersMatch &= CheckGravityWindow();
+	parsersMatch &= CheckMotionBatch();
+	parsersMatch &= CheckFusionAlgorithms();
+	if (!parsersMatch) {
+		JslDisconnectAndDisposeAll();
+		return 1;
+	}
+
+	for (const BenchDevice& device : devices) {
+		BenchmarkReports(device);
+	}
+	if (devices[0].jc != nullptr) {
+		BenchmarkMotionModes(devices[0]);
+	}
+	JoyShock* switchDevice = devices[3].jc;
+	if (switchDevice != nullptr) {
+		BenchmarkSwitchImu(devices[3]);
+		BenchmarkSticks(switchDevice);
+	}
+	if (devices[0].jc != nullptr) {
+		BenchmarkCalibration(devices[0].jc);
+		BenchmarkGetters(devices[0].jc->intHandle);
+	}
+	BenchmarkMotion();
+	BenchmarkMotionBatch();
+	BenchmarkFusionAlgorithms(devices);
+
+	JslDisconnectAndDisposeAll();
+
+	if (jsonPath != nullptr && !WriteJson(jsonPath)) {
+		printf("Couldn't write %s\n", jsonPath);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "../JoyShockLibrary.h"
+#include "../Simd.cpp"
+#include <cmath>
+#include <vector>
+
+// Sensor fusion for lots of devices at once. Motion::Update (SensorFusion.cpp) is the reference, and does one device at a time.
+// Here every value is kept structure-of-arrays, one float per device (a lane), so one pass of the maths updates 4 lanes with SSE2 or 8 with AVX2.
+// The results match Motion::Update to within float rounding, give or take: vectors are turned by quaternions directly rather than by two quaternion multiplies,
+// and cosf, acosf and exp2f are replaced by polynomials good to about 1e-7 (jsl_bench checks how close it all stays).
+// As with the Switch IMU decoders, there's a scalar version and vectorised ones, and the best the CPU can run is picked the first time it's needed.
+// It isn't built into the library. The polling threads fuse each report as soon as it's read, so samples from many devices are never waiting to be fused together.
+// It's here for jsl_bench to measure against Motion, for whoever wants to batch samples themselves.
+// Include it after JoyShockLibrary.cpp, which brings in Motion (SensorFusion.cpp has no include guard).
+
+// everything about every lane, structure-of-arrays. capacity is always a whole number of the widest Pack
+struct MotionLanes {
+	int capacity = 0;
+	// each lane's sample waiting to be fused, if waiting is non-zero
+	std::vector<float> waiting;
+	std::vector<float> gyroX, gyroY, gyroZ;
+	std::vector<float> accelX, accelY, accelZ;
+	std::vector<float> gravityLength;
+	std::vector<float> deltaTime;
+	// what Motion keeps
+	std::vector<float> quatW, quatX, quatY, quatZ;
+	std::vector<float> outAccelX, outAccelY, outAccelZ;
+	std::vector<float> gravX, gravY, gravZ;
+	std::vector<float> timeCorrecting;
+	// Motion's GravityWindow. samples and their times are slot * capacity + lane
+	std::vector<float> gravityX, gravityY, gravityZ;
+	std::vector<float> gravityTime;
+	std::vector<float> gravityClock;
+	std::vector<float> gravityWindow;
+	std::vector<unsigned int> numGravitySamples;
+};
+
+typedef void (*MotionBatchKernel)(MotionLanes& lanes);
+
+struct ScalarPack {
+	typedef bool Mask;
+	static const int width = 1;
+	float v;
+
+	static ScalarPack set1(float f) { return { f }; }
+	static ScalarPack load(const float* p) { return { *p }; }
+	void store(float* p) const { *p = v; }
+	ScalarPack operator+(ScalarPack b) const { return { v + b.v }; }
+	ScalarPack operator-(ScalarPack b) const { return { v - b.v }; }
+	ScalarPack operator*(ScalarPack b) const { return { v * b.v }; }
+	ScalarPack operator/(ScalarPack b) const { return { v / b.v }; }
+	Mask operator<(ScalarPack b) const { return v < b.v; }
+	Mask operator<=(ScalarPack b) const { return v <= b.v; }
+	Mask operator>(ScalarPack b) const { return v > b.v; }
+	Mask operator==(ScalarPack b) const { return v == b.v; }
+	static ScalarPack sqrt(ScalarPack a) { return { sqrtf(a.v) }; }
+	static ScalarPack abs(ScalarPack a) { return { fabsf(a.v) }; }
+	// same as SSE: a if a is less (or more), otherwise b
+	static ScalarPack min(ScalarPack a, ScalarPack b) { return a.v < b.v ? a : b; }
+	static ScalarPack max(ScalarPack a, ScalarPack b) { return a.v > b.v ? a : b; }
+	static ScalarPack select(Mask m, ScalarPack a, ScalarPack b) { return m ? a : b; }
+	static ScalarPack round(ScalarPack a) { return { nearbyintf(a.v) }; }
+	// 2 to the power of a, which is a whole number
+	static ScalarPack pow2(ScalarPack a) { return { ldexpf(1.0f, (int)a.v) }; }
+	static Mask mask_and(Mask a, Mask b) { return a && b; }
+	static Mask mask_or(Mask a, Mask b) { return a || b; }
+};
+
+namespace motion_batch_scalar {
+	typedef ScalarPack Pack;
+#include "MotionBatchKernel.cpp"
+}
+
+#if JSL_HAS_SSE2
+struct Sse2Pack {
+	typedef __m128 Mask;
+	static const int width = 4;
+	__m128 v;
+
+	static Sse2Pack set1(float f) { return { _mm_set1_ps(f) }; }
+	static Sse2Pack load(const float* p) { return { _mm_loadu_ps(p) }; }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+	Sse2Pack operator+(Sse2Pack b) const { return { _mm_add_ps(v, b.v) }; }
+	Sse2Pack operator-(Sse2Pack b) const { return { _mm_sub_ps(v, b.v) }; }
+	Sse2Pack operator*(Sse2Pack b) const { return { _mm_mul_ps(v, b.v) }; }
+	Sse2Pack operator/(Sse2Pack b) const { return { _mm_div_ps(v, b.v) }; }
+	Mask operator<(Sse2Pack b) const { return _mm_cmplt_ps(v, b.v); }
+	Mask operator<=(Sse2Pack b) const { return _mm_cmple_ps(v, b.v); }
+	Mask operator>(Sse2Pack b) const { return _mm_cmpgt_ps(v, b.v); }
+	Mask operator==(Sse2Pack b) const { return _mm_cmpeq_ps(v, b.v); }
+	static Sse2Pack sqrt(Sse2Pack a) { return { _mm_sqrt_ps(a.v) }; }
+	static Sse2Pack abs(Sse2Pack a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+	static Sse2Pack min(Sse2Pack a, Sse2Pack b) { return { _mm_min_ps(a.v, b.v) }; }
+	static Sse2Pack max(Sse2Pack a, Sse2Pack b) { return { _mm_max_ps(a.v, b.v) }; }
+	static Sse2Pack select(Mask m, Sse2Pack a, Sse2Pack b) { return { _mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v)) }; }
+	static Sse2Pack round(Sse2Pack a) { return { _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)) }; }
+	static Sse2Pack pow2(Sse2Pack a) { return { _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(a.v), _mm_set1_epi32(127)), 23)) }; }
+	static Mask mask_and(Mask a, Mask b) { return _mm_and_ps(a, b); }
+	static Mask mask_or(Mask a, Mask b) { return _mm_or_ps(a, b); }
+};
+
+namespace motion_batch_sse2 {
+	typedef Sse2Pack Pack;
+#include "MotionBatchKernel.cpp"
+}
+
+JSL_BEGIN_TARGET_AVX2
+struct Avx2Pack {
+	typedef __m256 Mask;
+	static const int width = 8;
+	__m256 v;
+
+	static Avx2Pack set1(float f) { return { _mm256_set1_ps(f) }; }
+	static Avx2Pack load(const float* p) { return { _mm256_loadu_ps(p) }; }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+	Avx2Pack operator+(Avx2Pack b) const { return { _mm256_add_ps(v, b.v) }; }
+	Avx2Pack operator-(Avx2Pack b) const { return { _mm256_sub_ps(v, b.v) }; }
+	Avx2Pack operator*(Avx2Pack b) const { return { _mm256_mul_ps(v, b.v) }; }
+	Avx2Pack operator/(Avx2Pack b) const { return { _mm256_div_ps(v, b.v) }; }
+	Mask operator<(Avx2Pack b) const { return _mm256_cmp_ps(v, b.v, _CMP_LT_OQ); }
+	Mask operator<=(Avx2Pack b) const { return _mm256_cmp_ps(v, b.v, _CMP_LE_OQ); }
+	Mask operator>(Avx2Pack b) const { return _mm256_cmp_ps(v, b.v, _CMP_GT_OQ); }
+	Mask operator==(Avx2Pack b) const { return _mm256_cmp_ps(v, b.v, _CMP_EQ_OQ); }
+	static Avx2Pack sqrt(Avx2Pack a) { return { _mm256_sqrt_ps(a.v) }; }
+	static Avx2Pack abs(Avx2Pack a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+	static Avx2Pack min(Avx2Pack a, Avx2Pack b) { return { _mm256_min_ps(a.v, b.v) }; }
+	static Avx2Pack max(Avx2Pack a, Avx2Pack b) { return { _mm256_max_ps(a.v, b.v) }; }
+	static Avx2Pack select(Mask m, Avx2Pack a, Avx2Pack b) { return { _mm256_blendv_ps(b.v, a.v, m) }; }
+	static Avx2Pack round(Avx2Pack a) { return { _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+	static Avx2Pack pow2(Avx2Pack a) { return { _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(a.v), _mm256_set1_epi32(127)), 23)) }; }
+	static Mask mask_and(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+	static Mask mask_or(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+};
+
+namespace motion_batch_avx2 {
+	typedef Avx2Pack Pack;
+#include "MotionBatchKernel.cpp"
+}
+JSL_END_TARGET_AVX2
+#endif
+
+struct MOTION_BATCH_KERNEL_INFO {
+	const char* name;
+	MotionBatchKernel update;
+	int width; // lanes per pass
+	bool supported; // whether this CPU can run it
+};
+
+// every kernel there is, the scalar one first
+inline int get_motion_batch_kernels(MOTION_BATCH_KERNEL_INFO* kernels) {
+	int count = 0;
+	kernels[count++] = { "scalar", &motion_batch_scalar::update_lanes, ScalarPack::width, true };
+#if JSL_HAS_SSE2
+	kernels[count++] = { "sse2", &motion_batch_sse2::update_lanes, Sse2Pack::width, true };
+	kernels[count++] = { "avx2", &motion_batch_avx2::update_lanes, Avx2Pack::width, cpu_has_avx2() };
+#endif
+	return count;
+}
+
+// the best kernel this CPU can run
+inline MotionBatchKernel motion_batch_kernel() {
+	static const MotionBatchKernel best = []() {
+		MOTION_BATCH_KERNEL_INFO kernels[4];
+		const int count = get_motion_batch_kernels(kernels);
+		MotionBatchKernel chosen = kernels[0].update;
+		for (int i = 0; i < count; i++) {
+			if (kernels[i].supported) {
+				chosen = kernels[i].update;
+			}
+		}
+		return chosen;
+	}();
+	return best;
+}
+
+// Motion for a number of devices, fused together. Give each lane its sample with set_sample, then update() fuses every lane that has one.
+// Not thread safe: like Motion, it belongs to whichever thread's fusing
+class MotionBatch {
+public:
+	// the widest Pack, so every kernel can work on whole packs
+	static const int lane_multiple = 8;
+
+	explicit MotionBatch(int numLanes) : _size(numLanes) {
+		const int capacity = (numLanes + lane_multiple - 1) / lane_multiple * lane_multiple;
+		_lanes.capacity = capacity;
+		std::vector<float>* perLane[] = { &_lanes.waiting, &_lanes.gyroX, &_lanes.gyroY, &_lanes.gyroZ, &_lanes.accelX, &_lanes.accelY, &_lanes.accelZ,
+			&_lanes.gravityLength, &_lanes.deltaTime, &_lanes.quatW, &_lanes.quatX, &_lanes.quatY, &_lanes.quatZ,
+			&_lanes.outAccelX, &_lanes.outAccelY, &_lanes.outAccelZ, &_lanes.gravX, &_lanes.gravY, &_lanes.gravZ, &_lanes.timeCorrecting, &_lanes.gravityClock };
+		for (std::vector<float>* values : perLane) {
+			values->assign(capacity, 0.0f);
+		}
+		_lanes.gravityX.assign(capacity * GravityWindow::MaxSamples, 0.0f);
+		_lanes.gravityY.assign(capacity * GravityWindow::MaxSamples, 0.0f);
+		_lanes.gravityZ.assign(capacity * GravityWindow::MaxSamples, 0.0f);
+		// a copy, since assign takes it by reference
+		const float neverAdded = GravityWindow::NeverAdded;
+		_lanes.gravityTime.assign(capacity * GravityWindow::MaxSamples, neverAdded);
+		_lanes.gravityWindow.assign(capacity, GravityWindow().WindowSeconds);
+		_lanes.numGravitySamples.assign(capacity, 0);
+		for (int lane = 0; lane < capacity; lane++) {
+			reset(lane);
+		}
+	}
+
+	int size() const {
+		return _size;
+	}
+
+	// Motion::Reset
+	void reset(int lane) {
+		_lanes.quatW[lane] = 1.0f;
+		_lanes.quatX[lane] = 0.0f;
+		_lanes.quatY[lane] = 0.0f;
+		_lanes.quatZ[lane] = 0.0f;
+		_lanes.outAccelX[lane] = _lanes.outAccelY[lane] = _lanes.outAccelZ[lane] = 0.0f;
+		_lanes.gravX[lane] = _lanes.gravY[lane] = _lanes.gravZ[lane] = 0.0f;
+		_lanes.numGravitySamples[lane] = 0;
+		_lanes.gravityClock[lane] = 0.0f;
+		for (int slot = 0; slot < GravityWindow::MaxSamples; slot++) {
+			_lanes.gravityTime[slot * _lanes.capacity + lane] = GravityWindow::NeverAdded;
+		}
+	}
+
+	// GravityWindow::WindowSeconds
+	void set_gravity_window(int lane, float seconds) {
+		_lanes.gravityWindow[lane] = seconds;
+	}
+
+	// pick up where a device's Motion is (Motion comes from SensorFusion.cpp, which JoyShockLibrary.cpp includes first)
+	void set_motion(int lane, const Motion& motion) {
+		_lanes.quatW[lane] = motion.Quaternion.w;
+		_lanes.quatX[lane] = motion.Quaternion.x;
+		_lanes.quatY[lane] = motion.Quaternion.y;
+		_lanes.quatZ[lane] = motion.Quaternion.z;
+		_lanes.outAccelX[lane] = motion.Accel.x;
+		_lanes.outAccelY[lane] = motion.Accel.y;
+		_lanes.outAccelZ[lane] = motion.Accel.z;
+		_lanes.gravX[lane] = motion.Grav.x;
+		_lanes.gravY[lane] = motion.Grav.y;
+		_lanes.gravZ[lane] = motion.Grav.z;
+		_lanes.timeCorrecting[lane] = motion.TimeCorrecting;
+		const GravityWindow& gravity = motion.Gravity;
+		_lanes.numGravitySamples[lane] = gravity.NumSamples;
+		_lanes.gravityClock[lane] = gravity.Clock;
+		_lanes.gravityWindow[lane] = gravity.WindowSeconds;
+		for (int slot = 0; slot < GravityWindow::MaxSamples; slot++) {
+			_lanes.gravityX[slot * _lanes.capacity + lane] = gravity.Samples[slot].x;
+			_lanes.gravityY[slot * _lanes.capacity + lane] = gravity.Samples[slot].y;
+			_lanes.gravityZ[slot * _lanes.capacity + lane] = gravity.Samples[slot].z;
+			_lanes.gravityTime[slot * _lanes.capacity + lane] = gravity.SampleTimes[slot];
+		}
+	}
+
+	// the next sample for this lane, same as Motion::Update's arguments. replaces any sample that's already waiting
+	void set_sample(int lane, float gyroX, float gyroY, float gyroZ, float accelX, float accelY, float accelZ, float gravityLength, float deltaTime) {
+		_lanes.waiting[lane] = 1.0f;
+		_lanes.gyroX[lane] = gyroX;
+		_lanes.gyroY[lane] = gyroY;
+		_lanes.gyroZ[lane] = gyroZ;
+		_lanes.accelX[lane] = accelX;
+		_lanes.accelY[lane] = accelY;
+		_lanes.accelZ[lane] = accelZ;
+		_lanes.gravityLength[lane] = gravityLength;
+		_lanes.deltaTime[lane] = deltaTime;
+	}
+
+	// fuse every lane with a sample waiting
+	void update(MotionBatchKernel kernel = motion_batch_kernel()) {
+		kernel(_lanes);
+	}
+
+	MOTION_STATE get_motion_state(int lane) const {
+		MOTION_STATE result = MOTION_STATE();
+		result.quatW = _lanes.quatW[lane];
+		result.quatX = _lanes.quatX[lane];
+		result.quatY = _lanes.quatY[lane];
+		result.quatZ = _lanes.quatZ[lane];
+		result.accelX = _lanes.outAccelX[lane];
+		result.accelY = _lanes.outAccelY[lane];
+		result.accelZ = _lanes.outAccelZ[lane];
+		result.gravX = _lanes.gravX[lane];
+		result.gravY = _lanes.gravY[lane];
+		result.gravZ = _lanes.gravZ[lane];
+		return result;
+	}
+
+private:
+	int _size;
+	MotionLanes _lanes;
+};
@@ -0,0 +1,276 @@
+// No #pragma once: MotionBatch.cpp includes this once for each instruction set, each time in its own namespace with its own Pack.
+// Pack is a group of lanes (one float per device) with the usual arithmetic and comparisons, and Pack::Mask for the results of comparisons.
+// Everything here follows Motion::Update step for step, in the same order, so that the only differences come from the few places noted.
+
+// cosf. range reduced to -pi to pi (2pi in two parts, so big angles keep their precision), then the Taylor series to x^18 -- good to about 1e-7
+static inline Pack cos_pack(Pack x) {
+	const Pack turns = Pack::round(x * Pack::set1(0.159154943f));
+	const Pack r = (x - turns * Pack::set1(6.28125f)) - turns * Pack::set1(0.00193530717958647692f);
+	const Pack r2 = r * r;
+	Pack result = Pack::set1(1.0f / 6402373705728000.0f);
+	result = Pack::set1(-1.0f / 20922789888000.0f) + r2 * result;
+	result = Pack::set1(1.0f / 87178291200.0f) + r2 * result;
+	result = Pack::set1(-1.0f / 479001600.0f) + r2 * result;
+	result = Pack::set1(1.0f / 3628800.0f) + r2 * result;
+	result = Pack::set1(-1.0f / 40320.0f) + r2 * result;
+	result = Pack::set1(1.0f / 720.0f) + r2 * result;
+	result = Pack::set1(-1.0f / 24.0f) + r2 * result;
+	result = Pack::set1(-0.5f) + r2 * result;
+	return Pack::set1(1.0f) + r2 * result;
+}
+
+// acosf. Abramowitz and Stegun 4.4.46, good to about 2e-8. NaN outside -1 to 1, like acosf
+static inline Pack acos_pack(Pack x) {
+	const Pack absolute = Pack::abs(x);
+	Pack result = Pack::set1(-0.0012624911f);
+	result = Pack::set1(0.0066700901f) + absolute * result;
+	result = Pack::set1(-0.0170881256f) + absolute * result;
+	result = Pack::set1(0.0308918810f) + absolute * result;
+	result = Pack::set1(-0.0501743046f) + absolute * result;
+	result = Pack::set1(0.0889789874f) + absolute * result;
+	result = Pack::set1(-0.2145988016f) + absolute * result;
+	result = Pack::set1(1.5707963050f) + absolute * result;
+	result = Pack::sqrt(Pack::set1(1.0f) - absolute) * result;
+	return Pack::select(x < Pack::set1(0.0f), Pack::set1(3.14159265f) - result, result);
+}
+
+// exp2f for x <= 0. the fraction's done by series (to about 1e-7), the whole part straight into the exponent
+static inline Pack exp2_pack(Pack x) {
+	x = Pack::max(x, Pack::set1(-126.0f));
+	const Pack whole = Pack::round(x);
+	const Pack f = (x - whole) * Pack::set1(0.693147181f);
+	Pack result = Pack::set1(1.0f / 5040.0f);
+	result = Pack::set1(1.0f / 720.0f) + f * result;
+	result = Pack::set1(1.0f / 120.0f) + f * result;
+	result = Pack::set1(1.0f / 24.0f) + f * result;
+	result = Pack::set1(1.0f / 6.0f) + f * result;
+	result = Pack::set1(0.5f) + f * result;
+	result = Pack::set1(1.0f) + f * result;
+	result = Pack::set1(1.0f) + f * result;
+	return result * Pack::pow2(whole);
+}
+
+// Quat::operator*=
+static inline void quat_multiply(Pack& w, Pack& x, Pack& y, Pack& z, Pack rw, Pack rx, Pack ry, Pack rz) {
+	const Pack newW = w * rw - x * rx - y * ry - z * rz;
+	const Pack newX = w * rx + x * rw + y * rz - z * ry;
+	const Pack newY = w * ry - x * rz + y * rw + z * rx;
+	const Pack newZ = w * rz + x * ry - y * rx + z * rw;
+	w = newW;
+	x = newX;
+	y = newY;
+	z = newZ;
+}
+
+// Quat::Normalize: keeps w, and scales x, y, z to match. identity if that can't be done
+static inline void quat_normalize(Pack& w, Pack& x, Pack& y, Pack& z) {
+	const Pack length = Pack::sqrt(x * x + y * y + z * z);
+	const Pack targetLength = Pack::set1(1.0f) - w * w;
+	const Pack::Mask identity = Pack::mask_or(targetLength <= Pack::set1(0.0f), length <= Pack::set1(0.0f));
+	const Pack fixFactor = Pack::sqrt(Pack::max(targetLength, Pack::set1(0.0f))) / length;
+	w = Pack::select(identity, Pack::set1(1.0f), w);
+	x = Pack::select(identity, Pack::set1(0.0f), x * fixFactor);
+	y = Pack::select(identity, Pack::set1(0.0f), y * fixFactor);
+	z = Pack::select(identity, Pack::set1(0.0f), z * fixFactor);
+}
+
+// Quat::AngleAxis
+static inline void angle_axis(Pack angle, Pack axisX, Pack axisY, Pack axisZ, Pack& w, Pack& x, Pack& y, Pack& z) {
+	w = cos_pack(angle * Pack::set1(0.5f));
+	x = axisX;
+	y = axisY;
+	z = axisZ;
+	quat_normalize(w, x, y, z);
+}
+
+// Vec::Normalize: left alone if it's zero length
+static inline void vec_normalize(Pack& x, Pack& y, Pack& z) {
+	const Pack length = Pack::sqrt(x * x + y * y + z * z);
+	const Pack::Mask zero = length == Pack::set1(0.0f);
+	const Pack fixFactor = Pack::set1(1.0f) / length;
+	x = Pack::select(zero, x, x * fixFactor);
+	y = Pack::select(zero, y, y * fixFactor);
+	z = Pack::select(zero, z, z * fixFactor);
+}
+
+// v * q, meaning q v q^-1. Vec::operator*=(Quat) does that as two quaternion multiplies. This is the same rotation (for a unit quaternion) in a lot less:
+// t = 2 (q.xyz x v), v' = v + q.w t + q.xyz x t
+static inline void rotate(Pack qw, Pack qx, Pack qy, Pack qz, Pack& x, Pack& y, Pack& z) {
+	const Pack tx = Pack::set1(2.0f) * (qy * z - qz * y);
+	const Pack ty = Pack::set1(2.0f) * (qz * x - qx * z);
+	const Pack tz = Pack::set1(2.0f) * (qx * y - qy * x);
+	const Pack newX = x + qw * tx + (qy * tz - qz * ty);
+	const Pack newY = y + qw * ty + (qz * tx - qx * tz);
+	const Pack newZ = z + qw * tz + (qx * ty - qy * tx);
+	x = newX;
+	y = newY;
+	z = newZ;
+}
+
+// Motion::Update for Pack::width lanes, starting at first. lanes without a sample waiting are left as they were
+static inline void update_block(MotionLanes& lanes, int first) {
+	typedef Pack::Mask Mask;
+	const Mask active = Pack::load(&lanes.waiting[first]) > Pack::set1(0.0f);
+	const Pack gyroX = Pack::load(&lanes.gyroX[first]);
+	const Pack gyroY = Pack::load(&lanes.gyroY[first]);
+	const Pack gyroZ = Pack::load(&lanes.gyroZ[first]);
+	const Pack accelX = Pack::load(&lanes.accelX[first]);
+	const Pack accelY = Pack::load(&lanes.accelY[first]);
+	const Pack accelZ = Pack::load(&lanes.accelZ[first]);
+	const Pack gravityLength = Pack::load(&lanes.gravityLength[first]);
+	const Pack deltaTime = Pack::load(&lanes.deltaTime[first]);
+	const Pack oldW = Pack::load(&lanes.quatW[first]);
+	const Pack oldX = Pack::load(&lanes.quatX[first]);
+	const Pack oldY = Pack::load(&lanes.quatY[first]);
+	const Pack oldZ = Pack::load(&lanes.quatZ[first]);
+	Pack w = oldW;
+	Pack x = oldX;
+	Pack y = oldY;
+	Pack z = oldZ;
+
+	// rotate
+	const Pack angle = Pack::sqrt(gyroX * gyroX + gyroY * gyroY + gyroZ * gyroZ) * Pack::set1(3.14159265f) / Pack::set1(180.0f) * deltaTime;
+	Pack rw, rx, ry, rz;
+	angle_axis(angle, gyroX, gyroY, gyroZ, rw, rx, ry, rz);
+	quat_multiply(w, x, y, z, rw, rx, ry, rz);
+
+	const Pack accelMagnitude = Pack::sqrt(accelX * accelX + accelY * accelY + accelZ * accelZ);
+	const Mask hasAccel = accelMagnitude > Pack::set1(0.0f);
+	// for comparing gravity samples, we need them to be global
+	Pack absoluteX = accelX;
+	Pack absoluteY = accelY;
+	Pack absoluteZ = accelZ;
+	rotate(w, x, y, z, absoluteX, absoluteY, absoluteZ);
+
+	// each lane has its own place in its gravity window and its own clock, so they're moved on one at a time (GravityWindow::Advance and Add)
+	float newestX[Pack::width];
+	float newestY[Pack::width];
+	float newestZ[Pack::width];
+	float sampled[Pack::width];
+	float moved[Pack::width];
+	absoluteX.store(newestX);
+	absoluteY.store(newestY);
+	absoluteZ.store(newestZ);
+	Pack::select(Pack::mask_and(active, hasAccel), Pack::set1(1.0f), Pack::set1(0.0f)).store(sampled);
+	Pack::select(active, Pack::set1(1.0f), Pack::set1(0.0f)).store(moved);
+	const int capacity = lanes.capacity;
+	for (int i = 0; i < Pack::width; i++) {
+		if (moved[i] == 0.0f) {
+			continue;
+		}
+		const int lane = first + i;
+		float& clock = lanes.gravityClock[lane];
+		if (lanes.deltaTime[lane] > 0.0f) {
+			clock += lanes.deltaTime[lane];
+		}
+		if (clock >= GravityWindow::ClockWrap) {
+			clock -= GravityWindow::ClockWrap;
+			for (int slot = 0; slot < GravityWindow::MaxSamples; slot++) {
+				lanes.gravityTime[slot * capacity + lane] -= GravityWindow::ClockWrap;
+			}
+		}
+		if (sampled[i] != 0.0f) {
+			const int slot = lanes.numGravitySamples[lane]++ % GravityWindow::MaxSamples;
+			lanes.gravityX[slot * capacity + lane] = newestX[i];
+			lanes.gravityY[slot * capacity + lane] = newestY[i];
+			lanes.gravityZ[slot * capacity + lane] = newestZ[i];
+			lanes.gravityTime[slot * capacity + lane] = clock;
+		}
+	}
+	// lanes' windows hold different numbers of samples, so rather than GravityWindow's deques, every slot's looked at and the ones still in the window count.
+	// the newest always counts, and the last MaxSamples are all there are. it's the same set of samples, so it's the same box exactly
+	const Pack clock = Pack::load(&lanes.gravityClock[first]);
+	const Pack window = Pack::load(&lanes.gravityWindow[first]);
+	Pack minX = absoluteX;
+	Pack minY = absoluteY;
+	Pack minZ = absoluteZ;
+	Pack maxX = absoluteX;
+	Pack maxY = absoluteY;
+	Pack maxZ = absoluteZ;
+	for (int slot = 0; slot < GravityWindow::MaxSamples; slot++) {
+		const Mask inWindow = clock - Pack::load(&lanes.gravityTime[slot * capacity + first]) < window;
+		const Pack sampleX = Pack::load(&lanes.gravityX[slot * capacity + first]);
+		const Pack sampleY = Pack::load(&lanes.gravityY[slot * capacity + first]);
+		const Pack sampleZ = Pack::load(&lanes.gravityZ[slot * capacity + first]);
+		minX = Pack::select(inWindow, Pack::min(sampleX, minX), minX);
+		minY = Pack::select(inWindow, Pack::min(sampleY, minY), minY);
+		minZ = Pack::select(inWindow, Pack::min(sampleZ, minZ), minZ);
+		maxX = Pack::select(inWindow, Pack::max(sampleX, maxX), maxX);
+		maxY = Pack::select(inWindow, Pack::max(sampleY, maxY), maxY);
+		maxZ = Pack::select(inWindow, Pack::max(sampleZ, maxZ), maxZ);
+	}
+	const Pack boxX = maxX - minX;
+	const Pack boxY = maxY - minY;
+	const Pack boxZ = maxZ - minZ;
+	const Pack steadyGravityThreshold = Pack::set1(0.05f);
+	const Mask steady = Pack::mask_and(Pack::mask_and(boxX <= steadyGravityThreshold, boxY <= steadyGravityThreshold), boxZ <= steadyGravityThreshold);
+
+	// where gravity's pointing, from the middle of the box
+	Pack directionX = minX + boxX * Pack::set1(0.5f);
+	Pack directionY = minY + boxY * Pack::set1(0.5f);
+	Pack directionZ = minZ + boxZ * Pack::set1(0.5f);
+	vec_normalize(directionX, directionY, directionZ);
+	directionX = Pack::set1(0.0f) - directionX;
+	directionY = Pack::set1(0.0f) - directionY;
+	directionZ = Pack::set1(0.0f) - directionZ;
+	// compared with straight down (0, -1, 0)
+	const Pack errorAngle = acos_pack(Pack::set1(0.0f) - directionY) * Pack::set1(180.0f) / Pack::set1(3.14159265f);
+	// direction x down
+	Pack flattenedX = directionZ;
+	Pack flattenedY = Pack::set1(0.0f);
+	Pack flattenedZ = Pack::set1(0.0f) - directionX;
+	vec_normalize(flattenedX, flattenedY, flattenedZ);
+
+	const Mask correcting = Pack::mask_and(Pack::mask_and(active, hasAccel), Pack::mask_and(steady, errorAngle > Pack::set1(0.0f)));
+	const Pack oldTimeCorrecting = Pack::load(&lanes.timeCorrecting[first]);
+	const Pack timeCorrecting = Pack::select(correcting, oldTimeCorrecting + deltaTime, Pack::set1(0.0f));
+	const Pack easeInTime = Pack::set1(0.25f);
+	Pack correction = errorAngle * (Pack::set1(1.0f) - exp2_pack(Pack::set1(0.0f) - deltaTime * Pack::set1(4.0f)));
+	correction = Pack::select(timeCorrecting < easeInTime, correction * (timeCorrecting / easeInTime), correction);
+	Pack cw, cx, cy, cz;
+	angle_axis(correction * Pack::set1(3.14159265f) / Pack::set1(180.0f), flattenedX, flattenedY, flattenedZ, cw, cx, cy, cz);
+	// a global rotation this time, so it goes on the other side
+	quat_multiply(cw, cx, cy, cz, w, x, y, z);
+	w = Pack::select(correcting, cw, w);
+	x = Pack::select(correcting, cx, x);
+	y = Pack::select(correcting, cy, y);
+	z = Pack::select(correcting, cz, z);
+
+	// gravity won't be shaky. accel might. so it's the quaternion's gravity that comes off the accelerometer
+	Pack gravX = Pack::set1(0.0f);
+	Pack gravY = Pack::set1(0.0f) - gravityLength;
+	Pack gravZ = Pack::set1(0.0f);
+	rotate(w, Pack::set1(0.0f) - x, Pack::set1(0.0f) - y, Pack::set1(0.0f) - z, gravX, gravY, gravZ);
+	const Mask newGravity = Pack::mask_and(active, hasAccel);
+	Pack::select(newGravity, gravX, Pack::load(&lanes.gravX[first])).store(&lanes.gravX[first]);
+	Pack::select(newGravity, gravY, Pack::load(&lanes.gravY[first])).store(&lanes.gravY[first]);
+	Pack::select(newGravity, gravZ, Pack::load(&lanes.gravZ[first])).store(&lanes.gravZ[first]);
+	// no accelerometer, no acceleration
+	const Pack outAccelX = Pack::select(hasAccel, accelX + gravX, Pack::set1(0.0f));
+	const Pack outAccelY = Pack::select(hasAccel, accelY + gravY, Pack::set1(0.0f));
+	const Pack outAccelZ = Pack::select(hasAccel, accelZ + gravZ, Pack::set1(0.0f));
+	Pack::select(active, outAccelX, Pack::load(&lanes.outAccelX[first])).store(&lanes.outAccelX[first]);
+	Pack::select(active, outAccelY, Pack::load(&lanes.outAccelY[first])).store(&lanes.outAccelY[first]);
+	Pack::select(active, outAccelZ, Pack::load(&lanes.outAccelZ[first])).store(&lanes.outAccelZ[first]);
+	Pack::select(active, timeCorrecting, oldTimeCorrecting).store(&lanes.timeCorrecting[first]);
+
+	quat_normalize(w, x, y, z);
+	Pack::select(active, w, oldW).store(&lanes.quatW[first]);
+	Pack::select(active, x, oldX).store(&lanes.quatX[first]);
+	Pack::select(active, y, oldY).store(&lanes.quatY[first]);
+	Pack::select(active, z, oldZ).store(&lanes.quatZ[first]);
+	Pack::set1(0.0f).store(&lanes.waiting[first]);
+}
+
+// every block with a sample waiting
+static void update_lanes(MotionLanes& lanes) {
+	for (int first = 0; first < lanes.capacity; first += Pack::width) {
+		bool waiting = false;
+		for (int i = 0; i < Pack::width; i++) {
+			waiting |= lanes.waiting[first + i] != 0.0f;
+		}
+		if (waiting) {
+			update_block(lanes, first);
+		}
+	}
+}
@@ -0,0 +1,211 @@
+// ReactorBench.cpp : compares a thread per device against the epoll reactor for reading controller reports.
+// Devices are simulated with pipes, each fed a 64-byte report every 4ms (250Hz, like a DS4), with their phases spread out like real devices'.
+// We report the CPU time and wakeups spent by whoever reads the reports. The simulated devices' own costs are subtracted.
+//
+// usage: jsl_reactor_bench [seconds per run]
+
+#include "../Reactor.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+static const int report_size = 64;
+static const auto report_interval = std::chrono::microseconds(4000);
+
+struct BenchResult {
+	unsigned long long reports = 0;
+	unsigned long long wakeups = 0;
+	double cpuSeconds = 0.0;
+	long contextSwitches = 0;
+};
+
+struct SimulatedDevice {
+	int readFd = -1;
+	int writeFd = -1;
+	unsigned long long reports = 0;
+	unsigned int checksum = 0;
+};
+
+static std::atomic<bool> _stop;
+
+static double ToSeconds(const timeval& tv) {
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void GetUsage(int who, double& cpuSeconds, long& contextSwitches) {
+	rusage usage;
+	getrusage(who, &usage);
+	cpuSeconds = ToSeconds(usage.ru_utime) + ToSeconds(usage.ru_stime);
+	contextSwitches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// stand-in for handle_input, so the reads aren't optimised away
+static void ConsumeReport(SimulatedDevice* device, const unsigned char* buf) {
+	unsigned int sum = 0;
+	for (int i = 0; i < report_size; i++) {
+		sum = sum * 31 + buf[i];
+	}
+	device->checksum += sum;
+	device->reports++;
+}
+
+static void ProduceReports(std::vector<SimulatedDevice>* devices, double* cpuSeconds, long* contextSwitches) {
+	unsigned char buf[report_size];
+	memset(buf, 0, report_size);
+	const int numDevices = (int)devices->size();
+	const auto start = std::chrono::steady_clock::now();
+	long long tick = 0;
+	while (!_stop) {
+		for (int i = 0; i < numDevices && !_stop; i++) {
+			std::this_thread::sleep_until(start + report_interval * tick + report_interval * i / numDevices);
+			buf[0] = 0x01;
+			buf[1] = (unsigned char)tick;
+			if (write((*devices)[i].writeFd, buf, report_size) < 0) {
+				// the reader fell behind and the pipe is full. a real device would drop the report too
+			}
+		}
+		tick++;
+	}
+	GetUsage(RUSAGE_THREAD, *cpuSeconds, *contextSwitches);
+}
+
+static void ThreadPerDeviceLoop(SimulatedDevice* device, std::atomic<unsigned long long>* wakeups) {
+	// same shape as pollIndividualLoop: hidapi's hid_read_timeout is a poll() followed by a read()
+	unsigned char buf[report_size];
+	pollfd fds = {};
+	fds.fd = device->readFd;
+	fds.events = POLLIN;
+	unsigned long long localWakeups = 0;
+	while (!_stop) {
+		int res = poll(&fds, 1, 1000);
+		localWakeups++;
+		if (res > 0 && read(device->readFd, buf, report_size) == report_size) {
+			ConsumeReport(device, buf);
+		}
+	}
+	wakeups->fetch_add(localWakeups);
+}
+
+static bool ReactorReadable(ReactorSource* source) {
+	SimulatedDevice* device = (SimulatedDevice*)source->context;
+	unsigned char buf[report_size];
+	while (read(device->readFd, buf, report_size) == report_size) {
+		ConsumeReport(device, buf);
+	}
+	return true;
+}
+
+static bool ReactorTimeout(ReactorSource* source) {
+	return true;
+}
+
+static BenchResult Run(int numDevices, int numReactorThreads, double seconds) {
+	std::vector<SimulatedDevice> devices(numDevices);
+	for (SimulatedDevice& device : devices) {
+		int fds[2];
+		if (pipe(fds) != 0) {
+			perror("pipe");
+			exit(1);
+		}
+		device.readFd = fds[0];
+		device.writeFd = fds[1];
+		fcntl(device.writeFd, F_SETFL, O_NONBLOCK);
+		if (numReactorThreads > 0) {
+			fcntl(device.readFd, F_SETFL, O_NONBLOCK);
+		}
+	}
+
+	_stop = false;
+	std::atomic<unsigned long long> wakeups(0);
+	std::vector<Reactor*> reactors;
+	std::vector<std::thread*> threads;
+
+	double startCpu, producerCpu = 0.0;
+	long startSwitches, producerSwitches = 0;
+	GetUsage(RUSAGE_SELF, startCpu, startSwitches);
+
+	if (numReactorThreads > 0) {
+		for (int i = 0; i < numReactorThreads; i++) {
+			reactors.push_back(new Reactor(ReactorReadable, ReactorTimeout, 1000));
+		}
+		for (int i = 0; i < numDevices; i++) {
+			reactors[i % numReactorThreads]->add(devices[i].readFd, &devices[i]);
+		}
+		for (Reactor* reactor : reactors) {
+			if (!reactor->start()) {
+				fprintf(stderr, "could not start reactor\n");
+				exit(1);
+			}
+		}
+	}
+	else {
+		for (SimulatedDevice& device : devices) {
+			threads.push_back(new std::thread(ThreadPerDeviceLoop, &device, &wakeups));
+		}
+	}
+	std::thread producer(ProduceReports, &devices, &producerCpu, &producerSwitches);
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	_stop = true;
+	producer.join();
+	for (Reactor* reactor : reactors) {
+		reactor->stop();
+		wakeups += reactor->wakeups;
+	}
+	for (std::thread* thread : threads) {
+		thread->join();
+		delete thread;
+	}
+
+	double endCpu;
+	long endSwitches;
+	GetUsage(RUSAGE_SELF, endCpu, endSwitches);
+
+	BenchResult result;
+	result.cpuSeconds = endCpu - startCpu - producerCpu;
+	result.contextSwitches = endSwitches - startSwitches - producerSwitches;
+	result.wakeups = wakeups;
+	for (SimulatedDevice& device : devices) {
+		result.reports += device.reports;
+		close(device.readFd);
+		close(device.writeFd);
+	}
+	for (Reactor* reactor : reactors) {
+		delete reactor;
+	}
+	return result;
+}
+
+static void Print(const char* mode, int numDevices, double seconds, const BenchResult& result) {
+	printf("%-18s %8d %10llu %10.1f %14.2f %10llu %14ld\n",
+		mode, numDevices, result.reports,
+		result.cpuSeconds * 1000.0,
+		result.reports > 0 ? result.cpuSeconds * 1000000.0 / result.reports : 0.0,
+		result.wakeups,
+		result.contextSwitches);
+}
+
+int main(int argc, char** argv) {
+	double seconds = argc > 1 ? atof(argv[1]) : 3.0;
+	if (seconds <= 0.0) {
+		seconds = 3.0;
+	}
+	if (!Reactor::is_supported()) {
+		fprintf(stderr, "the reactor isn't supported on this platform\n");
+		return 1;
+	}
+
+	printf("%.1f seconds per run, %d Hz per device\n", seconds, (int)(1000000 / report_interval.count()));
+	printf("%-18s %8s %10s %10s %14s %10s %14s\n", "mode", "devices", "reports", "cpu ms", "cpu us/report", "wakeups", "ctx switches");
+	const int deviceCounts[] = { 1, 8, 64 };
+	for (int numDevices : deviceCounts) {
+		Print("thread-per-device", numDevices, seconds, Run(numDevices, 0, seconds));
+		Print("reactor", numDevices, seconds, Run(numDevices, 1, seconds));
+	}
+	return 0;
+}